@@ -10,6 +10,7 @@ typedef struct redisAeEvents {
     aeEventLoop *loop;
     int fd;
     int reading, writing;
+    long long timer; /* Id of the pending timer, -1 when there is none */
 } redisAeEvents;
 
 static void redisAeReadEvent(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -26,6 +27,15 @@ static void redisAeWriteEvent(aeEventLoop *el, int fd, void *privdata, int mask)
     redisAsyncHandleWrite(e->context);
 }
 
+static int redisAeTimerEvent(aeEventLoop *el, long long id, void *privdata) {
+    ((void)el); ((void)id);
+
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    e->timer = -1;
+    redisAsyncHandleTimer(e->context);
+    return AE_NOMORE;
+}
+
 static void redisAeAddRead(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     aeEventLoop *loop = e->loop;
@@ -62,10 +72,20 @@ static void redisAeDelWrite(void *privdata) {
     }
 }
 
+static void redisAeScheduleTimer(void *privdata, long long usec) {
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    aeEventLoop *loop = e->loop;
+    if (e->timer != -1)
+        aeDeleteTimeEvent(loop,e->timer);
+    e->timer = aeCreateTimeEvent(loop,(usec+999)/1000,redisAeTimerEvent,e,NULL);
+}
+
 static void redisAeCleanup(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     redisAeDelRead(privdata);
     redisAeDelWrite(privdata);
+    if (e->timer != -1)
+        aeDeleteTimeEvent(e->loop,e->timer);
     free(e);
 }
 
@@ -83,6 +103,7 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     e->loop = loop;
     e->fd = c->fd;
     e->reading = e->writing = 0;
+    e->timer = -1;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisAeAddRead;
@@ -90,6 +111,7 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     ac->ev.addWrite = redisAeAddWrite;
     ac->ev.delWrite = redisAeDelWrite;
     ac->ev.cleanup = redisAeCleanup;
+    ac->ev.scheduleTimer = redisAeScheduleTimer;
     ac->ev.data = e;
 
     return REDIS_OK;
@@ -6,7 +6,7 @@
 
 typedef struct redisLibeventEvents {
     redisAsyncContext *context;
-    struct event rev, wev;
+    struct event rev, wev, tev;
 } redisLibeventEvents;
 
 static void redisLibeventReadEvent(int fd, short event, void *arg) {
@@ -21,6 +21,12 @@ static void redisLibeventWriteEvent(int fd, short event, void *arg) {
     redisAsyncHandleWrite(e->context);
 }
 
+static void redisLibeventTimerEvent(int fd, short event, void *arg) {
+    ((void)fd); ((void)event);
+    redisLibeventEvents *e = (redisLibeventEvents*)arg;
+    redisAsyncHandleTimer(e->context);
+}
+
 static void redisLibeventAddRead(void *privdata) {
     redisLibeventEvents *e = (redisLibeventEvents*)privdata;
     event_add(&e->rev,NULL);
@@ -41,10 +47,19 @@ static void redisLibeventDelWrite(void *privdata) {
     event_del(&e->wev);
 }
 
+static void redisLibeventScheduleTimer(void *privdata, long long usec) {
+    redisLibeventEvents *e = (redisLibeventEvents*)privdata;
+    struct timeval tv;
+    tv.tv_sec = usec/1000000;
+    tv.tv_usec = usec%1000000;
+    event_add(&e->tev,&tv);
+}
+
 static void redisLibeventCleanup(void *privdata) {
     redisLibeventEvents *e = (redisLibeventEvents*)privdata;
     event_del(&e->rev);
     event_del(&e->wev);
+    event_del(&e->tev);
     free(e);
 }
 
@@ -66,13 +81,16 @@ static int redisLibeventAttach(redisAsyncContext *ac, struct event_base *base) {
     ac->ev.addWrite = redisLibeventAddWrite;
     ac->ev.delWrite = redisLibeventDelWrite;
     ac->ev.cleanup = redisLibeventCleanup;
+    ac->ev.scheduleTimer = redisLibeventScheduleTimer;
     ac->ev.data = e;
 
-    /* Initialize and install read/write events */
+    /* Initialize and install read/write events and the timer */
     event_set(&e->rev,c->fd,EV_READ,redisLibeventReadEvent,e);
     event_set(&e->wev,c->fd,EV_WRITE,redisLibeventWriteEvent,e);
+    evtimer_set(&e->tev,redisLibeventTimerEvent,e);
     event_base_set(base,&e->rev);
     event_base_set(base,&e->wev);
+    event_base_set(base,&e->tev);
     return REDIS_OK;
 }
 #endif
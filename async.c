@@ -120,9 +120,11 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     ac->ev.addWrite = NULL;
     ac->ev.delWrite = NULL;
     ac->ev.cleanup = NULL;
+    ac->ev.scheduleTimer = NULL;
 
     ac->onConnect = NULL;
     ac->onDisconnect = NULL;
+    ac->onTimer = NULL;
 
     ac->replies.head = NULL;
     ac->replies.tail = NULL;
@@ -176,6 +178,20 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
     return REDIS_ERR;
 }
 
+int redisAsyncSetTimerCallback(redisAsyncContext *ac, redisTimerCallback *fn) {
+    ac->onTimer = fn;
+    return REDIS_OK;
+}
+
+/* Have onTimer called once, usec microseconds from now. Fails when the event
+ * library has no timers. */
+int redisAsyncScheduleTimer(redisAsyncContext *ac, long long usec) {
+    if (ac->ev.scheduleTimer == NULL)
+        return REDIS_ERR;
+    ac->ev.scheduleTimer(ac->ev.data,usec);
+    return REDIS_OK;
+}
+
 /* Helper functions to push/shift callbacks */
 static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
     redisCallback *cb;
@@ -509,6 +525,21 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
     }
 }
 
+void redisAsyncHandleTimer(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    if (ac->onTimer == NULL)
+        return;
+
+    c->flags |= REDIS_IN_CALLBACK;
+    ac->onTimer(ac);
+    c->flags &= ~REDIS_IN_CALLBACK;
+
+    /* Proceed with free'ing when redisAsyncFree() was called. */
+    if (c->flags & REDIS_FREEING)
+        __redisAsyncFree(ac);
+}
+
 /* Sets a pointer to the first argument and its length starting at p. Returns
  * the number of bytes to skip to get to the following argument. */
 static char *nextArgument(char *start, char **str, size_t *len) {
@@ -620,3 +651,9 @@ int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *priv
     free(cmd);
     return status;
 }
+
+/* Like redisAsyncCommand, for a command that is already in the protocol
+ * format, e.g. built by redisFormatCommand. */
+int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len) {
+    return __redisAsyncCommand(ac,fn,privdata,(char*)cmd,len);
+}
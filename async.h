@@ -57,6 +57,9 @@ typedef struct redisCallbackList {
 typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int status);
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
 
+/* Timer callback prototype, see redisAsyncScheduleTimer */
+typedef void (redisTimerCallback)(struct redisAsyncContext*);
+
 /* Context for an async connection to Redis */
 typedef struct redisAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -80,6 +83,11 @@ typedef struct redisAsyncContext {
         void (*addWrite)(void *privdata);
         void (*delWrite)(void *privdata);
         void (*cleanup)(void *privdata);
+
+        /* Optional hook that arranges for redisAsyncHandleTimer to be
+         * called once, usec microseconds from now. Scheduling again
+         * replaces the pending timer. */
+        void (*scheduleTimer)(void *privdata, long long usec);
     } ev;
 
     /* Called when either the connection is terminated due to an error or per
@@ -89,6 +97,9 @@ typedef struct redisAsyncContext {
     /* Called when the first write event was received. */
     redisConnectCallback *onConnect;
 
+    /* Called when a timer set with redisAsyncScheduleTimer fires. */
+    redisTimerCallback *onTimer;
+
     /* Regular command callbacks */
     redisCallbackList replies;
 
@@ -105,18 +116,22 @@ redisAsyncContext *redisAsyncConnect(const char *ip, int port);
 redisAsyncContext *redisAsyncConnectUnix(const char *path);
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn);
 int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallback *fn);
+int redisAsyncSetTimerCallback(redisAsyncContext *ac, redisTimerCallback *fn);
+int redisAsyncScheduleTimer(redisAsyncContext *ac, long long usec);
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
 void redisAsyncHandleWrite(redisAsyncContext *ac);
+void redisAsyncHandleTimer(redisAsyncContext *ac);
 
 /* Command functions for an async context. Write the command to the
  * output buffer and register the provided callback. */
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...);
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len);
 
 #ifdef __cplusplus
 }
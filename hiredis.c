@@ -36,6 +36,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 #include "hiredis.h"
 #include "net.h"
@@ -46,6 +51,28 @@ static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
 static void *createNilObject(const redisReadTask *task);
 
+/* Read buffer shared by the reader and the zero-copy replies pointing into
+ * it. Whoever drops the last reference frees it. */
+typedef struct redisReaderBuffer {
+    int refcount;
+    char *buf;
+} redisReaderBuffer;
+
+#if defined(__GNUC__)
+#define refcountIncr(_v) __sync_add_and_fetch(&(_v),1)
+#define refcountDecr(_v) __sync_sub_and_fetch(&(_v),1)
+#else
+#define refcountIncr(_v) (++(_v))
+#define refcountDecr(_v) (--(_v))
+#endif
+
+static void releaseReaderBuffer(redisReaderBuffer *b) {
+    if (refcountDecr(b->refcount) == 0) {
+        free(b->buf);
+        free(b);
+    }
+}
+
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as OOM. */
 static redisReplyObjectFunctions defaultFunctions = {
@@ -56,6 +83,92 @@ static redisReplyObjectFunctions defaultFunctions = {
     freeReplyObject
 };
 
+/* Reply nodes of redisPooledFunctions are recycled through bounded
+ * per-thread free lists instead of going back to malloc for every reply.
+ * Strings shorter than REDIS_REPLY_INLINE bytes are stored right after their
+ * node, in the same allocation. Both sizes have their own list. The flags of
+ * a node tell freeReplyObject where it came from. */
+#if defined(__GNUC__) && !defined(HIREDIS_NO_REPLY_POOL)
+#define HIREDIS_REPLY_POOL
+#endif
+
+#define REDIS_REPLY_INLINE 40
+#define REDIS_REPLY_POOL_SIZE 64 /* Free nodes kept per size and thread. */
+
+#ifdef HIREDIS_REPLY_POOL
+typedef struct redisReplyPool {
+    void *head;
+    int count;
+} redisReplyPool;
+
+static __thread redisReplyPool replyPool[2]; /* Plain and with inline string */
+static __thread int replyPoolRegistered;
+
+/* The nodes of a thread are freed when it exits. */
+static pthread_once_t replyPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t replyPoolKey;
+static int replyPoolKeyValid = 0;
+
+static void replyPoolDestroy(void *unused) {
+    (void)unused;
+    redisReplyPoolRelease();
+}
+
+static void replyPoolKeyCreate(void) {
+    if (pthread_key_create(&replyPoolKey,replyPoolDestroy) == 0)
+        replyPoolKeyValid = 1;
+}
+
+static void *replyPoolGet(int inl, size_t size) {
+    redisReplyPool *pool = &replyPool[inl];
+    void *p = pool->head;
+
+    if (p == NULL)
+        return malloc(size);
+    pool->head = *(void**)p;
+    pool->count--;
+    return p;
+}
+
+static void replyPoolPut(int inl, void *p) {
+    redisReplyPool *pool = &replyPool[inl];
+
+    if (pool->count == REDIS_REPLY_POOL_SIZE) {
+        free(p);
+        return;
+    }
+    if (!replyPoolRegistered) {
+        pthread_once(&replyPoolOnce,replyPoolKeyCreate);
+        if (replyPoolKeyValid)
+            pthread_setspecific(replyPoolKey,replyPool);
+        replyPoolRegistered = 1;
+    }
+    *(void**)p = pool->head;
+    pool->head = p;
+    pool->count++;
+}
+#else
+#define replyPoolGet(_inl,_size) malloc(_size)
+#define replyPoolPut(_inl,_p) free(_p)
+#endif
+
+/* Free the reply nodes pooled by the calling thread. This is done when the
+ * thread exits, calling it earlier only gives the memory back sooner. */
+void redisReplyPoolRelease(void) {
+#ifdef HIREDIS_REPLY_POOL
+    int i;
+    void *p;
+
+    for (i = 0; i < 2; i++) {
+        while ((p = replyPool[i].head) != NULL) {
+            replyPool[i].head = *(void**)p;
+            free(p);
+        }
+        replyPool[i].count = 0;
+    }
+#endif
+}
+
 /* Create a reply object */
 redisReply *createReplyObject(int type) {
     redisReply *r = calloc(1,sizeof(*r));
@@ -86,11 +199,18 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
-        if (r->str != NULL)
+        if (r->flags & REDIS_REPLY_STR_INLINE)
+            break;
+        else if (r->buffer != NULL)
+            releaseReaderBuffer(r->buffer);
+        else if (r->str != NULL)
             free(r->str);
         break;
     }
-    free(r);
+    if (r->flags & REDIS_REPLY_POOLED)
+        replyPoolPut((r->flags & REDIS_REPLY_STR_INLINE) != 0,r);
+    else
+        free(r);
 }
 
 static void *createStringObject(const redisReadTask *task, char *str, size_t len) {
@@ -140,46 +260,761 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
         }
     }
 
-    r->elements = elements;
+    r->elements = elements;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createIntegerObject(const redisReadTask *task, long long value) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_INTEGER);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createNilObject(const redisReadTask *task) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_NIL);
+    if (r == NULL)
+        return NULL;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+/* Create a string reply pointing into the read buffer instead of copying the
+ * payload. The buffer is pinned: the reader won't move or reuse it anymore
+ * and continues with a fresh buffer on the next feed. */
+static void *createStringRefObject(redisReader *rd, const redisReadTask *task, char *str, size_t len) {
+    redisReaderBuffer *b = rd->pinned;
+    redisReply *r, *parent;
+
+    if (b == NULL) {
+        b = malloc(sizeof(*b));
+        if (b == NULL)
+            return NULL;
+        b->refcount = 1; /* Reference of the reader */
+        b->buf = rd->buf;
+        rd->pinned = b;
+    }
+
+    r = createReplyObject(task->type);
+    if (r == NULL)
+        return NULL;
+
+    /* The \r of the trailing \r\n has been consumed and becomes the
+     * terminator of the string. */
+    str[len] = '\0';
+    r->str = str;
+    r->len = len;
+    r->buffer = b;
+    refcountIncr(b->refcount);
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static redisReply *createPooledObject(const redisReadTask *task, int type, int inl) {
+    redisReply *r, *parent;
+
+    r = replyPoolGet(inl,sizeof(*r)+(inl ? REDIS_REPLY_INLINE : 0));
+    if (r == NULL)
+        return NULL;
+
+    memset(r,0,sizeof(*r));
+    r->type = type;
+    r->flags = REDIS_REPLY_POOLED | (inl ? REDIS_REPLY_STR_INLINE : 0);
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createPooledStringObject(const redisReadTask *task, char *str, size_t len) {
+    int inl = len < REDIS_REPLY_INLINE;
+    redisReply *r;
+    char *buf;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING);
+
+    if (inl) {
+        r = createPooledObject(task,task->type,1);
+        if (r == NULL)
+            return NULL;
+        buf = (char*)(r+1);
+    } else {
+        buf = malloc(len+1);
+        if (buf == NULL)
+            return NULL;
+        r = createPooledObject(task,task->type,0);
+        if (r == NULL) {
+            free(buf);
+            return NULL;
+        }
+    }
+
+    /* Copy string value */
+    memcpy(buf,str,len);
+    buf[len] = '\0';
+    r->str = buf;
+    r->len = len;
+    return r;
+}
+
+static void *createPooledArrayObject(const redisReadTask *task, int elements) {
+    redisReply **element = NULL;
+    redisReply *r;
+
+    if (elements > 0) {
+        element = calloc(elements,sizeof(redisReply*));
+        if (element == NULL)
+            return NULL;
+    }
+
+    r = createPooledObject(task,REDIS_REPLY_ARRAY,0);
+    if (r == NULL) {
+        free(element);
+        return NULL;
+    }
+
+    r->element = element;
+    r->elements = elements;
+    return r;
+}
+
+static void *createPooledIntegerObject(const redisReadTask *task, long long value) {
+    redisReply *r;
+
+    r = createPooledObject(task,REDIS_REPLY_INTEGER,0);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value;
+    return r;
+}
+
+static void *createPooledNilObject(const redisReadTask *task) {
+    return createPooledObject(task,REDIS_REPLY_NIL,0);
+}
+
+/* Pooled nodes are recognized by freeReplyObject, trees can even mix them
+ * with default ones. */
+void freePooledReplyObject(void *reply) {
+    freeReplyObject(reply);
+}
+
+redisReplyObjectFunctions redisPooledFunctions = {
+    createPooledStringObject,
+    createPooledArrayObject,
+    createPooledIntegerObject,
+    createPooledNilObject,
+    freePooledReplyObject
+};
+
+/* Arena allocated replies. The root reply lives in the header of the first
+ * chunk; every other object of the tree is carved from the chunks, so the
+ * whole tree is released by freeArenaReplyObject in one go. */
+#define REDIS_ARENA_ALIGN 8
+#define REDIS_ARENA_MIN_CHUNK 512
+#define REDIS_ARENA_MAX_CHUNK (1024*1024)
+
+typedef struct redisArenaChunk {
+    struct redisArenaChunk *next;
+} redisArenaChunk;
+
+typedef struct redisArena {
+    char *pos; /* Free space in the current chunk */
+    char *end;
+    size_t next; /* Size of the next chunk */
+    redisArenaChunk *chunks; /* Chunks allocated after the first one */
+    redisReply reply; /* Root of the reply tree */
+} redisArena;
+
+#define ARENA_ALIGNED(_n) (((_n)+REDIS_ARENA_ALIGN-1) & ~(size_t)(REDIS_ARENA_ALIGN-1))
+#define ARENA_HDR ARENA_ALIGNED(sizeof(redisArena))
+#define ARENA_CHUNK_HDR ARENA_ALIGNED(sizeof(redisArenaChunk))
+
+static void *arenaAlloc(redisArena *a, size_t size) {
+    redisArenaChunk *chunk;
+    size_t chunksize;
+    char *p;
+
+    size = ARENA_ALIGNED(size);
+    if ((size_t)(a->end-a->pos) < size) {
+        /* Objects larger than the next chunk get a chunk of their own, so
+         * the free space of the current one can still be used. */
+        chunksize = size > a->next ? size : a->next;
+        chunk = malloc(ARENA_CHUNK_HDR+chunksize);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        p = (char*)chunk+ARENA_CHUNK_HDR;
+        if (chunksize == size)
+            return p;
+
+        a->pos = p;
+        a->end = p+chunksize;
+        if (a->next < REDIS_ARENA_MAX_CHUNK)
+            a->next *= 2;
+    }
+
+    p = a->pos;
+    a->pos += size;
+    return p;
+}
+
+/* Allocate a reply object for a task. The arena is created together with the
+ * root object and found from any task by walking up to the root. */
+static redisReply *createArenaObject(const redisReadTask *task, int type, redisArena **arena) {
+    const redisReadTask *root = task;
+    redisReply *r, *parent;
+    redisArena *a;
+
+    if (task->parent == NULL) {
+        a = malloc(ARENA_HDR+REDIS_ARENA_MIN_CHUNK);
+        if (a == NULL)
+            return NULL;
+        a->pos = (char*)a+ARENA_HDR;
+        a->end = a->pos+REDIS_ARENA_MIN_CHUNK;
+        a->next = REDIS_ARENA_MIN_CHUNK*2;
+        a->chunks = NULL;
+        r = &a->reply;
+    } else {
+        while (root->parent != NULL)
+            root = root->parent;
+        a = (redisArena*)((char*)root->obj-offsetof(redisArena,reply));
+        r = arenaAlloc(a,sizeof(*r));
+        if (r == NULL)
+            return NULL;
+
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+
+    memset(r,0,sizeof(*r));
+    r->type = type;
+    *arena = a;
+    return r;
+}
+
+static void *createArenaStringObject(const redisReadTask *task, char *str, size_t len) {
+    redisArena *a;
+    redisReply *r;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING);
+
+    r = createArenaObject(task,task->type,&a);
+    if (r == NULL)
+        return NULL;
+
+    r->str = arenaAlloc(a,len+1);
+    if (r->str == NULL) {
+        /* Children are released with the root by the reader. */
+        if (task->parent == NULL)
+            freeArenaReplyObject(r);
+        return NULL;
+    }
+
+    /* Copy string value */
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    return r;
+}
+
+static void *createArenaArrayObject(const redisReadTask *task, int elements) {
+    redisArena *a;
+    redisReply *r;
+
+    r = createArenaObject(task,REDIS_REPLY_ARRAY,&a);
+    if (r == NULL)
+        return NULL;
+
+    if (elements > 0) {
+        r->element = arenaAlloc(a,elements*sizeof(redisReply*));
+        if (r->element == NULL) {
+            if (task->parent == NULL)
+                freeArenaReplyObject(r);
+            return NULL;
+        }
+        memset(r->element,0,elements*sizeof(redisReply*));
+    }
+
+    r->elements = elements;
+    return r;
+}
+
+static void *createArenaIntegerObject(const redisReadTask *task, long long value) {
+    redisArena *a;
+    redisReply *r;
+
+    r = createArenaObject(task,REDIS_REPLY_INTEGER,&a);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = value;
+    return r;
+}
+
+static void *createArenaNilObject(const redisReadTask *task) {
+    redisArena *a;
+    return createArenaObject(task,REDIS_REPLY_NIL,&a);
+}
+
+/* Free a reply created with redisArenaFunctions. Only the root of the tree
+ * can be free'd. */
+void freeArenaReplyObject(void *reply) {
+    redisArena *a = (redisArena*)((char*)reply-offsetof(redisArena,reply));
+    redisArenaChunk *chunk = a->chunks, *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(a);
+}
+
+redisReplyObjectFunctions redisArenaFunctions = {
+    createArenaStringObject,
+    createArenaArrayObject,
+    createArenaIntegerObject,
+    createArenaNilObject,
+    freeArenaReplyObject
+};
+
+/* Compact replies: every node is 32 bytes, elements live in a vector owned by
+ * their array, so only the root and arrays are separate allocations. */
+typedef char redisCompactReplySize[sizeof(redisCompactReply) == 32 ? 1 : -1];
+
+static redisCompactReply *createCompactObject(const redisReadTask *task, int type) {
+    redisCompactReply *r, *parent;
+
+    if (task->parent == NULL) {
+        r = malloc(sizeof(*r));
+        if (r == NULL)
+            return NULL;
+    } else {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        r = &parent->u.element[task->idx];
+    }
+
+    r->type = type;
+    r->flags = 0;
+    r->len = 0;
+    return r;
+}
+
+static void *createCompactStringObject(const redisReadTask *task, char *str, size_t len) {
+    redisCompactReply *r;
+    char *dst;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING);
+
+    if (len > UINT32_MAX)
+        return NULL;
+
+    r = createCompactObject(task,task->type);
+    if (r == NULL)
+        return NULL;
+
+    if (len < REDIS_COMPACT_INLINE) {
+        r->flags |= REDIS_COMPACT_STR_INLINE;
+        dst = r->u.buf;
+    } else {
+        dst = malloc(len+1);
+        if (dst == NULL) {
+            /* Elements are released with the root by the reader. */
+            if (task->parent == NULL)
+                free(r);
+            else
+                r->type = REDIS_REPLY_NIL;
+            return NULL;
+        }
+        r->u.str = dst;
+    }
+
+    /* Copy string value */
+    memcpy(dst,str,len);
+    dst[len] = '\0';
+    r->len = len;
+    return r;
+}
+
+static void *createCompactArrayObject(const redisReadTask *task, int elements) {
+    redisCompactReply *r, *element = NULL;
+    int j;
+
+    if (elements > 0) {
+        element = malloc(elements*sizeof(*element));
+        if (element == NULL)
+            return NULL;
+        /* Elements not received yet are free'd as nil on errors. */
+        for (j = 0; j < elements; j++)
+            element[j].type = REDIS_REPLY_NIL;
+    }
+
+    r = createCompactObject(task,REDIS_REPLY_ARRAY);
+    if (r == NULL) {
+        free(element);
+        return NULL;
+    }
+
+    r->len = elements;
+    r->u.element = element;
+    return r;
+}
+
+static void *createCompactIntegerObject(const redisReadTask *task, long long value) {
+    redisCompactReply *r;
+
+    r = createCompactObject(task,REDIS_REPLY_INTEGER);
+    if (r == NULL)
+        return NULL;
+
+    r->u.integer = value;
+    return r;
+}
+
+static void *createCompactNilObject(const redisReadTask *task) {
+    return createCompactObject(task,REDIS_REPLY_NIL);
+}
+
+/* Free what a node owns, but not the node itself. */
+static void freeCompactNode(redisCompactReply *r) {
+    size_t j;
+
+    switch(r->type) {
+    case REDIS_REPLY_ARRAY:
+        for (j = 0; j < r->len; j++)
+            freeCompactNode(&r->u.element[j]);
+        free(r->u.element);
+        break;
+    case REDIS_REPLY_ERROR:
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_STRING:
+        if (!(r->flags & REDIS_COMPACT_STR_INLINE))
+            free(r->u.str);
+        break;
+    }
+}
+
+/* Free a reply created with redisCompactFunctions. */
+void freeCompactReplyObject(void *reply) {
+    redisCompactReply *r = reply;
+
+    if (r == NULL)
+        return;
+    freeCompactNode(r);
+    free(r);
+}
+
+redisReplyObjectFunctions redisCompactFunctions = {
+    createCompactStringObject,
+    createCompactArrayObject,
+    createCompactIntegerObject,
+    createCompactNilObject,
+    freeCompactReplyObject
+};
+
+/* Streaming replies: the object functions below hand every item to the
+ * callbacks of the reader instead of building a tree. The reader is found
+ * from the task, which always lives in its task stack. */
+static redisReader *streamReader(const redisReadTask *task, int *depth) {
+    const redisReadTask *root = task;
+
+    *depth = 0;
+    while (root->parent != NULL) {
+        root = root->parent;
+        (*depth)++;
+    }
+    return (redisReader*)((char*)root-offsetof(redisReader,rstack));
+}
+
+static void *createStreamString(const redisReadTask *task, char *str, size_t len) {
+    int depth;
+    redisReader *r = streamReader(task,&depth);
+
+    if (r->callbacks->string)
+        r->callbacks->string(r->privdata,depth,task->type,str,len);
+    return (void*)(size_t)task->type;
+}
+
+static void *createStreamArray(const redisReadTask *task, int elements) {
+    int depth;
+    redisReader *r = streamReader(task,&depth);
+
+    if (r->callbacks->beginArray)
+        r->callbacks->beginArray(r->privdata,depth,elements);
+    return (void*)REDIS_REPLY_ARRAY;
+}
+
+static void *createStreamInteger(const redisReadTask *task, long long value) {
+    int depth;
+    redisReader *r = streamReader(task,&depth);
+
+    if (r->callbacks->integer)
+        r->callbacks->integer(r->privdata,depth,value);
+    return (void*)REDIS_REPLY_INTEGER;
+}
+
+static void *createStreamNil(const redisReadTask *task) {
+    int depth;
+    redisReader *r = streamReader(task,&depth);
+
+    if (r->callbacks->nil)
+        r->callbacks->nil(r->privdata,depth);
+    return (void*)REDIS_REPLY_NIL;
+}
+
+static redisReplyObjectFunctions streamFunctions = {
+    createStreamString,
+    createStreamArray,
+    createStreamInteger,
+    createStreamNil,
+    NULL
+};
+
+static void streamEndArray(redisReader *r, int depth) {
+    if (r->fn == &streamFunctions && r->callbacks->endArray)
+        r->callbacks->endArray(r->privdata,depth);
+}
+
+/* Create a columnar reply with room for slots values. */
+redisColumns *redisColumnsCreate(int type, size_t slots) {
+    redisColumns *c;
+    size_t bitmap = (slots+7)/8;
+
+    c = calloc(1,sizeof(*c)+slots*2*sizeof(size_t)+bitmap);
+    if (c == NULL)
+        return NULL;
+
+    c->type = type;
+    c->slots = slots;
+    c->offset = (size_t*)(c+1);
+    c->len = c->offset+slots;
+    c->nil = (unsigned char*)(c->len+slots);
+    return c;
+}
+
+/* Append a value to the payload buffer of c. */
+int redisColumnsAppend(redisColumns *c, const char *str, size_t len) {
+    size_t cap;
+    char *data;
+
+    assert(c->count < c->slots);
+    if (c->size+len+1 > c->cap) {
+        cap = c->cap ? c->cap*2 : 64;
+        while (cap < c->size+len+1)
+            cap *= 2;
+        data = realloc(c->data,cap);
+        if (data == NULL)
+            return REDIS_ERR;
+        c->data = data;
+        c->cap = cap;
+    }
+
+    memcpy(c->data+c->size,str,len);
+    c->data[c->size+len] = '\0';
+    c->offset[c->count] = c->size;
+    c->len[c->count] = len;
+    c->size += len+1;
+    c->count++;
+    return REDIS_OK;
+}
+
+void redisColumnsAppendNil(redisColumns *c) {
+    assert(c->count < c->slots);
+    c->nil[c->count/8] |= 1<<(c->count%8);
+    c->offset[c->count] = c->size;
+    c->len[c->count] = 0;
+    c->count++;
+}
+
+void freeColumnsObject(void *reply) {
+    redisColumns *c = reply;
+
+    if (c == NULL)
+        return;
+    free(c->data);
+    free(c);
+}
+
+/* The columns an element of an array belongs to. Only flat arrays can be
+ * decoded. */
+static redisColumns *columnsOfElement(const redisReadTask *task) {
+    if (task->parent->parent != NULL)
+        return NULL;
+    return task->parent->obj;
+}
+
+static void *createColumnsString(const redisReadTask *task, char *str, size_t len) {
+    redisColumns *c;
+
+    if (task->parent == NULL) {
+        c = redisColumnsCreate(task->type,1);
+        if (c == NULL)
+            return NULL;
+        if (redisColumnsAppend(c,str,len) != REDIS_OK) {
+            freeColumnsObject(c);
+            return NULL;
+        }
+        return c;
+    }
+
+    c = columnsOfElement(task);
+    if (c == NULL || redisColumnsAppend(c,str,len) != REDIS_OK)
+        return NULL;
+    return c;
+}
+
+static void *createColumnsArray(const redisReadTask *task, int elements) {
+    if (task->parent != NULL)
+        return NULL;
+    return redisColumnsCreate(REDIS_REPLY_ARRAY,elements);
+}
 
-    if (task->parent) {
-        parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
-        parent->element[task->idx] = r;
+static void *createColumnsInteger(const redisReadTask *task, long long value) {
+    redisColumns *c;
+    char buf[21];
+    int len;
+
+    if (task->parent == NULL) {
+        c = redisColumnsCreate(REDIS_REPLY_INTEGER,0);
+        if (c != NULL)
+            c->integer = value;
+        return c;
     }
-    return r;
+
+    /* Integer elements are stored as their decimal representation. */
+    c = columnsOfElement(task);
+    len = snprintf(buf,sizeof(buf),"%lld",value);
+    if (c == NULL || redisColumnsAppend(c,buf,len) != REDIS_OK)
+        return NULL;
+    return c;
 }
 
-static void *createIntegerObject(const redisReadTask *task, long long value) {
-    redisReply *r, *parent;
+static void *createColumnsNil(const redisReadTask *task) {
+    redisColumns *c;
 
-    r = createReplyObject(REDIS_REPLY_INTEGER);
-    if (r == NULL)
-        return NULL;
+    if (task->parent == NULL)
+        return redisColumnsCreate(REDIS_REPLY_NIL,0);
 
-    r->integer = value;
+    c = columnsOfElement(task);
+    if (c != NULL)
+        redisColumnsAppendNil(c);
+    return c;
+}
 
-    if (task->parent) {
-        parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
-        parent->element[task->idx] = r;
+redisReplyObjectFunctions redisColumnarFunctions = {
+    createColumnsString,
+    createColumnsArray,
+    createColumnsInteger,
+    createColumnsNil,
+    freeColumnsObject
+};
+
+/* Drop the reference of the reader to its buffer. */
+static void __redisReaderFreeBuffer(redisReader *r) {
+    if (r->pinned != NULL) {
+        releaseReaderBuffer(r->pinned);
+        r->pinned = NULL;
+    } else if (r->buf != NULL) {
+        free(r->buf);
     }
-    return r;
+    r->buf = NULL;
+    r->pos = r->len = r->cap = 0;
 }
 
-static void *createNilObject(const redisReadTask *task) {
-    redisReply *r, *parent;
+/* Make room for at least len bytes after the write cursor. Consumed bytes
+ * are only reclaimed here, when the room runs out, by moving the unconsumed
+ * part to the front; parsing itself never moves data. */
+static int __redisReaderMakeRoom(redisReader *r, size_t len) {
+    size_t used = r->len-r->pos;
+    size_t newcap;
+    char *newbuf;
+
+    /* Release a large buffer once everything in it was consumed. */
+    if (used == 0 && r->pinned == NULL && r->maxbuf != 0 && r->cap > r->maxbuf &&
+        len <= r->maxbuf)
+        __redisReaderFreeBuffer(r);
+
+    /* Appending is fine even when replies point into the buffer. */
+    if (r->cap-r->len >= len)
+        return REDIS_OK;
 
-    r = createReplyObject(REDIS_REPLY_NIL);
-    if (r == NULL)
-        return NULL;
+    if (r->pinned == NULL) {
+        if (r->cap-used >= len) {
+            memmove(r->buf,r->buf+r->pos,used);
+            r->pos = 0;
+            r->len = used;
+            return REDIS_OK;
+        }
+    }
 
-    if (task->parent) {
-        parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
-        parent->element[task->idx] = r;
+    /* A pinned buffer is left to its replies: the next one only needs to
+     * hold the unconsumed part. */
+    newcap = r->pinned ? 0 : r->cap*2;
+    if (newcap < used+len)
+        newcap = used+len;
+    if (newcap < REDIS_READER_MIN_BUF)
+        newcap = REDIS_READER_MIN_BUF;
+
+    if (r->pos == 0 && r->pinned == NULL) {
+        newbuf = realloc(r->buf,newcap);
+        if (newbuf == NULL)
+            return REDIS_ERR;
+    } else {
+        /* Only copy the unconsumed part. A pinned buffer must not move at
+         * all, replies point into it. */
+        newbuf = malloc(newcap);
+        if (newbuf == NULL)
+            return REDIS_ERR;
+        if (used > 0)
+            memcpy(newbuf,r->buf+r->pos,used);
+        __redisReaderFreeBuffer(r);
+        r->len = used;
     }
-    return r;
+
+    r->buf = newbuf;
+    r->cap = newcap;
+    return REDIS_OK;
 }
 
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
@@ -191,10 +1026,10 @@ static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     }
 
     /* Clear input buffer on errors. */
-    if (r->buf != NULL) {
-        sdsfree(r->buf);
-        r->buf = NULL;
-        r->pos = r->len = 0;
+    __redisReaderFreeBuffer(r);
+    if (r->bulk != NULL) {
+        free(r->bulk);
+        r->bulk = NULL;
     }
 
     /* Reset task stack. */
@@ -255,60 +1090,174 @@ static char *readBytes(redisReader *r, unsigned int bytes) {
     return NULL;
 }
 
-/* Find pointer to \r\n. */
-static char *seekNewline(char *s, size_t len) {
-    int pos = 0;
-    int _len = len-1;
+/* Find pointer to \r\n, one byte at a time. Used as-is where no vector
+ * instructions are available and for the tail of the vectorized scanners. */
+static char *seekNewlineScalar(char *s, size_t len) {
+    size_t pos = 0;
+    char *cr;
 
     /* Position should be < len-1 because the character at "pos" should be
      * followed by a \n. Note that strchr cannot be used because it doesn't
      * allow to search a limited length and the buffer that is being searched
      * might not have a trailing NULL character. */
-    while (pos < _len) {
-        while(pos < _len && s[pos] != '\r') pos++;
-        if (s[pos] != '\r') {
+    while (pos+1 < len) {
+        cr = memchr(s+pos,'\r',len-1-pos);
+        if (cr == NULL) {
             /* Not found. */
             return NULL;
+        } else if (cr[1] == '\n') {
+            /* Found. */
+            return cr;
         } else {
-            if (s[pos+1] == '\n') {
-                /* Found. */
-                return s+pos;
-            } else {
-                /* Continue searching. */
-                pos++;
-            }
+            /* Continue searching. */
+            pos = cr-s+1;
         }
     }
     return NULL;
 }
 
-/* Read a long long value starting at *s, under the assumption that it will be
- * terminated by \r\n. Ambiguously returns -1 for unexpected input. */
-static long long readLongLong(char *s) {
-    long long v = 0;
-    int dec, mult = 1;
-    char c;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HIREDIS_SIMD_NEWLINE
+#include <immintrin.h>
+
+/* Compare a block with '\r' and the same block shifted by one byte with
+ * '\n': the lowest bit set in both masks is the first \r\n. The shifted load
+ * reads s[pos+width], so a block is only scanned when that byte exists. */
+static char *seekNewlineSSE2(char *s, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t pos = 0;
+
+    while (pos+16 < len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s+pos));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s+pos+1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a,cr),_mm_cmpeq_epi8(b,lf)));
+        if (mask)
+            return s+pos+__builtin_ctz(mask);
+        pos += 16;
+    }
+
+    return seekNewlineScalar(s+pos,len-pos);
+}
 
-    if (*s == '-') {
-        mult = -1;
-        s++;
-    } else if (*s == '+') {
-        mult = 1;
-        s++;
+__attribute__((target("avx2")))
+static char *seekNewlineAVX2(char *s, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t pos = 0;
+
+    while (pos+32 < len) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(s+pos));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s+pos+1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a,cr),_mm256_cmpeq_epi8(b,lf)));
+        if (mask)
+            return s+pos+__builtin_ctz(mask);
+        pos += 32;
     }
 
-    while ((c = *(s++)) != '\r') {
-        dec = c - '0';
-        if (dec >= 0 && dec < 10) {
-            v *= 10;
-            v += dec;
-        } else {
-            /* Should not happen... */
-            return -1;
-        }
+    return seekNewlineSSE2(s+pos,len-pos);
+}
+
+static char *seekNewlineResolve(char *s, size_t len);
+static char *(*seekNewlineImpl)(char *s, size_t len) = seekNewlineResolve;
+
+/* Pick the widest scanner the CPU supports on first use. Concurrent first
+ * calls from several threads all store the same pointer. */
+static char *seekNewlineResolve(char *s, size_t len) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        seekNewlineImpl = seekNewlineAVX2;
+    else
+        seekNewlineImpl = seekNewlineSSE2;
+    return seekNewlineImpl(s,len);
+}
+#endif
+
+/* Find pointer to \r\n. */
+static char *seekNewline(char *s, size_t len) {
+#ifdef HIREDIS_SIMD_NEWLINE
+    return seekNewlineImpl(s,len);
+#else
+    return seekNewlineScalar(s,len);
+#endif
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* Convert 8 ASCII digits at once, the first digit in the lowest byte. Each
+ * step combines neighbouring groups: pairs, then quads, then the octet. */
+static uint32_t parseEightDigits(uint64_t val) {
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 0x000F424000000064ULL; /* 100 + (1000000 << 32) */
+    const uint64_t mul2 = 0x0000271000000001ULL; /* 1 + (10000 << 32) */
+
+    val -= 0x3030303030303030ULL;
+    val = (val*10)+(val>>8);
+    val = (((val & mask)*mul1)+(((val>>16) & mask)*mul2))>>32;
+    return (uint32_t)val;
+}
+
+/* True when all 8 bytes are in '0'..'9'. */
+static int isEightDigits(uint64_t val) {
+    return ((val & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((val+0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+            0x3333333333333333ULL;
+}
+#endif
+
+/* Parse the len bytes at s as a signed 64 bit integer. Returns REDIS_ERR on
+ * empty input, anything but digits after an optional sign, and overflow. */
+static int readLongLong(const char *s, size_t len, long long *value) {
+    unsigned long long v = 0;
+    int negative = 0;
+    size_t i = 0, lead;
+    unsigned int dec;
+
+    if (len > 0 && (s[0] == '-' || s[0] == '+')) {
+        negative = (s[0] == '-');
+        i++;
+    }
+
+    /* At most 19 digits, so v can't wrap while parsing. */
+    if (i == len || len-i > 19)
+        return REDIS_ERR;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* Leading digits one by one, so the rest splits into chunks of 8. */
+    lead = i+(len-i)%8;
+#else
+    lead = len;
+#endif
+
+    for (; i < lead; i++) {
+        dec = (unsigned char)s[i]-'0';
+        if (dec > 9)
+            return REDIS_ERR;
+        v = v*10+dec;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (i < len) {
+        uint64_t chunk;
+        memcpy(&chunk,s+i,8);
+        if (!isEightDigits(chunk))
+            return REDIS_ERR;
+        v = v*100000000ULL+parseEightDigits(chunk);
+        i += 8;
     }
+#endif
 
-    return mult*v;
+    if (negative) {
+        if (v > (unsigned long long)LLONG_MAX+1)
+            return REDIS_ERR;
+        *value = (v == (unsigned long long)LLONG_MAX+1) ? LLONG_MIN : -(long long)v;
+    } else {
+        if (v > LLONG_MAX)
+            return REDIS_ERR;
+        *value = (long long)v;
+    }
+    return REDIS_OK;
 }
 
 static char *readLine(redisReader *r, int *_len) {
@@ -340,6 +1289,7 @@ static void moveToNextTask(redisReader *r) {
         assert(prv->type == REDIS_REPLY_ARRAY);
         if (cur->idx == prv->elements-1) {
             r->ridx--;
+            streamEndArray(r,r->ridx);
         } else {
             /* Reset the type because the next item can be anything */
             assert(cur->idx < prv->elements);
@@ -356,11 +1306,18 @@ static int processLineItem(redisReader *r) {
     void *obj;
     char *p;
     int len;
+    long long v;
 
     if ((p = readLine(r,&len)) != NULL) {
         if (cur->type == REDIS_REPLY_INTEGER) {
+            if (readLongLong(p,len,&v) != REDIS_OK) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                    "Bad integer value");
+                return REDIS_ERR;
+            }
+
             if (r->fn && r->fn->createInteger)
-                obj = r->fn->createInteger(cur,readLongLong(p));
+                obj = r->fn->createInteger(cur,v);
             else
                 obj = (void*)REDIS_REPLY_INTEGER;
         } else {
@@ -385,20 +1342,91 @@ static int processLineItem(redisReader *r) {
     return REDIS_ERR;
 }
 
+/* Create a string reply owning an already filled buffer. */
+static void *createStringObjectNoCopy(const redisReadTask *task, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(task->type);
+    if (r == NULL)
+        return NULL;
+
+    r->str = str;
+    r->len = len;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+/* Continue receiving a large bulk payload into its destination. Bytes are
+ * taken from the read buffer here, or read from the socket straight into
+ * r->bulk by redisBufferRead. */
+static int processBigBulkItem(redisReader *r) {
+    redisReadTask *cur = &(r->rstack[r->ridx]);
+    size_t avail = r->len-r->pos;
+    size_t len = r->bulklen-2;
+    void *obj;
+
+    if (avail > r->bulklen-r->bulkpos)
+        avail = r->bulklen-r->bulkpos;
+    if (avail > 0) {
+        memcpy(r->bulk+r->bulkpos,r->buf+r->pos,avail);
+        r->bulkpos += avail;
+        r->pos += avail;
+    }
+
+    if (r->bulkpos < r->bulklen)
+        return REDIS_ERR;
+
+    r->bulk[len] = '\0';
+    if (r->fn == &defaultFunctions) {
+        obj = createStringObjectNoCopy(cur,r->bulk,len);
+        if (obj == NULL)
+            free(r->bulk);
+    } else {
+        if (r->fn && r->fn->createString)
+            obj = r->fn->createString(cur,r->bulk,len);
+        else
+            obj = (void*)REDIS_REPLY_STRING;
+        free(r->bulk);
+    }
+    r->bulk = NULL;
+
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    /* Set reply if this is the root object. */
+    if (r->ridx == 0) r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
 static int processBulkItem(redisReader *r) {
     redisReadTask *cur = &(r->rstack[r->ridx]);
     void *obj = NULL;
     char *p, *s;
-    long len;
+    long long len;
     unsigned long bytelen;
     int success = 0;
 
+    if (r->bulk != NULL)
+        return processBigBulkItem(r);
+
     p = r->buf+r->pos;
     s = seekNewline(p,r->len-r->pos);
     if (s != NULL) {
         p = r->buf+r->pos;
         bytelen = s-(r->buf+r->pos)+2; /* include \r\n */
-        len = readLongLong(p);
+        if (readLongLong(p,bytelen-2,&len) != REDIS_OK) {
+            __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                "Bad bulk string length");
+            return REDIS_ERR;
+        }
 
         if (len < 0) {
             /* The nil object can always be created. */
@@ -411,11 +1439,27 @@ static int processBulkItem(redisReader *r) {
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
-                if (r->fn && r->fn->createString)
+                if (r->zerocopy && (size_t)len >= r->zerocopy &&
+                    r->fn == &defaultFunctions)
+                    obj = createStringRefObject(r,cur,s+2,len);
+                else if (r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
                     obj = (void*)REDIS_REPLY_STRING;
                 success = 1;
+            } else if (r->bigbulk && (unsigned long)len >= r->bigbulk &&
+                       len <= REDIS_READER_MAX_BIG_BULK) {
+                /* Allocate the final string once instead of growing the read
+                 * buffer until the whole payload is in. */
+                r->bulk = malloc(len+2);
+                if (r->bulk == NULL) {
+                    __redisReaderSetErrorOOM(r);
+                    return REDIS_ERR;
+                }
+                r->bulklen = len+2;
+                r->bulkpos = 0;
+                r->pos += bytelen-r->bulklen; /* skip the header */
+                return processBigBulkItem(r);
             }
         }
 
@@ -442,7 +1486,8 @@ static int processMultiBulkItem(redisReader *r) {
     redisReadTask *cur = &(r->rstack[r->ridx]);
     void *obj;
     char *p;
-    long elements;
+    int len;
+    long long elements;
     int root = 0;
 
     /* Set error for nested multi bulks with depth > 7 */
@@ -452,8 +1497,13 @@ static int processMultiBulkItem(redisReader *r) {
         return REDIS_ERR;
     }
 
-    if ((p = readLine(r,NULL)) != NULL) {
-        elements = readLongLong(p);
+    if ((p = readLine(r,&len)) != NULL) {
+        if (readLongLong(p,len,&elements) != REDIS_OK ||
+            elements < -1 || elements > INT_MAX) {
+            __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                "Bad multi-bulk length");
+            return REDIS_ERR;
+        }
         root = (r->ridx == 0);
 
         if (elements == -1) {
@@ -491,6 +1541,7 @@ static int processMultiBulkItem(redisReader *r) {
                 r->rstack[r->ridx].parent = cur;
                 r->rstack[r->ridx].privdata = r->privdata;
             } else {
+                streamEndArray(r,r->ridx);
                 moveToNextTask(r);
             }
         }
@@ -562,13 +1613,8 @@ redisReader *redisReaderCreate(void) {
     r->err = 0;
     r->errstr[0] = '\0';
     r->fn = &defaultFunctions;
-    r->buf = sdsempty();
     r->maxbuf = REDIS_READER_MAX_BUF;
-    if (r->buf == NULL) {
-        free(r);
-        return NULL;
-    }
-
+    r->bigbulk = REDIS_READER_BIG_BULK;
     r->ridx = -1;
     return r;
 }
@@ -576,13 +1622,52 @@ redisReader *redisReaderCreate(void) {
 void redisReaderFree(redisReader *r) {
     if (r->reply != NULL && r->fn && r->fn->freeObject)
         r->fn->freeObject(r->reply);
-    if (r->buf != NULL)
-        sdsfree(r->buf);
+    __redisReaderFreeBuffer(r);
+    if (r->bulk != NULL)
+        free(r->bulk);
     free(r);
 }
 
+/* Switch the reader to streaming mode: instead of building reply objects,
+ * every item is handed to the callbacks as soon as it was received, so replies
+ * of any size are parsed in constant memory. redisReaderGetReply returns a
+ * non-NULL placeholder (the type of the reply cast to a pointer) once a whole
+ * reply was streamed; it must not be free'd. Passing NULL restores the
+ * default reply objects. Only switch between replies. */
+void redisReaderSetCallbacks(redisReader *r, redisReplyCallbacks *callbacks) {
+    r->callbacks = callbacks;
+    r->fn = callbacks ? &streamFunctions : &defaultFunctions;
+}
+
+/* Return a pointer to at least len bytes of free space in the input buffer,
+ * for example to read(2) into, and set *avail to the size of the space.
+ * Bytes written there are parsed after redisReaderCommit. */
+char *redisReaderReserve(redisReader *r, size_t len, size_t *avail) {
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return NULL;
+
+    if (__redisReaderMakeRoom(r,len) != REDIS_OK) {
+        __redisReaderSetErrorOOM(r);
+        return NULL;
+    }
+
+    if (avail != NULL)
+        *avail = r->cap-r->len;
+    return r->buf+r->len;
+}
+
+int redisReaderCommit(redisReader *r, size_t len) {
+    if (r->err)
+        return REDIS_ERR;
+
+    assert(len <= r->cap-r->len);
+    r->len += len;
+    return REDIS_OK;
+}
+
 int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
-    sds newbuf;
+    char *dst;
 
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
@@ -590,24 +1675,12 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
 
     /* Copy the provided buffer. */
     if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
-            r->pos = 0;
-
-            /* r->buf should not be NULL since we just free'd a larger one. */
-            assert(r->buf != NULL);
-        }
-
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) {
-            __redisReaderSetErrorOOM(r);
+        dst = redisReaderReserve(r,len,NULL);
+        if (dst == NULL)
             return REDIS_ERR;
-        }
 
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+        memcpy(dst,buf,len);
+        r->len += len;
     }
 
     return REDIS_OK;
@@ -622,8 +1695,9 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
+    /* When the buffer is empty, there will never be a reply, unless a large
+     * bulk was completed by reading straight into it. */
+    if (r->len == 0 && r->bulk == NULL)
         return REDIS_OK;
 
     /* Set first item to process when the stack is empty. */
@@ -646,13 +1720,11 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        r->buf = sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
-    }
+    /* Rewind the cursors when everything was consumed, so the buffer is
+     * reused from the start without moving anything. A pinned buffer is
+     * left alone, it is replaced when more room is needed. */
+    if (r->pos == r->len && r->pinned == NULL)
+        r->pos = r->len = 0;
 
     /* Emit a reply when there is one. */
     if (r->ridx == -1) {
@@ -664,17 +1736,16 @@ int redisReaderGetReply(redisReader *r, void **reply) {
 }
 
 /* Calculate the number of bytes needed to represent an integer as string. */
-static int intlen(int i) {
-    int len = 0;
-    if (i < 0) {
-        len++;
-        i = -i;
-    }
-    do {
-        len++;
-        i /= 10;
-    } while(i);
-    return len;
+static int intlen(unsigned long long v) {
+    int len = 1;
+    for (;;) {
+        if (v < 10) return len;
+        if (v < 100) return len+1;
+        if (v < 1000) return len+2;
+        if (v < 10000) return len+3;
+        v /= 10000;
+        len += 4;
+    }
 }
 
 /* Helper that calculates the bulk length given a certain string length. */
@@ -682,468 +1753,595 @@ static size_t bulklen(size_t len) {
     return 1+intlen(len)+2+len+2;
 }
 
-int redisvFormatCommandArgList( char ***curargv, int *argc, const char *format, va_list ap ) {
-    const char *c = format;
-    sds curarg, newarg; /* current argument */
-    int touched = 0; /* was the current argument touched? */
-    char **newargv = NULL;
-    int totlen = 0;
-    int commented = 0;
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Write a protocol header like "*3\r\n" or "$5\r\n" to p, converting the
+ * value two digits at a time. Returns the position after the header. */
+static char *writeHeader(char *p, char prefix, unsigned long long v) {
+    char *end;
+    unsigned int i;
+
+    *p++ = prefix;
+    end = p+intlen(v);
+    p = end;
+    while (v >= 100) {
+        i = (unsigned int)(v%100)*2;
+        v /= 100;
+        *--p = digitPairs[i+1];
+        *--p = digitPairs[i];
+    }
+    if (v >= 10) {
+        *--p = digitPairs[v*2+1];
+        *--p = digitPairs[v*2];
+    } else {
+        *--p = '0'+(char)v;
+    }
+    end[0] = '\r';
+    end[1] = '\n';
+    return end+2;
+}
 
-    /* Abort if there is not target to set */
-    if (curargv == NULL || argc == NULL)
-        return -1;
+/* Arguments whose lengths are kept on the stack while formatting. */
+#define REDIS_FORMAT_STACK_ARGS 16
 
-    *argc = 0;
-    /* Build the command string accordingly to protocol */
-    curarg = sdsempty();
-    if (curarg == NULL)
-        return -1;
+/* Return the lengths of the arguments: argvlen itself when set, otherwise
+ * they are computed once into stack (when there is room) or a new array. */
+static const size_t *argvLengths(int argc, const char **argv, const size_t *argvlen, size_t *stack) {
+    size_t *lens;
+    int j;
 
-    while(*c != '\0') {
-        if (*c != '%' || commented == 1 || c[1] == '\0') {
-            if (*c == ' ' && commented == 0) {
-                if (touched) {
-                    newargv = realloc(*curargv,sizeof(char*)*((*argc)+1));
-                    if (newargv == NULL) goto err;
-                    *curargv = newargv;
-                    (*curargv)[(*argc)++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = sdsempty();
-                    if (curarg == NULL) goto err;
-                    touched = 0;
-                }
-            } else if ( *c == '"' ) {
-                commented = (commented) ? 0 : 1;
-
-                if( touched ){
-                    newargv = realloc(*curargv,sizeof(char*)*((*argc)+1));
-                    if (newargv == NULL) goto err;
-                    *curargv = newargv;
-                    (*curargv)[(*argc)++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = sdsempty();
-                    if (curarg == NULL) goto err;
-                    touched = 0;
-                }
-            } else {
-                newarg = sdscatlen(curarg,c,1);
-                if (newarg == NULL) goto err;
-                curarg = newarg;
-                touched = 1;
-            }
-        } else {
-            char *arg;
-            size_t size;
+    if (argvlen != NULL)
+        return argvlen;
 
-            /* Set newarg so it can be checked even if it is not touched. */
-            newarg = curarg;
+    lens = (argc <= REDIS_FORMAT_STACK_ARGS) ? stack : malloc(argc*sizeof(size_t));
+    if (lens == NULL)
+        return NULL;
+    for (j = 0; j < argc; j++)
+        lens[j] = strlen(argv[j]);
+    return lens;
+}
 
-            switch(c[1]) {
-            case 's':
-                arg = va_arg(ap,char*);
-                size = strlen(arg);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
-                break;
-            case 'b':
-                arg = va_arg(ap,char*);
-                size = va_arg(ap,size_t);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
-                break;
-            case '%':
-                newarg = sdscat(curarg,"%");
-                break;
-            default:
-                /* Try to detect printf format */
-                {
-                    static const char intfmts[] = "diouxX";
-                    char _format[16];
-                    const char *_p = c+1;
-                    size_t _l = 0;
-                    va_list _cpy;
-
-                    /* Flags */
-                    if (*_p != '\0' && *_p == '#') _p++;
-                    if (*_p != '\0' && *_p == '0') _p++;
-                    if (*_p != '\0' && *_p == '-') _p++;
-                    if (*_p != '\0' && *_p == ' ') _p++;
-                    if (*_p != '\0' && *_p == '+') _p++;
-
-                    /* Field width */
-                    while (*_p != '\0' && isdigit(*_p)) _p++;
-
-                    /* Precision */
-                    if (*_p == '.') {
-                        _p++;
-                        while (*_p != '\0' && isdigit(*_p)) _p++;
-                    }
-
-                    /* Copy va_list before consuming with va_arg */
-                    va_copy(_cpy,ap);
-
-                    /* Integer conversion (without modifiers) */
-                    if (strchr(intfmts,*_p) != NULL) {
-                        va_arg(ap,int);
-                        goto fmt_valid;
-                    }
-
-                    /* Double conversion (without modifiers) */
-                    if (strchr("eEfFgGaA",*_p) != NULL) {
-                        va_arg(ap,double);
-                        goto fmt_valid;
-                    }
-
-                    /* Size: char */
-                    if (_p[0] == 'h' && _p[1] == 'h') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* char gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: short */
-                    if (_p[0] == 'h') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* short gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long long */
-                    if (_p[0] == 'l' && _p[1] == 'l') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long */
-                    if (_p[0] == 'l') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                fmt_invalid:
-                    va_end(_cpy);
-                    goto err;
-
-                fmt_valid:
-                    _l = (_p+1)-c;
-                    if (_l < sizeof(_format)-2) {
-                        memcpy(_format,c,_l);
-                        _format[_l] = '\0';
-                        newarg = sdscatvprintf(curarg,_format,_cpy);
-
-                        /* Update current position (note: outer blocks
-                         * increment c twice so compensate here) */
-                        c = _p-1;
-                    }
-
-                    va_end(_cpy);
-                    break;
-                }
-            }
+/* Number of bytes of a command, or -1 when it is too long. */
+static int commandLength(int argc, const size_t *argvlen) {
+    size_t totlen;
+    int j;
 
-            if (newarg == NULL) goto err;
-            curarg = newarg;
+    totlen = 1+intlen(argc)+2;
+    for (j = 0; j < argc; j++) {
+        totlen += bulklen(argvlen[j]);
+        if (totlen > INT_MAX)
+            return -1;
+    }
+    return totlen;
+}
 
-            touched = 1;
-            c++;
-        }
-        c++;
+/* Write a command to cmd, which must have room for it. */
+static char *writeCommand(char *cmd, int argc, const char **argv, const size_t *argvlen) {
+    int j;
+
+    cmd = writeHeader(cmd,'*',argc);
+    for (j = 0; j < argc; j++) {
+        cmd = writeHeader(cmd,'$',argvlen[j]);
+        memcpy(cmd,argv[j],argvlen[j]);
+        cmd += argvlen[j];
+        *cmd++ = '\r';
+        *cmd++ = '\n';
     }
+    return cmd;
+}
+
+/* Format a command according to the Redis protocol. This function takes the
+ * number of arguments, an array with arguments and an array with their
+ * lengths. If the latter is set to NULL, strlen will be used to compute the
+ * argument lengths.
+ */
+int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen) {
+    size_t stack[REDIS_FORMAT_STACK_ARGS];
+    const size_t *lens;
+    char *cmd = NULL; /* final command */
+    int totlen;
 
-    if( commented == 1 ) goto err;
+    lens = argvLengths(argc,argv,argvlen,stack);
+    if (lens == NULL)
+        return -1;
 
-    /* Add the last argument if needed */
-    if (touched) {
-        newargv = realloc(*curargv,sizeof(char*)*((*argc)+1));
-        if (newargv == NULL) goto err;
-        *curargv = newargv;
-        (*curargv)[(*argc)++] = curarg;
-        totlen += bulklen(sdslen(curarg));
+    /* Build the command at protocol level */
+    totlen = commandLength(argc,lens);
+    if (totlen >= 0)
+        cmd = malloc(totlen+1);
+    if (cmd != NULL) {
+        writeCommand(cmd,argc,argv,lens);
+        cmd[totlen] = '\0';
+        *target = cmd;
     } else {
-        sdsfree(curarg);
+        totlen = -1;
     }
 
-    /* Clear curarg because it was put in curargv or was free'd. */
-    curarg = NULL;
+    if (lens != argvlen && lens != stack)
+        free((void*)lens);
+    return totlen;
+}
+
+int redisFormatCommandArgvList(char **target, int argc, const char **argv) {
+    return redisFormatCommandArgv(target,argc,argv,NULL);
+}
+
+/* Format a command into a buffer of the caller holding size bytes. Returns
+ * the length of the command, or -1 on errors. The command (without a
+ * terminating nul byte) is only written when it fits, so a caller can retry
+ * with a buffer of the returned length. */
+int redisFormatCommandArgvBuf(char *buf, size_t size, int argc, const char **argv, const size_t *argvlen) {
+    size_t stack[REDIS_FORMAT_STACK_ARGS];
+    const size_t *lens;
+    int totlen;
+
+    lens = argvLengths(argc,argv,argvlen,stack);
+    if (lens == NULL)
+        return -1;
+
+    totlen = commandLength(argc,lens);
+    if (totlen >= 0 && (size_t)totlen <= size)
+        writeCommand(buf,argc,argv,lens);
 
-    /* Add bytes needed to hold multi bulk count */
-    totlen += 1+intlen(*argc)+2;
+    if (lens != argvlen && lens != stack)
+        free((void*)lens);
     return totlen;
+}
 
-err:
-    while(*argc--)
-        sdsfree((*curargv)[*argc]);
-    free(*curargv);
+/* A compiled format string is a list of operations, each one adding bytes to
+ * an argument: literal text, a %s or %b argument, or a printf conversion. The
+ * parser below decides where arguments start and end without looking at the
+ * values, so the number of arguments is known when compiling. */
+#define FORMAT_OP_LITERAL 0
+#define FORMAT_OP_STR 1
+#define FORMAT_OP_BIN 2
+#define FORMAT_OP_PRINTF 3
+#define FORMAT_OP_SKIP 4 /* Conversion too long to be printed */
+
+/* Type consumed by a printf conversion */
+#define FORMAT_CONV_INT 0
+#define FORMAT_CONV_DOUBLE 1
+#define FORMAT_CONV_LONG 2
+#define FORMAT_CONV_LONGLONG 3
+
+typedef struct redisFormatOp {
+    unsigned char type;
+    unsigned char conv;
+    int arg; /* Argument the operation adds to */
+    size_t off, len; /* Literal text or printf format in text */
+} redisFormatOp;
+
+struct redisFormat {
+    char *format; /* Copy of the compiled format string */
+    const char *key; /* Format pointer the plan was cached for */
+    char *text;
+    size_t textlen;
+    redisFormatOp *ops;
+    int nops;
+    int argc;
+};
 
-    if (curarg != NULL)
-        sdsfree(curarg);
+static void formatAddOp(redisFormat *f, int type, int conv, const char *text, size_t len) {
+    redisFormatOp *op;
 
-    return -1;
+    /* Merge literal text with the previous literal of the same argument */
+    if (type == FORMAT_OP_LITERAL && f->nops > 0) {
+        op = f->ops+f->nops-1;
+        if (op->type == type && op->arg == f->argc && op->off+op->len == f->textlen) {
+            memcpy(f->text+f->textlen,text,len);
+            f->textlen += len;
+            op->len += len;
+            return;
+        }
+    }
 
+    op = f->ops+f->nops++;
+    op->type = type;
+    op->conv = conv;
+    op->arg = f->argc;
+    op->off = f->textlen;
+    op->len = len;
+    if (len > 0) {
+        memcpy(f->text+f->textlen,text,len);
+        f->textlen += len;
+    }
+    if (type == FORMAT_OP_PRINTF)
+        f->text[f->textlen++] = '\0';
 }
 
-int redisvFormatCommand(char **target, const char *format, va_list ap) {
-    const char *c = format;
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    sds curarg, newarg; /* current argument */
-    int touched = 0; /* was the current argument touched? */
-    char **curargv = NULL, **newargv = NULL;
-    int argc = 0;
-    int totlen = 0;
-    int j;
-    int commented = 0;
+/* Return the type consumed by the printf conversion starting at p (right
+ * after the '%') or -1 when it is invalid, and set end to its last char. */
+static int formatConversion(const char *p, const char **end) {
+    static const char intfmts[] = "diouxX";
+    int conv = FORMAT_CONV_INT;
+
+    /* Flags */
+    if (*p != '\0' && *p == '#') p++;
+    if (*p != '\0' && *p == '0') p++;
+    if (*p != '\0' && *p == '-') p++;
+    if (*p != '\0' && *p == ' ') p++;
+    if (*p != '\0' && *p == '+') p++;
+
+    /* Field width */
+    while (*p != '\0' && isdigit(*p)) p++;
+
+    /* Precision */
+    if (*p == '.') {
+        p++;
+        while (*p != '\0' && isdigit(*p)) p++;
+    }
 
-    /* Abort if there is not target to set */
-    if (target == NULL)
+    if (*p != '\0' && strchr(intfmts,*p) != NULL) {
+        *end = p;
+        return FORMAT_CONV_INT;
+    }
+    if (*p != '\0' && strchr("eEfFgGaA",*p) != NULL) {
+        *end = p;
+        return FORMAT_CONV_DOUBLE;
+    }
+
+    /* Sizes: char and short get promoted to int */
+    if (p[0] == 'h' && p[1] == 'h') {
+        p += 2;
+    } else if (p[0] == 'h') {
+        p += 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        p += 2;
+        conv = FORMAT_CONV_LONGLONG;
+    } else if (p[0] == 'l') {
+        p += 1;
+        conv = FORMAT_CONV_LONG;
+    } else {
         return -1;
+    }
+
+    if (*p != '\0' && strchr(intfmts,*p) != NULL) {
+        *end = p;
+        return conv;
+    }
+    return -1;
+}
 
-    /* Build the command string accordingly to protocol */
-    curarg = sdsempty();
-    if (curarg == NULL)
-        return -1;
+/* Parse format into f. Every operation takes at least one byte of the
+ * format and printf formats are copied with a terminator, so for a format of
+ * len bytes f->ops needs room for len+1 operations and f->text for len*2+1
+ * bytes. Returns REDIS_ERR when the format is invalid. */
+static int formatParse(redisFormat *f, const char *format) {
+    const char *c = format, *end;
+    int touched = 0; /* was the current argument touched? */
+    int commented = 0;
+    int conv;
 
     while(*c != '\0') {
         if (*c != '%' || commented == 1 || c[1] == '\0') {
-            if (*c == ' ' && commented == 0) {
+            if ((*c == ' ' && commented == 0) || *c == '"') {
+                if (*c == '"')
+                    commented = (commented) ? 0 : 1;
                 if (touched) {
-                    newargv = realloc(curargv,sizeof(char*)*(argc+1));
-                    if (newargv == NULL) goto err;
-                    curargv = newargv;
-                    curargv[argc++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = sdsempty();
-                    if (curarg == NULL) goto err;
-                    touched = 0;
-                }
-            } else if ( *c == '"' ) {
-                commented = (commented) ? 0 : 1;
-
-                if( touched ){
-                    newargv = realloc(curargv,sizeof(char*)*(argc+1));
-                    if (newargv == NULL) goto err;
-                    curargv = newargv;
-                    curargv[argc++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
-
-                    /* curarg is put in argv so it can be overwritten. */
-                    curarg = sdsempty();
-                    if (curarg == NULL) goto err;
+                    f->argc++;
                     touched = 0;
                 }
             } else {
-                newarg = sdscatlen(curarg,c,1);
-                if (newarg == NULL) goto err;
-                curarg = newarg;
+                formatAddOp(f,FORMAT_OP_LITERAL,0,c,1);
                 touched = 1;
             }
         } else {
-            char *arg;
-            size_t size;
-
-            /* Set newarg so it can be checked even if it is not touched. */
-            newarg = curarg;
-
             switch(c[1]) {
             case 's':
-                arg = va_arg(ap,char*);
-                size = strlen(arg);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
+                formatAddOp(f,FORMAT_OP_STR,0,NULL,0);
                 break;
             case 'b':
-                arg = va_arg(ap,char*);
-                size = va_arg(ap,size_t);
-                if (size > 0)
-                    newarg = sdscatlen(curarg,arg,size);
+                formatAddOp(f,FORMAT_OP_BIN,0,NULL,0);
                 break;
             case '%':
-                newarg = sdscat(curarg,"%");
+                formatAddOp(f,FORMAT_OP_LITERAL,0,"%",1);
                 break;
             default:
-                /* Try to detect printf format */
-                {
-                    static const char intfmts[] = "diouxX";
-                    char _format[16];
-                    const char *_p = c+1;
-                    size_t _l = 0;
-                    va_list _cpy;
-
-                    /* Flags */
-                    if (*_p != '\0' && *_p == '#') _p++;
-                    if (*_p != '\0' && *_p == '0') _p++;
-                    if (*_p != '\0' && *_p == '-') _p++;
-                    if (*_p != '\0' && *_p == ' ') _p++;
-                    if (*_p != '\0' && *_p == '+') _p++;
-
-                    /* Field width */
-                    while (*_p != '\0' && isdigit(*_p)) _p++;
-
-                    /* Precision */
-                    if (*_p == '.') {
-                        _p++;
-                        while (*_p != '\0' && isdigit(*_p)) _p++;
-                    }
-
-                    /* Copy va_list before consuming with va_arg */
-                    va_copy(_cpy,ap);
-
-                    /* Integer conversion (without modifiers) */
-                    if (strchr(intfmts,*_p) != NULL) {
-                        va_arg(ap,int);
-                        goto fmt_valid;
-                    }
-
-                    /* Double conversion (without modifiers) */
-                    if (strchr("eEfFgGaA",*_p) != NULL) {
-                        va_arg(ap,double);
-                        goto fmt_valid;
-                    }
-
-                    /* Size: char */
-                    if (_p[0] == 'h' && _p[1] == 'h') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* char gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: short */
-                    if (_p[0] == 'h') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,int); /* short gets promoted to int */
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long long */
-                    if (_p[0] == 'l' && _p[1] == 'l') {
-                        _p += 2;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                    /* Size: long */
-                    if (_p[0] == 'l') {
-                        _p += 1;
-                        if (*_p != '\0' && strchr(intfmts,*_p) != NULL) {
-                            va_arg(ap,long);
-                            goto fmt_valid;
-                        }
-                        goto fmt_invalid;
-                    }
-
-                fmt_invalid:
-                    va_end(_cpy);
-                    goto err;
-
-                fmt_valid:
-                    _l = (_p+1)-c;
-                    if (_l < sizeof(_format)-2) {
-                        memcpy(_format,c,_l);
-                        _format[_l] = '\0';
-                        newarg = sdscatvprintf(curarg,_format,_cpy);
-
-                        /* Update current position (note: outer blocks
-                         * increment c twice so compensate here) */
-                        c = _p-1;
-                    }
-
-                    va_end(_cpy);
-                    break;
+                conv = formatConversion(c+1,&end);
+                if (conv == -1)
+                    return REDIS_ERR;
+
+                /* The value of a conversion that is too long is consumed,
+                 * but not printed. */
+                if ((size_t)((end+1)-c) < 14) {
+                    formatAddOp(f,FORMAT_OP_PRINTF,conv,c,(end+1)-c);
+                    c = end-1;
+                } else {
+                    formatAddOp(f,FORMAT_OP_SKIP,conv,NULL,0);
                 }
+                break;
             }
 
-            if (newarg == NULL) goto err;
-            curarg = newarg;
-
             touched = 1;
             c++;
         }
         c++;
     }
 
-    if (commented == 1) goto err;
+    if (commented == 1)
+        return REDIS_ERR;
 
     /* Add the last argument if needed */
-    if (touched) {
-        newargv = realloc(curargv,sizeof(char*)*(argc+1));
-        if (newargv == NULL) goto err;
-        curargv = newargv;
-        curargv[argc++] = curarg;
-        totlen += bulklen(sdslen(curarg));
-    } else {
-        sdsfree(curarg);
+    if (touched)
+        f->argc++;
+    return REDIS_OK;
+}
+
+/* Parse a format string once, so commands can be formatted with it without
+ * parsing it again. The format has the same syntax as for redisCommand.
+ * Returns NULL when the format is invalid or out of memory. */
+redisFormat *redisFormatCompile(const char *format) {
+    size_t len = strlen(format);
+    redisFormat *f;
+
+    f = calloc(1,sizeof(*f));
+    if (f == NULL)
+        return NULL;
+
+    f->format = malloc(len+1);
+    f->text = malloc(len*2+1);
+    f->ops = malloc(sizeof(redisFormatOp)*(len+1));
+    if (f->format == NULL || f->text == NULL || f->ops == NULL ||
+        formatParse(f,format) != REDIS_OK) {
+        redisFormatFree(f);
+        return NULL;
     }
+    memcpy(f->format,format,len+1);
+    return f;
+}
 
-    /* Clear curarg because it was put in curargv or was free'd. */
-    curarg = NULL;
+void redisFormatFree(redisFormat *f) {
+    if (f == NULL)
+        return;
+    free(f->format);
+    free(f->text);
+    free(f->ops);
+    free(f);
+}
 
-    /* Add bytes needed to hold multi bulk count */
-    totlen += 1+intlen(argc)+2;
+/* Operations and arguments of a compiled format kept on the stack, and room
+ * for the output of printf conversions. */
+#define REDIS_FORMAT_STACK_OPS 32
+#define REDIS_FORMAT_SCRATCH 256
 
-    /* Build the command at protocol level */
-    cmd = malloc(totlen+1);
-    if (cmd == NULL) goto err;
+typedef struct redisFormatPiece {
+    const char *str;
+    size_t len;
+    char *owned; /* Output of a conversion that did not fit the scratch */
+} redisFormatPiece;
+
+typedef struct redisFormatState {
+    redisFormatPiece *pieces;
+    size_t *lens;
+    redisFormatPiece stackpieces[REDIS_FORMAT_STACK_OPS];
+    size_t stacklens[REDIS_FORMAT_STACK_ARGS];
+    char scratch[REDIS_FORMAT_SCRATCH];
+} redisFormatState;
+
+static void formatStateFree(const redisFormat *f, redisFormatState *st) {
+    int j;
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        pos += sprintf(cmd+pos,"$%zu\r\n",sdslen(curargv[j]));
-        memcpy(cmd+pos,curargv[j],sdslen(curargv[j]));
-        pos += sdslen(curargv[j]);
-        sdsfree(curargv[j]);
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
-    }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
-
-    free(curargv);
-    *target = cmd;
+    if (st->pieces != NULL) {
+        for (j = 0; j < f->nops; j++)
+            free(st->pieces[j].owned);
+        if (st->pieces != st->stackpieces)
+            free(st->pieces);
+    }
+    if (st->lens != st->stacklens)
+        free(st->lens);
+}
+
+/* Print a conversion, returning its length like snprintf. */
+static int formatPrint(char *buf, size_t size, const char *fmt, int conv, long long ll, double d) {
+    switch(conv) {
+    case FORMAT_CONV_DOUBLE: return snprintf(buf,size,fmt,d);
+    case FORMAT_CONV_LONG: return snprintf(buf,size,fmt,(long)ll);
+    case FORMAT_CONV_LONGLONG: return snprintf(buf,size,fmt,ll);
+    default: return snprintf(buf,size,fmt,(int)ll);
+    }
+}
+
+/* Take the values of a compiled format from ap. Returns the length of the
+ * command, or -1 on errors; st must be freed with formatStateFree anyway. */
+static int formatArguments(const redisFormat *f, redisFormatState *st, va_list ap) {
+    size_t used = 0, totlen;
+    redisFormatPiece *piece;
+    const redisFormatOp *op;
+    long long ll = 0;
+    double d = 0;
+    int j, n;
+
+    /* Pieces are zeroed before anything can fail, formatStateFree frees
+     * their owned pointers. */
+    st->pieces = (f->nops <= REDIS_FORMAT_STACK_OPS) ? st->stackpieces :
+        malloc(sizeof(redisFormatPiece)*f->nops);
+    if (st->pieces != NULL)
+        memset(st->pieces,0,sizeof(redisFormatPiece)*f->nops);
+    st->lens = (f->argc <= REDIS_FORMAT_STACK_ARGS) ? st->stacklens :
+        malloc(sizeof(size_t)*f->argc);
+    if (st->pieces == NULL || st->lens == NULL)
+        return -1;
+    memset(st->lens,0,sizeof(size_t)*f->argc);
+
+    for (j = 0; j < f->nops; j++) {
+        op = f->ops+j;
+        piece = st->pieces+j;
+
+        switch(op->type) {
+        case FORMAT_OP_LITERAL:
+            piece->str = f->text+op->off;
+            piece->len = op->len;
+            break;
+        case FORMAT_OP_STR:
+            piece->str = va_arg(ap,char*);
+            piece->len = strlen(piece->str);
+            break;
+        case FORMAT_OP_BIN:
+            piece->str = va_arg(ap,char*);
+            piece->len = va_arg(ap,size_t);
+            break;
+        default:
+            switch(op->conv) {
+            case FORMAT_CONV_DOUBLE: d = va_arg(ap,double); break;
+            case FORMAT_CONV_LONG: ll = va_arg(ap,long); break;
+            case FORMAT_CONV_LONGLONG: ll = va_arg(ap,long long); break;
+            default: ll = va_arg(ap,int); break;
+            }
+            if (op->type == FORMAT_OP_SKIP)
+                break;
+
+            n = formatPrint(st->scratch+used,sizeof(st->scratch)-used,
+                            f->text+op->off,op->conv,ll,d);
+            if (n < 0)
+                return -1;
+            if ((size_t)n < sizeof(st->scratch)-used) {
+                piece->str = st->scratch+used;
+                used += n;
+            } else {
+                piece->owned = malloc(n+1);
+                if (piece->owned == NULL)
+                    return -1;
+                formatPrint(piece->owned,n+1,f->text+op->off,op->conv,ll,d);
+                piece->str = piece->owned;
+            }
+            piece->len = n;
+            break;
+        }
+        st->lens[op->arg] += piece->len;
+    }
+
+    totlen = 1+intlen(f->argc)+2;
+    for (j = 0; j < f->argc; j++) {
+        totlen += bulklen(st->lens[j]);
+        if (totlen > INT_MAX)
+            return -1;
+    }
     return totlen;
+}
 
-err:
-    while(argc--)
-        sdsfree(curargv[argc]);
-    free(curargv);
+/* Write the command taken by formatArguments to cmd. */
+static void formatWrite(const redisFormat *f, const redisFormatState *st, char *cmd) {
+    const redisFormatPiece *piece;
+    int arg = -1, j;
+
+    cmd = writeHeader(cmd,'*',f->argc);
+    for (j = 0; j < f->nops; j++) {
+        if (f->ops[j].arg != arg) {
+            if (arg != -1) {
+                *cmd++ = '\r';
+                *cmd++ = '\n';
+            }
+            arg = f->ops[j].arg;
+            cmd = writeHeader(cmd,'$',st->lens[arg]);
+        }
+        piece = st->pieces+j;
+        if (piece->len > 0) {
+            memcpy(cmd,piece->str,piece->len);
+            cmd += piece->len;
+        }
+    }
+    if (arg != -1) {
+        *cmd++ = '\r';
+        *cmd++ = '\n';
+    }
+}
 
-    if (curarg != NULL)
-        sdsfree(curarg);
+int redisvFormatCompiledCommand(char **target, const redisFormat *f, va_list ap) {
+    redisFormatState st;
+    char *cmd = NULL;
+    int totlen;
 
-    /* No need to check cmd since it is the last statement that can fail,
-     * but do it anyway to be as defensive as possible. */
-    if (cmd != NULL)
-        free(cmd);
+    if (target == NULL)
+        return -1;
 
-    return -1;
+    totlen = formatArguments(f,&st,ap);
+    if (totlen >= 0)
+        cmd = malloc(totlen+1);
+    if (cmd != NULL) {
+        formatWrite(f,&st,cmd);
+        cmd[totlen] = '\0';
+        *target = cmd;
+    } else {
+        totlen = -1;
+    }
+
+    formatStateFree(f,&st);
+    return totlen;
+}
+
+int redisFormatCompiledCommand(char **target, const redisFormat *f, ...) {
+    va_list ap;
+    int len;
+    va_start(ap,f);
+    len = redisvFormatCompiledCommand(target,f,ap);
+    va_end(ap);
+    return len;
+}
+
+/* Compiled formats are cached per thread, see formatCacheGet. */
+#if defined(__GNUC__) && !defined(HIREDIS_NO_FORMAT_CACHE)
+#define HIREDIS_FORMAT_CACHE
+static redisFormat *formatCacheGet(const char *format);
+#else
+#define formatCacheGet(_format) NULL
+#endif
+
+/* Formats that are not cached are compiled for a single use, on the stack
+ * when they are no longer than this. */
+#define REDIS_FORMAT_STACK_LEN 128
+
+typedef struct redisFormatStack {
+    redisFormat f;
+    redisFormatOp ops[REDIS_FORMAT_STACK_LEN+1];
+    char text[REDIS_FORMAT_STACK_LEN*2+1];
+} redisFormatStack;
+
+/* Return the compiled format: the cached one, or one compiled on the stack or
+ * on the heap. Returns NULL when the format is invalid or out of memory. The
+ * format must be given back with formatRelease. */
+static const redisFormat *formatLookup(const char *format, redisFormatStack *stack) {
+    redisFormat *f;
+
+    f = formatCacheGet(format);
+    if (f != NULL)
+        return f;
+
+    if (strlen(format) > REDIS_FORMAT_STACK_LEN)
+        return redisFormatCompile(format);
+
+    f = &stack->f;
+    memset(f,0,sizeof(*f));
+    f->ops = stack->ops;
+    f->text = stack->text;
+    return (formatParse(f,format) == REDIS_OK) ? f : NULL;
+}
+
+/* Only formats compiled on the heap for a single use are free'd, cached ones
+ * have their key set. */
+static void formatRelease(const redisFormat *f, redisFormatStack *stack) {
+    if (f != NULL && f != &stack->f && f->key == NULL)
+        redisFormatFree((redisFormat*)f);
+}
+
+int redisvFormatCommand(char **target, const char *format, va_list ap) {
+    redisFormatStack stack;
+    const redisFormat *f;
+    int len;
+
+    /* Abort if there is not target to set */
+    if (target == NULL)
+        return -1;
+
+    f = formatLookup(format,&stack);
+    if (f == NULL)
+        return -1;
+
+    len = redisvFormatCompiledCommand(target,f,ap);
+    formatRelease(f,&stack);
+    return len;
 }
 
 /* Format a command according to the Redis protocol. This function
@@ -1167,78 +2365,187 @@ int redisFormatCommand(char **target, const char *format, ...) {
     return len;
 }
 
-/* Format a command according to the Redis protocol. This function takes the
- * number of arguments, an array with arguments and an array with their
- * lengths. If the latter is set to NULL, strlen will be used to compute the
- * argument lengths.
- */
-int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen) {
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    size_t len;
-    int totlen, j;
+/* Format a command into an array of sds arguments instead of the protocol.
+ * Returns the length the command has in the protocol, or -1 on errors. */
+int redisvFormatCommandArgList( char ***curargv, int *argc, const char *format, va_list ap ) {
+    redisFormatStack stack;
+    redisFormatState st;
+    const redisFormat *f;
+    char **newargv;
+    size_t pos = 0;
+    int totlen = -1, arg = -1, j;
 
-    /* Calculate number of bytes needed for the command */
-    totlen = 1+intlen(argc)+2;
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        totlen += bulklen(len);
+    /* Abort if there is not target to set */
+    if (curargv == NULL || argc == NULL)
+        return -1;
+
+    *argc = 0;
+    f = formatLookup(format,&stack);
+    if (f == NULL)
+        goto err;
+
+    totlen = formatArguments(f,&st,ap);
+    if (totlen >= 0 && f->argc > 0) {
+        newargv = realloc(*curargv,sizeof(char*)*f->argc);
+        if (newargv == NULL) {
+            totlen = -1;
+        } else {
+            *curargv = newargv;
+            for (j = 0; j < f->argc && totlen >= 0; j++) {
+                newargv[j] = sdsnewlen(NULL,st.lens[j]);
+                if (newargv[j] == NULL)
+                    totlen = -1;
+                else
+                    (*argc)++;
+            }
+        }
     }
 
-    /* Build the command at protocol level */
-    cmd = malloc(totlen+1);
-    if (cmd == NULL)
+    if (totlen >= 0) {
+        for (j = 0; j < f->nops; j++) {
+            if (f->ops[j].arg != arg) {
+                arg = f->ops[j].arg;
+                pos = 0;
+            }
+            if (st.pieces[j].len > 0) {
+                memcpy((*curargv)[arg]+pos,st.pieces[j].str,st.pieces[j].len);
+                pos += st.pieces[j].len;
+            }
+        }
+    }
+
+    formatStateFree(f,&st);
+    formatRelease(f,&stack);
+    if (totlen >= 0)
+        return totlen;
+
+err:
+    while((*argc)--)
+        sdsfree((*curargv)[*argc]);
+    free(*curargv);
+    *curargv = NULL;
+    *argc = 0;
+    return -1;
+}
+
+/* Format the arguments of a command into buf instead of the protocol: every
+ * argument is nul terminated, and argv and argvlen are set to point into buf.
+ * Returns the number of arguments, or -1 when the format is invalid or when
+ * there are more than maxargs arguments or they do not fit in size bytes.
+ * ap is consumed either way, so callers that want to fall back to
+ * redisvFormatCommandArgList have to pass a copy. */
+int redisvFormatArgvBuf(char *buf, size_t size, const char **argv, size_t *argvlen, int maxargs,
+                        const char *format, va_list ap)
+{
+    redisFormatStack stack;
+    redisFormatState st;
+    const redisFormat *f;
+    size_t used = 0;
+    int arg = -1, argc = -1, j;
+
+    f = formatLookup(format,&stack);
+    if (f == NULL)
         return -1;
+    if (formatArguments(f,&st,ap) < 0 || f->argc > maxargs)
+        goto done;
+    for (j = 0; j < f->argc; j++) {
+        used += st.lens[j]+1;
+        if (used > size)
+            goto done;
+    }
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        pos += sprintf(cmd+pos,"$%zu\r\n",len);
-        memcpy(cmd+pos,argv[j],len);
-        pos += len;
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
+    used = 0;
+    for (j = 0; j < f->nops; j++) {
+        if (f->ops[j].arg != arg) {
+            if (arg != -1)
+                buf[used++] = '\0';
+            arg = f->ops[j].arg;
+            argv[arg] = buf+used;
+            argvlen[arg] = st.lens[arg];
+        }
+        if (st.pieces[j].len > 0) {
+            memcpy(buf+used,st.pieces[j].str,st.pieces[j].len);
+            used += st.pieces[j].len;
+        }
     }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
+    if (arg != -1)
+        buf[used++] = '\0';
+    argc = f->argc;
+
+done:
+    formatStateFree(f,&st);
+    formatRelease(f,&stack);
+    return argc;
+}
 
-    *target = cmd;
-    return totlen;
+/* The formats used by a thread are compiled and kept in a small cache,
+ * indexed by their address. A format is only compiled when it is seen a
+ * second time at the same address, so formats built on the fly do not evict
+ * the ones used in a loop. A hit is checked against the text of the format,
+ * so a buffer that is reused for another format is never misread. */
+#define REDIS_FORMAT_CACHE_SIZE 64 /* Must be a power of two. */
+
+#ifdef HIREDIS_FORMAT_CACHE
+static __thread redisFormat *formatCache[REDIS_FORMAT_CACHE_SIZE];
+static __thread const char *formatSeen[REDIS_FORMAT_CACHE_SIZE];
+
+/* The cache of a thread is freed when it exits. */
+static pthread_once_t formatCacheOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t formatCacheKey;
+static int formatCacheKeyValid = 0;
+
+static void formatCacheDestroy(void *unused) {
+    (void)unused;
+    redisFormatCacheRelease();
 }
 
-int redisFormatCommandArgvList(char **target, int argc, const char **argv) {
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
-    size_t len;
-    int totlen, j;
+static void formatCacheKeyCreate(void) {
+    if (pthread_key_create(&formatCacheKey,formatCacheDestroy) == 0)
+        formatCacheKeyValid = 1;
+}
 
-    /* Calculate number of bytes needed for the command */
-    totlen = 1+intlen(argc)+2;
-    for (j = 0; j < argc; j++) {
-        len = strlen(argv[j]);
-        totlen += bulklen(len);
-    }
+static redisFormat *formatCacheGet(const char *format) {
+    uintptr_t h = (uintptr_t)format;
+    int idx = ((h>>3)^(h>>11)) & (REDIS_FORMAT_CACHE_SIZE-1);
+    redisFormat *f = formatCache[idx];
 
-    /* Build the command at protocol level */
-    cmd = malloc(totlen+1);
-    if (cmd == NULL)
-        return -1;
+    if (f != NULL && f->key == format && strcmp(f->format,format) == 0)
+        return f;
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        len = strlen(argv[j]);
-        pos += sprintf(cmd+pos,"$%zu\r\n",len);
-        memcpy(cmd+pos,argv[j],len);
-        pos += len;
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
+    /* Parse it the slow way the first time. */
+    if (formatSeen[idx] != format) {
+        formatSeen[idx] = format;
+        return NULL;
     }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
 
-    *target = cmd;
-    return totlen;
+    formatSeen[idx] = NULL;
+    f = redisFormatCompile(format);
+    if (f == NULL)
+        return NULL;
+    f->key = format;
+    pthread_once(&formatCacheOnce,formatCacheKeyCreate);
+    if (formatCacheKeyValid)
+        pthread_setspecific(formatCacheKey,formatCache);
+    redisFormatFree(formatCache[idx]);
+    formatCache[idx] = f;
+    return f;
+}
+#endif
+
+/* Free the formats cached by the calling thread. This is done when the thread
+ * exits, calling it earlier only gives the memory back sooner. */
+void redisFormatCacheRelease(void) {
+#ifdef HIREDIS_FORMAT_CACHE
+    int i;
+
+    for (i = 0; i < REDIS_FORMAT_CACHE_SIZE; i++) {
+        redisFormatFree(formatCache[i]);
+        formatCache[i] = NULL;
+        formatSeen[i] = NULL;
+    }
+#endif
 }
+
 void __redisSetError(redisContext *c, int type, const char *str) {
     size_t len;
 
@@ -1270,10 +2577,17 @@ static redisContext *redisContextInit(void) {
 }
 
 void redisFree(redisContext *c) {
+    int j;
+
     if (c->fd > 0)
         close(c->fd);
     if (c->obuf != NULL)
         sdsfree(c->obuf);
+    /* Borrowed buffers that were never written are released as well. */
+    for (j = 0; j < c->orefslen; j++)
+        if (c->orefs[j].fn != NULL)
+            c->orefs[j].fn(c->orefs[j].privdata);
+    free(c->orefs);
     if (c->reader != NULL)
         redisReaderFree(c->reader);
     free(c);
@@ -1336,15 +2650,42 @@ int redisSetTimeout(redisContext *c, struct timeval tv) {
  *
  * After this function is called, you may use redisContextReadReply to
  * see if there is a reply available. */
+/* Space to read the rest of a large bulk payload into, when the read buffer
+ * holds nothing else the reader still has to process. */
+static char *__redisReaderBulkSpace(redisReader *r, size_t *len) {
+    if (r->bulk == NULL || r->pos != r->len)
+        return NULL;
+
+    *len = r->bulklen-r->bulkpos;
+    if (*len > INT_MAX)
+        *len = INT_MAX;
+    return r->bulk+r->bulkpos;
+}
+
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
+    char *buf, *bulk;
+    size_t avail;
     int nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    nread = read(c->fd,buf,sizeof(buf));
+    /* Read into the reader's input buffer, or into a large bulk directly. */
+    bulk = __redisReaderBulkSpace(c->reader,&avail);
+    if (bulk != NULL) {
+        buf = bulk;
+    } else {
+        buf = redisReaderReserve(c->reader,REDIS_READ_SIZE,&avail);
+        if (buf == NULL) {
+            __redisSetError(c,c->reader->err,c->reader->errstr);
+            return REDIS_ERR;
+        }
+        if (avail > INT_MAX)
+            avail = INT_MAX;
+    }
+
+    nread = read(c->fd,buf,avail);
     if (nread == -1) {
         if (errno == EAGAIN && !(c->flags & REDIS_BLOCK)) {
             /* Try again later */
@@ -1355,12 +2696,110 @@ int redisBufferRead(redisContext *c) {
     } else if (nread == 0) {
         __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
         return REDIS_ERR;
+    } else if (bulk != NULL) {
+        c->reader->bulkpos += nread;
     } else {
-        if (redisReaderFeed(c->reader,buf,nread) != REDIS_OK) {
-            __redisSetError(c,c->reader->err,c->reader->errstr);
-            return REDIS_ERR;
+        redisReaderCommit(c->reader,nread);
+    }
+    return REDIS_OK;
+}
+
+/* Largest output buffer kept once everything in it was written. */
+#define REDIS_OUTPUT_KEEP (1024*16)
+
+/* Advance the send cursor of the output buffer by nwritten bytes. The
+ * written part is only dropped when at least as much was written as is left,
+ * so on average every byte is moved at most once, however the buffer is
+ * written. */
+static void __redisConsumeOutput(redisContext *c, size_t nwritten) {
+    size_t len = sdslen(c->obuf);
+    int j;
+
+    c->opos += nwritten;
+    if (c->opos == len) {
+        /* Keep small buffers, so appending the next command allocates
+         * nothing. */
+        if (len+sdsavail(c->obuf) <= REDIS_OUTPUT_KEEP) {
+            sdsclear(c->obuf);
+        } else {
+            sdsfree(c->obuf);
+            c->obuf = sdsempty();
+        }
+        c->opos = 0;
+    } else if (c->opos >= len-c->opos) {
+        c->obuf = sdsrange(c->obuf,c->opos,-1);
+        for (j = 0; j < c->orefslen; j++)
+            c->orefs[j].at -= c->opos;
+        c->opos = 0;
+    }
+}
+
+/* Most buffers passed to a single writev(2). */
+#define REDIS_WRITEV_MAX 64
+
+/* Write obuf interleaved with the borrowed buffers. */
+static int __redisBufferWritev(redisContext *c) {
+    struct iovec iov[REDIS_WRITEV_MAX];
+    redisOutputRef *ref;
+    size_t pos = c->opos, n;
+    ssize_t nwritten;
+    int iovcnt = 0, j;
+
+    for (j = 0; j < c->orefslen && iovcnt < REDIS_WRITEV_MAX-1; j++) {
+        ref = &c->orefs[j];
+        if (ref->at > pos) {
+            iov[iovcnt].iov_base = c->obuf+pos;
+            iov[iovcnt].iov_len = ref->at-pos;
+            iovcnt++;
+            pos = ref->at;
+        }
+        iov[iovcnt].iov_base = (char*)ref->buf;
+        iov[iovcnt].iov_len = ref->len;
+        iovcnt++;
+    }
+    if (j == c->orefslen && sdslen(c->obuf) > pos) {
+        iov[iovcnt].iov_base = c->obuf+pos;
+        iov[iovcnt].iov_len = sdslen(c->obuf)-pos;
+        iovcnt++;
+    }
+
+    nwritten = writev(c->fd,iov,iovcnt);
+    if (nwritten == -1) {
+        if (errno == EAGAIN && !(c->flags & REDIS_BLOCK)) {
+            /* Try again later */
+            return REDIS_OK;
+        }
+        __redisSetError(c,REDIS_ERR_IO,NULL);
+        return REDIS_ERR;
+    }
+
+    /* Walk the output in order to find what was written. */
+    pos = c->opos;
+    j = 0;
+    while (nwritten > 0) {
+        ref = &c->orefs[j];
+        if (j < c->orefslen && ref->at == pos) {
+            n = (size_t)nwritten < ref->len ? (size_t)nwritten : ref->len;
+            ref->buf += n;
+            ref->len -= n;
+            nwritten -= n;
+            if (ref->len > 0)
+                break;
+            if (ref->fn != NULL)
+                ref->fn(ref->privdata);
+            j++;
+        } else {
+            n = (j < c->orefslen ? ref->at : sdslen(c->obuf))-pos;
+            if ((size_t)nwritten < n)
+                n = nwritten;
+            pos += n;
+            nwritten -= n;
         }
     }
+
+    c->orefslen -= j;
+    memmove(c->orefs,c->orefs+j,c->orefslen*sizeof(*c->orefs));
+    __redisConsumeOutput(c,pos-c->opos);
     return REDIS_OK;
 }
 
@@ -1380,8 +2819,11 @@ int redisBufferWrite(redisContext *c, int *done) {
     if (c->err)
         return REDIS_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+    if (c->orefslen > 0) {
+        if (__redisBufferWritev(c) != REDIS_OK)
+            return REDIS_ERR;
+    } else if (sdslen(c->obuf) > c->opos) {
+        nwritten = write(c->fd,c->obuf+c->opos,sdslen(c->obuf)-c->opos);
         if (nwritten == -1) {
             if (errno == EAGAIN && !(c->flags & REDIS_BLOCK)) {
                 /* Try again later */
@@ -1390,15 +2832,10 @@ int redisBufferWrite(redisContext *c, int *done) {
                 return REDIS_ERR;
             }
         } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                c->obuf = sdsrange(c->obuf,nwritten,-1);
-            }
+            __redisConsumeOutput(c,nwritten);
         }
     }
-    if (done != NULL) *done = (sdslen(c->obuf) == 0);
+    if (done != NULL) *done = (sdslen(c->obuf) == 0 && c->orefslen == 0);
     return REDIS_OK;
 }
 
@@ -1462,25 +2899,83 @@ int __redisAppendCommand(redisContext *c, char *cmd, size_t len) {
     return REDIS_OK;
 }
 
-int redisvAppendCommand(redisContext *c, const char *format, va_list ap) {
-    char *cmd;
+/* Append a command that is already in the protocol format, e.g. built by
+ * redisFormatCommand. */
+int redisAppendFormattedCommand(redisContext *c, const char *cmd, size_t len) {
+    return __redisAppendCommand(c,(char*)cmd,len);
+}
+
+/* Encode a command straight into the free space of the output buffer,
+ * instead of formatting it into a temporary buffer first. */
+static int __redisAppendCommandLens(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
+    sds newbuf;
     int len;
 
-    len = redisvFormatCommand(&cmd,format,ap);
+    len = commandLength(argc,argvlen);
     if (len == -1) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
-        free(cmd);
+    newbuf = sdsMakeRoomFor(c->obuf,len);
+    if (newbuf == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    c->obuf = newbuf;
+    writeCommand(c->obuf+sdslen(c->obuf),argc,argv,argvlen);
+    sdsIncrLen(c->obuf,len);
+    return REDIS_OK;
+}
+
+int redisvAppendCompiledCommand(redisContext *c, const redisFormat *f, va_list ap) {
+    redisFormatState st;
+    sds newbuf = NULL;
+    int len;
+
+    len = formatArguments(f,&st,ap);
+    if (len >= 0)
+        newbuf = sdsMakeRoomFor(c->obuf,len);
+    if (newbuf == NULL) {
+        formatStateFree(f,&st);
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    free(cmd);
+    c->obuf = newbuf;
+    formatWrite(f,&st,c->obuf+sdslen(c->obuf));
+    sdsIncrLen(c->obuf,len);
+    formatStateFree(f,&st);
     return REDIS_OK;
 }
 
+int redisAppendCompiledCommand(redisContext *c, const redisFormat *f, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap,f);
+    ret = redisvAppendCompiledCommand(c,f,ap);
+    va_end(ap);
+    return ret;
+}
+
+int redisvAppendCommand(redisContext *c, const char *format, va_list ap) {
+    redisFormatStack stack;
+    const redisFormat *f;
+    int ret;
+
+    f = formatLookup(format,&stack);
+    if (f == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    ret = redisvAppendCompiledCommand(c,f,ap);
+    formatRelease(f,&stack);
+    return ret;
+}
+
 int redisAppendCommand(redisContext *c, const char *format, ...) {
     va_list ap;
     int ret;
@@ -1492,42 +2987,104 @@ int redisAppendCommand(redisContext *c, const char *format, ...) {
 }
 
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
-    char *cmd;
-    int len;
+    size_t stack[REDIS_FORMAT_STACK_ARGS];
+    const size_t *lens;
+    int ret;
 
-    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
-    if (len == -1) {
+    lens = argvLengths(argc,argv,argvlen,stack);
+    if (lens == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
-        free(cmd);
-        return REDIS_ERR;
-    }
-
-    free(cmd);
-    return REDIS_OK;
+    ret = __redisAppendCommandLens(c,argc,argv,lens);
+    if (lens != argvlen && lens != stack)
+        free((void*)lens);
+    return ret;
 }
 
 int redisAppendCommandArgvList(redisContext *c, int argc, const char **argv) {
-    char *cmd;
-    int len;
+    return redisAppendCommandArgv(c,argc,argv,NULL);
+}
 
-    len = redisFormatCommandArgvList(&cmd,argc,argv);
-    if (len == -1) {
+int redisAppendCommandArgvBorrowed(redisContext *c, int argc, const char **argv, const size_t *argvlen,
+                                   redisReleaseCallback *fn, void *privdata) {
+    size_t stack[REDIS_FORMAT_STACK_ARGS];
+    const size_t *lens;
+    redisOutputRef *orefs, *ref = NULL;
+    size_t len;
+    char *start, *p;
+    int borrowed = 0, j;
+
+    lens = argvLengths(argc,argv,argvlen,stack);
+    if (lens == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
 
-    if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
-        free(cmd);
-        return REDIS_ERR;
+    /* Only headers and small arguments are copied to the output buffer. */
+    len = 1+intlen(argc)+2;
+    for (j = 0; j < argc; j++) {
+        if (lens[j] >= REDIS_OUTPUT_BORROW_MIN) {
+            len += 1+intlen(lens[j])+2+2;
+            borrowed++;
+        } else {
+            len += bulklen(lens[j]);
+        }
+    }
+
+    if (c->orefslen+borrowed > c->orefscap) {
+        orefs = realloc(c->orefs,(c->orefslen+borrowed)*2*sizeof(*orefs));
+        if (orefs == NULL)
+            goto oom;
+        c->orefs = orefs;
+        c->orefscap = (c->orefslen+borrowed)*2;
+    }
+
+    p = sdsMakeRoomFor(c->obuf,len);
+    if (p == NULL)
+        goto oom;
+    c->obuf = p;
+
+    start = p = c->obuf+sdslen(c->obuf);
+    p = writeHeader(p,'*',argc);
+    for (j = 0; j < argc; j++) {
+        p = writeHeader(p,'$',lens[j]);
+        if (lens[j] >= REDIS_OUTPUT_BORROW_MIN) {
+            ref = &c->orefs[c->orefslen++];
+            ref->at = p-c->obuf;
+            ref->buf = argv[j];
+            ref->len = lens[j];
+            ref->fn = NULL;
+            ref->privdata = NULL;
+        } else {
+            memcpy(p,argv[j],lens[j]);
+            p += lens[j];
+        }
+        *p++ = '\r';
+        *p++ = '\n';
     }
+    sdsIncrLen(c->obuf,p-start);
+
+    if (lens != argvlen && lens != stack)
+        free((void*)lens);
 
-    free(cmd);
+    /* The release callback goes with the last borrowed buffer. */
+    if (ref != NULL) {
+        ref->fn = fn;
+        ref->privdata = privdata;
+    } else if (fn != NULL) {
+        fn(privdata);
+    }
     return REDIS_OK;
+
+oom:
+    if (lens != argvlen && lens != stack)
+        free((void*)lens);
+    __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+    return REDIS_ERR;
 }
+
 /* Helper function for the redisCommand* family of functions.
  *
  * Write a formatted command to the output buffer. If the given context is
@@ -1565,6 +3122,16 @@ void *redisCommand(redisContext *c, const char *format, ...) {
     return reply;
 }
 
+void *redisCompiledCommand(redisContext *c, const redisFormat *f, ...) {
+    va_list ap;
+    void *reply = NULL;
+    va_start(ap,f);
+    if (redisvAppendCompiledCommand(c,f,ap) == REDIS_OK)
+        reply = __redisBlockForReply(c);
+    va_end(ap);
+    return reply;
+}
+
 void *redisCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
     if (redisAppendCommandArgv(c,argc,argv,argvlen) != REDIS_OK)
         return NULL;
@@ -33,6 +33,7 @@
 #define __HIREDIS_H
 #include <stdio.h> /* for size_t */
 #include <stdarg.h> /* for va_list */
+#include <stdint.h> /* for uint32_t */
 #include <sys/time.h> /* for struct timeval */
 
 #define HIREDIS_MAJOR 0
@@ -87,19 +88,29 @@
 #define REDIS_REPLY_ERROR 6
 
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
+#define REDIS_READER_MIN_BUF 1024 /* Smallest reader buffer allocated. */
+#define REDIS_READ_SIZE (1024*16) /* Room reserved for every read(2). */
+#define REDIS_READER_BIG_BULK (1024*64) /* Default size of a large bulk. */
+#define REDIS_READER_MAX_BIG_BULK (1024*1024*512) /* Largest bulk Redis sends. */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* This is the reply object returned by redisCommand() */
+/* Flags of a reply node */
+#define REDIS_REPLY_POOLED 0x1 /* Taken from the reply pool */
+#define REDIS_REPLY_STR_INLINE 0x2 /* str is stored right after the node */
+
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
+    int flags; /* REDIS_REPLY_POOLED, REDIS_REPLY_STR_INLINE */
     long long integer; /* The integer when type is REDIS_REPLY_INTEGER */
     int len; /* Length of string */
     char *str; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    void *buffer; /* Reader buffer str points into for zero-copy strings */
 } redisReply;
 
 typedef struct redisReadTask {
@@ -119,14 +130,28 @@ typedef struct redisReplyObjectFunctions {
     void (*freeObject)(void*);
 } redisReplyObjectFunctions;
 
+/* Callbacks for streaming replies, see redisReaderSetCallbacks. The depth of
+ * the reply itself is 0, elements of an array at depth n are at depth n+1.
+ * string is called for REDIS_REPLY_STRING, _STATUS and _ERROR items; str is
+ * only valid during the call. When the reader fails halfway through a reply,
+ * no further callbacks are invoked for it. */
+typedef struct redisReplyCallbacks {
+    void (*beginArray)(void *privdata, int depth, int elements);
+    void (*endArray)(void *privdata, int depth);
+    void (*string)(void *privdata, int depth, int type, const char *str, size_t len);
+    void (*integer)(void *privdata, int depth, long long value);
+    void (*nil)(void *privdata, int depth);
+} redisReplyCallbacks;
+
 /* State for the protocol parser */
 typedef struct redisReader {
     int err; /* Error flags, 0 when there is no error */
     char errstr[128]; /* String representation of error when applicable */
 
     char *buf; /* Read buffer */
-    size_t pos; /* Buffer cursor */
-    size_t len; /* Buffer length */
+    size_t pos; /* Read cursor: bytes before it were consumed */
+    size_t len; /* Write cursor: bytes before it were received */
+    size_t cap; /* Allocated size of buf */
     size_t maxbuf; /* Max length of unused buffer */
 
     redisReadTask rstack[9];
@@ -135,13 +160,33 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+
+    /* Bulk strings of at least this many bytes are not copied out of the
+     * read buffer: the replies point into it and keep it alive until they
+     * are free'd. Only used with the default reply object functions. 0
+     * disables zero-copy replies. */
+    size_t zerocopy;
+    void *pinned; /* Read buffer shared with zero-copy replies */
+
+    /* Bulk payloads of at least this many bytes are received into a single
+     * allocation of their final size. redisBufferRead reads them from the
+     * socket straight into it. 0 disables this. */
+    size_t bigbulk;
+    char *bulk; /* Large bulk being received, with its trailing \r\n */
+    size_t bulklen;
+    size_t bulkpos; /* Bytes of the bulk received so far */
+
+    redisReplyCallbacks *callbacks; /* Set in streaming mode */
 } redisReader;
 
 /* Public API for the protocol parser. */
 redisReader *redisReaderCreate(void);
 void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
+char *redisReaderReserve(redisReader *r, size_t len, size_t *avail);
+int redisReaderCommit(redisReader *r, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
+void redisReaderSetCallbacks(redisReader *r, redisReplyCallbacks *callbacks);
 
 /* Backwards compatibility, can be removed on big version bump. */
 #define redisReplyReaderCreate redisReaderCreate
@@ -155,10 +200,119 @@ int redisReaderGetReply(redisReader *r, void **reply);
 /* Function to free the reply objects hiredis returns by default. */
 void freeReplyObject(void *reply);
 
+
+/* Compact reply object: a 32 byte node. Strings shorter than
+ * REDIS_COMPACT_INLINE bytes are stored in the node itself, the elements of an
+ * array are stored in a single vector of nodes. Use the accessors below
+ * instead of the fields. */
+#define REDIS_COMPACT_INLINE 24
+#define REDIS_COMPACT_STR_INLINE 0x1
+
+typedef struct redisCompactReply {
+    unsigned char type; /* REDIS_REPLY_* */
+    unsigned char flags; /* REDIS_COMPACT_STR_INLINE when str is inline */
+    uint32_t len; /* Length of string, or number of elements */
+    union {
+        char buf[REDIS_COMPACT_INLINE]; /* Short strings, NUL-terminated */
+        char *str;
+        long long integer;
+        struct redisCompactReply *element;
+    } u;
+} redisCompactReply;
+
+#define redisCompactType(_r) ((_r)->type)
+#define redisCompactStr(_r) (((_r)->flags & REDIS_COMPACT_STR_INLINE) ? (_r)->u.buf : (_r)->u.str)
+#define redisCompactLen(_r) ((_r)->len)
+#define redisCompactInteger(_r) ((_r)->u.integer)
+#define redisCompactElements(_r) ((_r)->len)
+#define redisCompactElement(_r,_i) (&(_r)->u.element[_i])
+
+/* Reply object functions creating redisCompactReply objects. Only the root
+ * of a reply can be free'd, with freeCompactReplyObject. */
+extern redisReplyObjectFunctions redisCompactFunctions;
+void freeCompactReplyObject(void *reply);
+
+/* Reply object functions that recycle redisReply nodes through per-thread
+ * free lists and store strings shorter than 40 bytes in the same allocation
+ * as their node. Set reader->fn to use them. Such replies are free'd with
+ * freeReplyObject (or freePooledReplyObject), and can be mixed with default
+ * replies in a tree; their str can neither be free'd nor replaced.
+ * The nodes kept by a thread are freed when it exits, or earlier by
+ * redisReplyPoolRelease. */
+extern redisReplyObjectFunctions redisPooledFunctions;
+void freePooledReplyObject(void *reply);
+void redisReplyPoolRelease(void);
+
+/* Reply object functions that allocate every reply tree from a single arena
+ * instead of one allocation per object. Set reader->fn to use them. Such
+ * replies must be free'd as a whole with freeArenaReplyObject: elements can
+ * neither be free'd nor kept after the root is free'd. */
+extern redisReplyObjectFunctions redisArenaFunctions;
+void freeArenaReplyObject(void *reply);
+
+/* Reply object created by redisColumnarFunctions. An array of strings is
+ * decoded into one payload buffer instead of an object per element: value i
+ * is the len[i] bytes at data+offset[i], followed by a '\0', unless it is
+ * nil. Integer elements are stored as their decimal representation, nested
+ * arrays can't be decoded. For replies other than arrays, type is set
+ * accordingly and an error, status or string is stored as value 0. */
+typedef struct redisColumns {
+    int type; /* REDIS_REPLY_* */
+    long long integer; /* The integer when type is REDIS_REPLY_INTEGER */
+    size_t count; /* Number of values */
+    size_t slots; /* Number of values there is room for */
+    size_t *offset; /* Start of each value in data */
+    size_t *len; /* Length of each value */
+    unsigned char *nil; /* Bitmap with a bit set for every nil value */
+    char *data; /* Payload of all values */
+    size_t size; /* Used bytes of data */
+    size_t cap; /* Allocated bytes of data */
+} redisColumns;
+
+#define redisColumnsIsNil(_c,_i) (((_c)->nil[(_i)/8] >> ((_i)%8)) & 1)
+#define redisColumnsValue(_c,_i) ((_c)->data+(_c)->offset[_i])
+
+/* Reply object functions creating a redisColumns for every reply. Free
+ * those replies with freeColumnsObject. */
+extern redisReplyObjectFunctions redisColumnarFunctions;
+redisColumns *redisColumnsCreate(int type, size_t slots);
+int redisColumnsAppend(redisColumns *c, const char *str, size_t len);
+void redisColumnsAppendNil(redisColumns *c);
+void freeColumnsObject(void *reply);
+
 /* Functions to format a command according to the protocol. */
 int redisvFormatCommand(char **target, const char *format, va_list ap);
 int redisFormatCommand(char **target, const char *format, ...);
 int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen);
+int redisFormatCommandArgvBuf(char *buf, size_t size, int argc, const char **argv, const size_t *argvlen);
+
+/* Format string parsed once by redisFormatCompile, to format many commands
+ * with. The formats given to redisCommand and friends are compiled and
+ * cached per thread as well, from their second use on; they are freed when
+ * the thread exits, or earlier by redisFormatCacheRelease. */
+typedef struct redisFormat redisFormat;
+redisFormat *redisFormatCompile(const char *format);
+void redisFormatFree(redisFormat *f);
+int redisvFormatCompiledCommand(char **target, const redisFormat *f, va_list ap);
+int redisFormatCompiledCommand(char **target, const redisFormat *f, ...);
+void redisFormatCacheRelease(void);
+
+/* Called when the caller's argument buffers of a command appended with
+ * redisAppendCommandArgvBorrowed are no longer used. */
+typedef void (redisReleaseCallback)(void *privdata);
+
+/* Caller buffer written to the socket after the first at bytes of obuf. */
+typedef struct redisOutputRef {
+    size_t at;
+    const char *buf;
+    size_t len; /* Bytes left to write */
+    redisReleaseCallback *fn; /* Set on the last buffer of a command */
+    void *privdata;
+} redisOutputRef;
+
+/* Arguments of at least this many bytes are borrowed, not copied, by
+ * redisAppendCommandArgvBorrowed. */
+#define REDIS_OUTPUT_BORROW_MIN (1024*16)
 
 /* Context for a connection to Redis */
 typedef struct redisContext {
@@ -167,7 +321,12 @@ typedef struct redisContext {
     int fd;
     int flags;
     char *obuf; /* Write buffer */
+    size_t opos; /* Bytes of obuf already written */
     redisReader *reader; /* Protocol reader */
+
+    redisOutputRef *orefs; /* Borrowed buffers, in output order */
+    int orefslen;
+    int orefscap;
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
@@ -193,6 +352,17 @@ int redisGetReplyFromReader(redisContext *c, void **reply);
 int redisvAppendCommand(redisContext *c, const char *format, va_list ap);
 int redisAppendCommand(redisContext *c, const char *format, ...);
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
+int redisAppendFormattedCommand(redisContext *c, const char *cmd, size_t len);
+int redisvAppendCompiledCommand(redisContext *c, const redisFormat *f, va_list ap);
+int redisAppendCompiledCommand(redisContext *c, const redisFormat *f, ...);
+
+/* Append a command without copying its large arguments into the output
+ * buffer: they are written from the buffers of the caller with writev(2).
+ * Those buffers must stay valid and unchanged until fn is called, which
+ * happens once they were written, right away when no argument was large
+ * enough to be borrowed, or from redisFree. fn must not use the context. */
+int redisAppendCommandArgvBorrowed(redisContext *c, int argc, const char **argv, const size_t *argvlen,
+                                   redisReleaseCallback *fn, void *privdata);
 
 /* Issue a command to Redis. In a blocking context, it is identical to calling
  * redisAppendCommand, followed by redisGetReply. The function will return
@@ -201,9 +371,12 @@ int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const s
  * only redisAppendCommand and will always return NULL. */
 void *redisvCommand(redisContext *c, const char *format, va_list ap);
 void *redisCommand(redisContext *c, const char *format, ...);
+void *redisCompiledCommand(redisContext *c, const redisFormat *f, ...);
 void *redisCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
 void *redisCommandArgvList(redisContext *c, int argc, const char **argv);
 int redisvFormatCommandArgList( char ***curargv, int *argc, const char *format, va_list ap );
+int redisvFormatArgvBuf(char *buf, size_t size, const char **argv, size_t *argvlen, int maxargs,
+                        const char *format, va_list ap);
 redisReply *createReplyObject(int type);
 
 #ifdef __cplusplus
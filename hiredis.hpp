@@ -0,0 +1,180 @@
+#ifndef __HIREDIS_HPP
+#define __HIREDIS_HPP
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "hiredis.h"
+
+/* Commands built from C++ values, requires C++17. The command name is a
+ * template argument, so the multi bulk header and the bulk of the name are
+ * generated at compile time:
+ *
+ *   static constexpr char SET[] = "SET";
+ *   hiredis::append(c,hiredis::cmd<SET>(key,42));
+ *
+ * Arguments are strings (anything convertible to std::string_view, so binary
+ * data works) or integers, which are written with std::to_chars. Strings are
+ * not copied, they have to outlive the command object. */
+
+namespace hiredis {
+
+namespace detail {
+
+constexpr std::size_t digits(std::size_t v) {
+    std::size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+/* Length of "$<len>\r\n<bytes>\r\n" */
+constexpr std::size_t bulklen(std::size_t len) {
+    return 1+digits(len)+2+len+2;
+}
+
+/* Write "<type><v>\r\n" and return a pointer past it. */
+constexpr char *writeHeader(char *p, char type, std::size_t v) {
+    std::size_t n = digits(v);
+    *p++ = type;
+    for (std::size_t i = n; i > 0; i--) {
+        p[i-1] = '0'+v%10;
+        v /= 10;
+    }
+    p += n;
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+/* "*<argc>\r\n$<len>\r\n<name>\r\n" */
+template <const char *Name, std::size_t Argc>
+struct prefix {
+    static constexpr std::size_t namelen = std::char_traits<char>::length(Name);
+    static constexpr std::size_t size = 1+digits(Argc)+2+bulklen(namelen);
+
+    static constexpr std::array<char,size> build() {
+        std::array<char,size> a{};
+        char *p = writeHeader(a.data(),'*',Argc);
+        p = writeHeader(p,'$',namelen);
+        for (std::size_t i = 0; i < namelen; i++)
+            *p++ = Name[i];
+        *p++ = '\r';
+        *p = '\n';
+        return a;
+    }
+
+    static constexpr std::array<char,size> value = build();
+};
+
+template <class T>
+constexpr bool is_number_v = std::is_integral_v<T> &&
+    !std::is_same_v<T,bool> && !std::is_same_v<T,char>;
+
+/* A single argument. Integers are formatted into the object itself. */
+class arg {
+public:
+    template <class T, std::enable_if_t<is_number_v<T>,int> = 0>
+    arg(T v) : str(nullptr) {
+        static_assert(sizeof(T) <= 8, "integer argument is too wide");
+        len = std::to_chars(buf,buf+sizeof(buf),v).ptr-buf;
+    }
+    arg(std::string_view s) : str(s.data()), len(s.size()) {}
+
+    const char *data() const { return str ? str : buf; }
+    std::size_t size() const { return len; }
+
+private:
+    const char *str;
+    std::size_t len;
+    char buf[24];
+};
+
+} /* namespace detail */
+
+template <const char *Name, std::size_t N>
+class command {
+public:
+    template <class... Args>
+    explicit command(const Args&... args) : argv{{detail::arg(args)...}} {}
+
+    /* Length of the command in the protocol format. */
+    std::size_t size() const {
+        std::size_t len = prefix::size;
+        for (const auto &a : argv)
+            len += detail::bulklen(a.size());
+        return len;
+    }
+
+    /* Write size() bytes to buf and return a pointer past them. */
+    char *write(char *buf) const {
+        std::memcpy(buf,prefix::value.data(),prefix::size);
+        buf += prefix::size;
+        for (const auto &a : argv) {
+            buf = detail::writeHeader(buf,'$',a.size());
+            std::memcpy(buf,a.data(),a.size());
+            buf += a.size();
+            *buf++ = '\r';
+            *buf++ = '\n';
+        }
+        return buf;
+    }
+
+    std::string str() const {
+        std::string s(size(),'\0');
+        write(s.data());
+        return s;
+    }
+
+private:
+    using prefix = detail::prefix<Name,N+1>;
+    std::array<detail::arg,N> argv;
+};
+
+template <const char *Name, class... Args>
+command<Name,sizeof...(Args)> cmd(const Args&... args) {
+    return command<Name,sizeof...(Args)>(args...);
+}
+
+/* Like redisAppendCommand. Commands up to 512 bytes are built on the stack,
+ * the output buffer gets a single copy of them. */
+template <const char *Name, std::size_t N>
+int append(redisContext *c, const command<Name,N> &cmd) {
+    char stackbuf[512];
+    std::unique_ptr<char[]> heapbuf;
+    std::size_t len = cmd.size();
+    char *buf = stackbuf;
+
+    if (len > sizeof(stackbuf)) {
+        heapbuf.reset(new char[len]);
+        buf = heapbuf.get();
+    }
+    cmd.write(buf);
+    return redisAppendFormattedCommand(c,buf,len);
+}
+
+/* Like redisCommand: in a blocking context the reply is returned, NULL is
+ * returned on error and in a non-blocking context. */
+template <const char *Name, std::size_t N>
+redisReply *call(redisContext *c, const command<Name,N> &cmd) {
+    void *reply;
+
+    if (append(c,cmd) != REDIS_OK)
+        return nullptr;
+    if (!(c->flags & REDIS_BLOCK))
+        return nullptr;
+    if (redisGetReply(c,&reply) != REDIS_OK)
+        return nullptr;
+    return static_cast<redisReply*>(reply);
+}
+
+} /* namespace hiredis */
+
+#endif
@@ -0,0 +1,855 @@
+#include    "fmacros.h"
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <time.h>
+#include    "sds.h"
+#include    "dict.h"
+#include    "proxy-async.h"
+
+#define PROXY_NOTUSED(V) ((void) V)
+
+/* Container for a regular command callback: the callback hiredis invokes is
+ * translated to the proxyAsyncCallbackFn given by the caller. */
+typedef struct proxyAsyncCallback {
+    proxyAsyncContext *pac;
+    proxyAsyncCallbackFn *fn;
+    void *privdata;
+} proxyAsyncCallback;
+
+typedef struct proxySubscriber {
+    struct proxySubscriber *next;
+    proxyAsyncCallbackFn *fn; /* NULL when removed while dispatching */
+    void *privdata;
+} proxySubscriber;
+
+/* A channel or pattern with one or more local subscribers. */
+typedef struct proxySubscription {
+    proxyAsyncContext *pac;
+    sds name;
+    int pattern;
+    int upstreams;     /* Servers where the (P)SUBSCRIBE is active or pending */
+    int unsubscribing; /* (P)UNSUBSCRIBE sent, waiting for the confirmations */
+    int lost;          /* An upstream connection went away */
+    int dispatching;
+    proxySubscriber *subscribers;
+} proxySubscription;
+
+static unsigned int subscriptionHash(const void *key) {
+    return dictGenHashFunction((const unsigned char *)key, sdslen((const sds)key));
+}
+
+static int subscriptionKeyCompare(void *privdata, const void *key1, const void *key2) {
+    DICT_NOTUSED(privdata);
+    size_t l1 = sdslen((const sds)key1);
+    size_t l2 = sdslen((const sds)key2);
+    if( l1 != l2 ) return 0;
+    return memcmp(key1,key2,l1) == 0;
+}
+
+/* sds name -> proxySubscription. The key is owned by the subscription. */
+static dictType subscriptionDictType = {
+    subscriptionHash,          /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    subscriptionKeyCompare,    /* key compare */
+    NULL,                      /* key destructor */
+    NULL                       /* val destructor */
+};
+
+static int getAsyncContextIdx( proxyAsyncContext *pac, const redisAsyncContext *ac ) {
+    for( int i = 0; i < pac->count; i++ ) {
+        if( pac->contexts[i] == ac )
+            return i;
+    }
+
+    return -1;
+}
+
+static void failAsyncQueue( proxyAsyncContext *pac, int idx );
+
+/* The context is free'd by hiredis right after this, so it must no longer be
+ * used for routing. Commands still queued for it get a NULL reply. */
+static void detachAsyncContext( const redisAsyncContext *ac ) {
+    proxyAsyncContext *pac = ac->data;
+    int idx = getAsyncContextIdx( pac, ac );
+    if( idx >= 0 ) {
+        pac->contexts[idx] = NULL;
+        pac->p->contexts[idx] = NULL;
+        if( pac->queues )
+            failAsyncQueue( pac, idx );
+    }
+
+    for( int i = 0; i < pac->count; i++ ) {
+        if( pac->subcontexts[i] == ac )
+            pac->subcontexts[i] = NULL;
+    }
+}
+
+static void proxyAsyncConnectCallback( const redisAsyncContext *ac, int status ) {
+    proxyAsyncContext *pac = ac->data;
+    if( status != REDIS_OK )
+        detachAsyncContext( ac );
+    if( pac->onConnect )
+        pac->onConnect( ac, status );
+}
+
+static void proxyAsyncTimerCallback( redisAsyncContext *ac );
+
+static void proxyAsyncDisconnectCallback( const redisAsyncContext *ac, int status ) {
+    proxyAsyncContext *pac = ac->data;
+    detachAsyncContext( ac );
+    if( pac->onDisconnect )
+        pac->onDisconnect( ac, status );
+}
+
+static redisAsyncContext *connectAsyncContext( proxyAsyncContext *pac, redisAddr *addr ) {
+    redisAsyncContext *ac = redisAsyncConnect(addr->ip, addr->port);
+    if( ac == NULL )
+        return NULL;
+
+    if( ac->err ) {
+        printf("Connection Error: %s[%d] %s\n", addr->ip, addr->port, ac->errstr);
+        redisAsyncFree(ac);
+        return NULL;
+    }
+
+    ac->data = pac;
+    redisAsyncSetConnectCallback(ac, proxyAsyncConnectCallback);
+    redisAsyncSetDisconnectCallback(ac, proxyAsyncDisconnectCallback);
+    return ac;
+}
+
+proxyAsyncContext *proxyAsyncConnect( redisAddr *addrs, int count ) {
+    proxyAsyncContext *pac;
+    redisContext **contexts;
+
+    pac = calloc(1,sizeof(proxyAsyncContext));
+    if( pac == NULL )
+        return NULL;
+
+    pac->contexts = calloc(count, sizeof(redisAsyncContext *));
+    pac->subcontexts = calloc(count, sizeof(redisAsyncContext *));
+    contexts = calloc(count, sizeof(redisContext *));
+    if( pac->contexts == NULL || pac->subcontexts == NULL || contexts == NULL ) {
+        free(contexts);
+        free(pac->subcontexts);
+        free(pac->contexts);
+        free(pac);
+        return NULL;
+    }
+
+    pac->count = count;
+    for( int i = 0; i < count; i++ ) {
+        redisAsyncContext *ac = connectAsyncContext( pac, &addrs[i] );
+        if( ac == NULL )
+            continue;
+
+        redisAsyncSetTimerCallback(ac, proxyAsyncTimerCallback);
+        pac->contexts[i] = ac;
+        contexts[i] = &ac->c;
+
+        /* A subscribed connection only takes (P)(UN)SUBSCRIBE, so
+         * subscriptions get a connection of their own. */
+        pac->subcontexts[i] = connectAsyncContext( pac, &addrs[i] );
+    }
+
+    pac->p = proxyContextWithConnections( addrs, contexts, count );
+    free(contexts);
+    pac->channels = dictCreate(&subscriptionDictType,NULL);
+    pac->patterns = dictCreate(&subscriptionDictType,NULL);
+    if( pac->p == NULL ) {
+        proxyAsyncFree(pac);
+        return NULL;
+    }
+
+    return pac;
+}
+
+redisAsyncContext *proxyAsyncGetContext( proxyAsyncContext *pac, int idx ) {
+    if( pac && idx >= 0 && idx < pac->count )
+        return pac->contexts[idx];
+
+    return NULL;
+}
+
+redisAsyncContext *proxyAsyncGetSubscribeContext( proxyAsyncContext *pac, int idx ) {
+    if( pac && idx >= 0 && idx < pac->count )
+        return pac->subcontexts[idx];
+
+    return NULL;
+}
+
+void proxyAsyncSetConnectCallback( proxyAsyncContext *pac, redisConnectCallback *fn ) {
+    pac->onConnect = fn;
+}
+
+void proxyAsyncSetDisconnectCallback( proxyAsyncContext *pac, redisDisconnectCallback *fn ) {
+    pac->onDisconnect = fn;
+}
+
+/* Free every connection. Pending callbacks and subscribers are invoked with
+ * a NULL reply, as redisAsyncFree does. */
+void proxyAsyncFree( proxyAsyncContext *pac ) {
+    if( pac == NULL )
+        return;
+
+    /* Queued commands are moved to the output buffers, so redisAsyncFree
+     * invokes their callbacks with a NULL reply like the others. */
+    proxyAsyncFlush( pac );
+    free(pac->queues);
+    pac->queues = NULL;
+
+    for( int i = 0; i < pac->count; i++ ) {
+        redisAsyncContext *ac = pac->contexts[i];
+        if( ac ) {
+            pac->contexts[i] = NULL;
+            if( pac->p )
+                pac->p->contexts[i] = NULL;
+            redisAsyncFree(ac);
+        }
+
+        ac = pac->subcontexts[i];
+        if( ac ) {
+            pac->subcontexts[i] = NULL;
+            redisAsyncFree(ac);
+        }
+    }
+
+    /* The embedded redisContexts were free'd with their async contexts. */
+    destroyProxyContext(pac->p);
+    if( pac->channels )
+        dictRelease(pac->channels);
+    if( pac->patterns )
+        dictRelease(pac->patterns);
+    free(pac->subcontexts);
+    free(pac->contexts);
+    free(pac);
+}
+
+static redisAsyncContext *getFirstAsyncContext( proxyAsyncContext *pac ) {
+    for( int i = 0; i < pac->count; i++ ) {
+        if( pac->contexts[i] )
+            return pac->contexts[i];
+    }
+
+    return NULL;
+}
+
+/* The async context owning a key, found with the same continuum as the
+ * blocking proxy. */
+static redisAsyncContext *lookupAsyncContextWithKey( proxyAsyncContext *pac, const char *key, size_t len ) {
+    redisContext *c = lookupRedisServerWithKeyLen( pac->p, key, len );
+    if( c == NULL )
+        return NULL;
+
+    for( int i = 0; i < pac->count; i++ ) {
+        if( pac->contexts[i] && &pac->contexts[i]->c == c )
+            return pac->contexts[i];
+    }
+
+    return NULL;
+}
+
+static void proxyAsyncReplyCallback( redisAsyncContext *ac, void *reply, void *privdata ) {
+    PROXY_NOTUSED(ac);
+    proxyAsyncCallback *cb = privdata;
+    if( cb->fn )
+        cb->fn( cb->pac, reply, cb->privdata );
+    free(cb);
+}
+
+static int isSubscribeCommand( const char *cmd, size_t len ) {
+    if( len > 0 && (cmd[0] == 'p' || cmd[0] == 'P') ) {
+        cmd++;
+        len--;
+    }
+
+    return (len == 9 && strncasecmp(cmd, "subscribe", 9) == 0) ||
+        (len == 11 && strncasecmp(cmd, "unsubscribe", 11) == 0);
+}
+
+/* A queued command. The callback comes first, so once the command is sent
+ * the request is free'd by proxyAsyncReplyCallback like any callback. */
+typedef struct proxyAsyncRequest {
+    proxyAsyncCallback cb;
+    struct proxyAsyncRequest *next;
+    char *cmd;         /* Formatted command */
+    size_t len;
+    size_t keylen;     /* GET: the key ends the command, before its \r\n */
+    int get;
+} proxyAsyncRequest;
+
+typedef struct proxyAsyncQueue {
+    proxyAsyncRequest *head;
+    proxyAsyncRequest *tail;
+    int count;
+    long long since;   /* When the first command was queued */
+    int timer;         /* A timer is pending for the window */
+} proxyAsyncQueue;
+
+static long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void failAsyncRequests( proxyAsyncRequest *req ) {
+    while( req ) {
+        proxyAsyncRequest *next = req->next;
+        if( req->cb.fn )
+            req->cb.fn( req->cb.pac, NULL, req->cb.privdata );
+        free(req->cmd);
+        free(req);
+        req = next;
+    }
+}
+
+/* Fail the queue of a server whose connection is gone. Its timer went away
+ * with the connection. */
+static void failAsyncQueue( proxyAsyncContext *pac, int idx ) {
+    proxyAsyncQueue *q = &pac->queues[idx];
+    proxyAsyncRequest *req = q->head;
+
+    q->head = q->tail = NULL;
+    q->count = 0;
+    q->timer = 0;
+    failAsyncRequests( req );
+}
+
+/* Hand every GET of a merged MGET its element of the reply. An error or a
+ * NULL reply is given to all of them. */
+static void proxyAsyncMGetCallback( redisAsyncContext *ac, void *reply, void *privdata ) {
+    PROXY_NOTUSED(ac);
+    redisReply *r = reply;
+    proxyAsyncRequest *req = privdata;
+
+    for( size_t i = 0; req; i++ ) {
+        proxyAsyncRequest *next = req->next;
+        void *part = reply;
+
+        if( r && r->type == REDIS_REPLY_ARRAY )
+            part = i < r->elements ? r->element[i] : NULL;
+        if( req->cb.fn )
+            req->cb.fn( req->cb.pac, part, req->cb.privdata );
+        free(req);
+        req = next;
+    }
+}
+
+static int sendAsyncRequest( redisAsyncContext *ac, proxyAsyncRequest *req ) {
+    int status = REDIS_ERR;
+
+    if( ac )
+        status = redisAsyncFormattedCommand( ac, proxyAsyncReplyCallback, &req->cb, req->cmd, req->len );
+
+    free(req->cmd);
+    req->cmd = NULL;
+    return status;
+}
+
+/* Send a list of count GETs as a single MGET. */
+static int sendAsyncMGet( redisAsyncContext *ac, proxyAsyncRequest *head, int count ) {
+    const char *stackargv[PROXY_STACK_ARGS];
+    size_t stackargvlen[PROXY_STACK_ARGS];
+    const char **argv = stackargv;
+    size_t *argvlen = stackargvlen;
+    int status = REDIS_ERR;
+    int i = 1;
+
+    if( ac == NULL )
+        return REDIS_ERR;
+
+    if( count+1 > PROXY_STACK_ARGS ) {
+        argv = malloc( (count+1) * sizeof(char *) );
+        argvlen = malloc( (count+1) * sizeof(size_t) );
+        if( argv == NULL || argvlen == NULL )
+            goto cleanup;
+    }
+
+    argv[0] = "MGET";
+    argvlen[0] = 4;
+    for( proxyAsyncRequest *req = head; req; req = req->next ) {
+        argv[i] = req->cmd + req->len - 2 - req->keylen;
+        argvlen[i++] = req->keylen;
+    }
+
+    status = redisAsyncCommandArgv( ac, proxyAsyncMGetCallback, head, count+1, argv, argvlen );
+
+cleanup:
+    if( argv != stackargv ) {
+        free(argv);
+        free(argvlen);
+    }
+    return status;
+}
+
+/* Write the queue of a server: the commands end up in the output buffer
+ * together, and go out with the next write. */
+static void flushAsyncQueue( proxyAsyncContext *pac, int idx ) {
+    proxyAsyncQueue *q = &pac->queues[idx];
+    proxyAsyncRequest *req = q->head;
+
+    /* Callbacks of failed requests may queue new commands. */
+    q->head = q->tail = NULL;
+    q->count = 0;
+
+    while( req ) {
+        proxyAsyncRequest *last = req;
+        proxyAsyncRequest *next;
+        int count = 1;
+
+        if( pac->batchMergeGets && req->get ) {
+            while( last->next && last->next->get ) {
+                last = last->next;
+                count++;
+            }
+        }
+
+        next = last->next;
+        last->next = NULL;
+        if( count > 1 ) {
+            if( sendAsyncMGet( pac->contexts[idx], req, count ) == REDIS_OK ) {
+                for( proxyAsyncRequest *r = req; r; r = r->next ) {
+                    free(r->cmd);
+                    r->cmd = NULL;
+                }
+            } else {
+                failAsyncRequests( req );
+            }
+        } else if( sendAsyncRequest( pac->contexts[idx], req ) != REDIS_OK ) {
+            failAsyncRequests( req );
+        }
+        req = next;
+    }
+}
+
+static int queueAsyncCommand( proxyAsyncContext *pac, int idx, proxyAsyncCallbackFn *fn, void *privdata,
+        int argc, const char **argv, const size_t *argvlen ) {
+    proxyAsyncQueue *q = &pac->queues[idx];
+    proxyAsyncRequest *req;
+    int len;
+
+    req = malloc(sizeof(*req));
+    if( req == NULL )
+        return REDIS_ERR;
+
+    len = redisFormatCommandArgv( &req->cmd, argc, argv, argvlen );
+    if( len < 0 ) {
+        free(req);
+        return REDIS_ERR;
+    }
+
+    req->cb.pac = pac;
+    req->cb.fn = fn;
+    req->cb.privdata = privdata;
+    req->next = NULL;
+    req->len = len;
+    req->get = argc == 2 && (argvlen ? argvlen[0] : strlen(argv[0])) == 3 &&
+        strncasecmp(argv[0], "get", 3) == 0;
+    req->keylen = req->get ? (argvlen ? argvlen[1] : strlen(argv[1])) : 0;
+
+    if( q->tail )
+        q->tail->next = req;
+    else
+        q->head = req;
+    q->tail = req;
+
+    if( q->count++ == 0 && pac->batchWindow > 0 ) {
+        q->since = ustime();
+        if( !q->timer && redisAsyncScheduleTimer( pac->contexts[idx], pac->batchWindow ) == REDIS_OK )
+            q->timer = 1;
+    }
+
+    if( (pac->batchDepth > 0 && q->count >= pac->batchDepth) ||
+            (pac->batchWindow > 0 && ustime() - q->since >= pac->batchWindow) )
+        flushAsyncQueue( pac, idx );
+
+    return REDIS_OK;
+}
+
+/* Write the queue of a server once its window is over. A timer left from a
+ * queue that was written early is moved to the end of the current window. */
+static void proxyAsyncTimerCallback( redisAsyncContext *ac ) {
+    proxyAsyncContext *pac = ac->data;
+    int idx = getAsyncContextIdx( pac, ac );
+    proxyAsyncQueue *q;
+    long long left;
+
+    if( pac->queues == NULL || idx < 0 )
+        return;
+
+    q = &pac->queues[idx];
+    q->timer = 0;
+    if( q->head == NULL )
+        return;
+
+    left = q->since + pac->batchWindow - ustime();
+    if( left > 0 && redisAsyncScheduleTimer( ac, left ) == REDIS_OK )
+        q->timer = 1;
+    else
+        flushAsyncQueue( pac, idx );
+}
+
+void proxyAsyncFlush( proxyAsyncContext *pac ) {
+    if( pac == NULL )
+        return;
+
+    /* Callbacks of failed commands may turn batching off, which frees the
+     * queues. */
+    for( int i = 0; pac->queues && i < pac->count; i++ ) {
+        if( pac->queues[i].head )
+            flushAsyncQueue( pac, i );
+    }
+}
+
+int proxyAsyncSetBatch( proxyAsyncContext *pac, int depth, long long usec, int mergeGets ) {
+    if( pac == NULL )
+        return REDIS_ERR;
+
+    if( pac->queues == NULL && (depth > 0 || usec > 0) ) {
+        pac->queues = calloc(pac->count, sizeof(proxyAsyncQueue));
+        if( pac->queues == NULL )
+            return REDIS_ERR;
+    }
+
+    pac->batchDepth = depth;
+    pac->batchWindow = usec;
+    pac->batchMergeGets = mergeGets;
+    if( depth <= 0 && usec <= 0 ) {
+        proxyAsyncFlush( pac );
+        free(pac->queues);
+        pac->queues = NULL;
+    }
+
+    return REDIS_OK;
+}
+
+int proxyAsyncCommandArgv( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata,
+        int argc, const char **argv, const size_t *argvlen ) {
+    redisAsyncContext *ac;
+    proxyAsyncCallback *cb;
+    int status;
+
+    if( argc < 1 )
+        return REDIS_ERR;
+
+    /* Subscriptions are shared between local subscribers and need their own
+     * bookkeeping, see proxyAsyncSubscribe. */
+    if( isSubscribeCommand( argv[0], argvlen ? argvlen[0] : strlen(argv[0]) ) )
+        return REDIS_ERR;
+
+    if( argc > 1 )
+        ac = lookupAsyncContextWithKey( pac, argv[1], argvlen ? argvlen[1] : strlen(argv[1]) );
+    else
+        ac = getFirstAsyncContext( pac );
+
+    if( ac == NULL )
+        return REDIS_ERR;
+
+    if( pac->queues )
+        return queueAsyncCommand( pac, getAsyncContextIdx( pac, ac ), fn, privdata, argc, argv, argvlen );
+
+    cb = malloc(sizeof(*cb));
+    if( cb == NULL )
+        return REDIS_ERR;
+
+    cb->pac = pac;
+    cb->fn = fn;
+    cb->privdata = privdata;
+    status = redisAsyncCommandArgv( ac, proxyAsyncReplyCallback, cb, argc, argv, argvlen );
+    if( status != REDIS_OK )
+        free(cb);
+    return status;
+}
+
+int proxyvAsyncCommand( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata, const char *format, va_list ap ) {
+    char buf[PROXY_STACK_BUF];
+    const char *argv[PROXY_STACK_ARGS];
+    size_t argvlen[PROXY_STACK_ARGS];
+    char **sdsargv = NULL;
+    size_t *sdsargvlen;
+    int argc = 0;
+    int status = REDIS_ERR;
+    va_list cpy;
+
+    /* Short commands are formatted on the stack. */
+    va_copy(cpy, ap);
+    argc = redisvFormatArgvBuf( buf, sizeof(buf), argv, argvlen, PROXY_STACK_ARGS, format, cpy );
+    va_end(cpy);
+    if( argc >= 0 )
+        return proxyAsyncCommandArgv( pac, fn, privdata, argc, argv, argvlen );
+
+    if( redisvFormatCommandArgList( &sdsargv, &argc, format, ap ) == -1 || argc == 0 )
+        goto done;
+
+    sdsargvlen = malloc(argc * sizeof(size_t));
+    if( sdsargvlen == NULL )
+        goto done;
+
+    for( int i = 0; i < argc; i++ )
+        sdsargvlen[i] = sdslen(sdsargv[i]);
+
+    status = proxyAsyncCommandArgv( pac, fn, privdata, argc, (const char **)sdsargv, sdsargvlen );
+    free(sdsargvlen);
+
+done:
+    for( int i = 0; i < argc; i++ )
+        sdsfree(sdsargv[i]);
+    free(sdsargv);
+    return status;
+}
+
+int proxyAsyncCommand( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata, const char *format, ... ) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = proxyvAsyncCommand(pac,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+static int hasLiveSubscribers( proxySubscription *sub ) {
+    for( proxySubscriber *s = sub->subscribers; s; s = s->next ) {
+        if( s->fn )
+            return 1;
+    }
+
+    return 0;
+}
+
+static void pruneSubscribers( proxySubscription *sub ) {
+    proxySubscriber **link = &sub->subscribers;
+    while( *link ) {
+        proxySubscriber *s = *link;
+        if( s->fn == NULL ) {
+            *link = s->next;
+            free(s);
+        } else {
+            link = &s->next;
+        }
+    }
+}
+
+static void freeSubscription( proxySubscription *sub ) {
+    proxySubscriber *s = sub->subscribers;
+    while( s ) {
+        proxySubscriber *next = s->next;
+        free(s);
+        s = next;
+    }
+
+    sdsfree(sub->name);
+    free(sub);
+}
+
+static void subscriptionCallback( redisAsyncContext *ac, void *r, void *privdata );
+
+/* Send the upstream (P)SUBSCRIBE on the subscriber connections: a channel
+ * lives on the server PUBLISH routes it to, a pattern can match channels on
+ * every server. */
+static void subscribeUpstream( proxySubscription *sub ) {
+    proxyAsyncContext *pac = sub->pac;
+
+    if( sub->pattern ) {
+        for( int i = 0; i < pac->count; i++ ) {
+            if( pac->subcontexts[i] && redisAsyncCommand( pac->subcontexts[i], subscriptionCallback,
+                        sub, "PSUBSCRIBE %b", sub->name, sdslen(sub->name) ) == REDIS_OK )
+                sub->upstreams++;
+        }
+    } else {
+        redisAsyncContext *c = lookupAsyncContextWithKey( pac, sub->name, sdslen(sub->name) );
+        int idx = c ? getAsyncContextIdx( pac, c ) : -1;
+        if( idx >= 0 && pac->subcontexts[idx] && redisAsyncCommand( pac->subcontexts[idx], subscriptionCallback,
+                    sub, "SUBSCRIBE %b", sub->name, sdslen(sub->name) ) == REDIS_OK )
+            sub->upstreams++;
+    }
+}
+
+static void unsubscribeUpstream( proxySubscription *sub ) {
+    proxyAsyncContext *pac = sub->pac;
+
+    sub->unsubscribing = 1;
+    for( int i = 0; i < pac->count; i++ ) {
+        redisAsyncContext *c = pac->subcontexts[i];
+        if( c == NULL )
+            continue;
+
+        /* Only where hiredis has the subscription registered for us. */
+        dict *callbacks = sub->pattern ? c->sub.patterns : c->sub.channels;
+        if( dictFind( callbacks, sub->name ) == NULL )
+            continue;
+
+        redisAsyncCommand( c, NULL, NULL, sub->pattern ? "PUNSUBSCRIBE %b" : "UNSUBSCRIBE %b",
+                sub->name, sdslen(sub->name) );
+    }
+}
+
+/* Called when the last upstream subscription went away, either confirmed by
+ * (P)UNSUBSCRIBE or because its connection was lost. */
+static void releaseSubscription( proxySubscription *sub ) {
+    proxyAsyncContext *pac = sub->pac;
+    dict *subscriptions = sub->pattern ? pac->patterns : pac->channels;
+
+    sub->unsubscribing = 0;
+
+    /* Local subscribers that arrived while unsubscribing. */
+    if( !sub->lost && hasLiveSubscribers( sub ) ) {
+        pruneSubscribers( sub );
+        subscribeUpstream( sub );
+        if( sub->upstreams > 0 )
+            return;
+    }
+
+    dictDelete( subscriptions, sub->name );
+
+    /* Subscribers may unsubscribe or subscribe again from the callback, which
+     * no longer sees this subscription. */
+    for( proxySubscriber *s = sub->subscribers; s; s = s->next ) {
+        if( s->fn )
+            s->fn( pac, NULL, s->privdata );
+    }
+
+    freeSubscription( sub );
+}
+
+static void dispatchMessage( proxySubscription *sub, redisReply *reply ) {
+    sub->dispatching++;
+    for( proxySubscriber *s = sub->subscribers; s; s = s->next ) {
+        if( s->fn )
+            s->fn( sub->pac, reply, s->privdata );
+    }
+
+    if( --sub->dispatching == 0 )
+        pruneSubscribers( sub );
+}
+
+static void subscriptionCallback( redisAsyncContext *ac, void *r, void *privdata ) {
+    PROXY_NOTUSED(ac);
+    proxySubscription *sub = privdata;
+    redisReply *reply = r;
+
+    /* A pattern lost on one server would silently miss what is published
+     * there, so the whole subscription fails: the other servers are
+     * unsubscribed and the subscribers get their NULL reply once the last
+     * one confirmed. */
+    if( reply == NULL ) {
+        sub->lost = 1;
+        if( --sub->upstreams == 0 )
+            releaseSubscription( sub );
+        else if( !sub->unsubscribing )
+            unsubscribeUpstream( sub );
+        return;
+    }
+
+    if( reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 ||
+            reply->element[0]->type != REDIS_REPLY_STRING )
+        return;
+
+    const char *type = reply->element[0]->str;
+    if( strcasecmp(type, "message") == 0 || strcasecmp(type, "pmessage") == 0 ) {
+        dispatchMessage( sub, reply );
+    } else if( strcasecmp(type, "unsubscribe") == 0 || strcasecmp(type, "punsubscribe") == 0 ) {
+        if( --sub->upstreams == 0 )
+            releaseSubscription( sub );
+    }
+}
+
+static int proxyAsyncSubscribeGeneric( proxyAsyncContext *pac, const char *name, int pattern,
+        proxyAsyncCallbackFn *fn, void *privdata ) {
+    dict *subscriptions = pattern ? pac->patterns : pac->channels;
+    proxySubscription *sub;
+    proxySubscriber *s;
+    sds key;
+
+    if( fn == NULL )
+        return REDIS_ERR;
+
+    key = sdsnew(name);
+    sub = dictFetchValue( subscriptions, key );
+    if( sub == NULL ) {
+        sub = calloc(1,sizeof(*sub));
+        if( sub == NULL ) {
+            sdsfree(key);
+            return REDIS_ERR;
+        }
+
+        sub->pac = pac;
+        sub->name = key;
+        sub->pattern = pattern;
+        subscribeUpstream( sub );
+        if( sub->upstreams == 0 ) {
+            freeSubscription( sub );
+            return REDIS_ERR;
+        }
+
+        dictAdd( subscriptions, sub->name, sub );
+    } else {
+        sdsfree(key);
+    }
+
+    s = malloc(sizeof(*s));
+    if( s == NULL )
+        return REDIS_ERR;
+
+    s->fn = fn;
+    s->privdata = privdata;
+    s->next = sub->subscribers;
+    sub->subscribers = s;
+    return REDIS_OK;
+}
+
+/* Remove the subscriber registered with fn and privdata, or every subscriber
+ * of the channel when fn is NULL. The upstream subscription is dropped once
+ * the last local subscriber is gone. */
+static int proxyAsyncUnsubscribeGeneric( proxyAsyncContext *pac, const char *name, int pattern,
+        proxyAsyncCallbackFn *fn, void *privdata ) {
+    dict *subscriptions = pattern ? pac->patterns : pac->channels;
+    proxySubscription *sub;
+    int found = 0;
+
+    sds key = sdsnew(name);
+    sub = dictFetchValue( subscriptions, key );
+    sdsfree(key);
+    if( sub == NULL )
+        return REDIS_ERR;
+
+    for( proxySubscriber *s = sub->subscribers; s; s = s->next ) {
+        if( s->fn == NULL )
+            continue;
+
+        if( fn == NULL || (s->fn == fn && s->privdata == privdata) ) {
+            s->fn = NULL;
+            found = 1;
+            if( fn )
+                break;
+        }
+    }
+
+    if( !found )
+        return REDIS_ERR;
+
+    if( sub->dispatching == 0 )
+        pruneSubscribers( sub );
+
+    if( !hasLiveSubscribers( sub ) && !sub->unsubscribing )
+        unsubscribeUpstream( sub );
+
+    return REDIS_OK;
+}
+
+int proxyAsyncSubscribe( proxyAsyncContext *pac, const char *channel, proxyAsyncCallbackFn *fn, void *privdata ) {
+    return proxyAsyncSubscribeGeneric( pac, channel, 0, fn, privdata );
+}
+
+int proxyAsyncUnsubscribe( proxyAsyncContext *pac, const char *channel, proxyAsyncCallbackFn *fn, void *privdata ) {
+    return proxyAsyncUnsubscribeGeneric( pac, channel, 0, fn, privdata );
+}
+
+int proxyAsyncPSubscribe( proxyAsyncContext *pac, const char *pattern, proxyAsyncCallbackFn *fn, void *privdata ) {
+    return proxyAsyncSubscribeGeneric( pac, pattern, 1, fn, privdata );
+}
+
+int proxyAsyncPUnsubscribe( proxyAsyncContext *pac, const char *pattern, proxyAsyncCallbackFn *fn, void *privdata ) {
+    return proxyAsyncUnsubscribeGeneric( pac, pattern, 1, fn, privdata );
+}
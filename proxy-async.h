@@ -0,0 +1,103 @@
+#ifndef     __PROXY_ASYNC_H__
+#define     __PROXY_ASYNC_H__
+
+#include    "async.h"
+#include    "proxy.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct proxyAsyncContext; /* need forward declaration of proxyAsyncContext */
+struct dict; /* dictionary header is included in proxy-async.c */
+struct proxyAsyncQueue; /* commands waiting for a batch, see proxyAsyncSetBatch */
+
+/* Reply callback prototype for the async proxy */
+typedef void (proxyAsyncCallbackFn)(struct proxyAsyncContext*, void*, void*);
+
+/* Context for async connections to several Redis servers. Every server has
+ * two redisAsyncContexts, one for commands and one for subscriptions, that
+ * have to be attached to an event library, e.g. for libevent:
+ *
+ *   for (i = 0; i < pac->count; i++) {
+ *       redisLibeventAttach(proxyAsyncGetContext(pac,i),base);
+ *       redisLibeventAttach(proxyAsyncGetSubscribeContext(pac,i),base);
+ *   }
+ *
+ * The data field and the connect/disconnect/timer callbacks of those
+ * contexts are used by the proxy, use proxyAsyncSet(Dis)ConnectCallback
+ * instead. */
+typedef struct proxyAsyncContext {
+    int count;
+    redisAsyncContext **contexts;
+    redisAsyncContext **subcontexts; /* Only used for (P)(UN)SUBSCRIBE */
+    proxyContext *p; /* Key distribution, shared with the blocking proxy */
+
+    /* Subscriptions of local subscribers. Every channel is subscribed once
+     * on the server owning it, every pattern once on every server, no
+     * matter how many local subscribers there are. */
+    struct dict *channels;
+    struct dict *patterns;
+
+    /* Called for every server connection, the subscriber ones included, see
+     * proxyAsyncSetConnectCallback */
+    redisConnectCallback *onConnect;
+    redisDisconnectCallback *onDisconnect;
+
+    /* Batching, see proxyAsyncSetBatch. queues is NULL when it is off. */
+    int batchDepth;
+    long long batchWindow;
+    int batchMergeGets;
+    struct proxyAsyncQueue *queues;
+
+    /* Not used by the proxy */
+    void *data;
+} proxyAsyncContext;
+
+proxyAsyncContext *proxyAsyncConnect( redisAddr *addrs, int count );
+redisAsyncContext *proxyAsyncGetContext( proxyAsyncContext *pac, int idx );
+redisAsyncContext *proxyAsyncGetSubscribeContext( proxyAsyncContext *pac, int idx );
+void proxyAsyncSetConnectCallback( proxyAsyncContext *pac, redisConnectCallback *fn );
+void proxyAsyncSetDisconnectCallback( proxyAsyncContext *pac, redisDisconnectCallback *fn );
+void proxyAsyncFree( proxyAsyncContext *pac );
+
+/* Issue a command routed by its first key (or to the first server when the
+ * command has no arguments). PUBLISH is routed by channel. The Argv variant
+ * is binary safe, argvlen may be NULL to use strlen. Use the functions
+ * below for (P)SUBSCRIBE and (P)UNSUBSCRIBE. */
+int proxyvAsyncCommand( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata, const char *format, va_list ap );
+int proxyAsyncCommand( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata, const char *format, ... );
+int proxyAsyncCommandArgv( proxyAsyncContext *pac, proxyAsyncCallbackFn *fn, void *privdata,
+        int argc, const char **argv, const size_t *argvlen );
+
+/* Batch commands per server. Commands are queued instead of being written
+ * right away, and a server's queue is written at once when it holds depth
+ * commands, or usec microseconds after the first one was queued. The window
+ * is timed through the event library adapter (the bundled ones support
+ * timers); with an adapter without timers it is only checked when commands
+ * arrive, and proxyAsyncFlush has to be called from the event loop so the
+ * tail of a burst isn't held back. With depth only, queues are written when
+ * they are full or by proxyAsyncFlush. With mergeGets, consecutive GETs to
+ * the same server are sent as one MGET whose reply is split between their
+ * callbacks; a key holding another type then reads as nil instead of an
+ * error. A depth and window of 0 turn batching off. Commands that can't be
+ * sent when their queue is flushed get a NULL reply. */
+int proxyAsyncSetBatch( proxyAsyncContext *pac, int depth, long long usec, int mergeGets );
+void proxyAsyncFlush( proxyAsyncContext *pac );
+
+/* Subscribe a local subscriber to a channel or pattern. The callback is
+ * invoked with every "message" (or "pmessage") reply, and with a NULL reply
+ * when the subscription is lost because its connection went away. A pattern
+ * is subscribed on every server and is lost as a whole when one of them goes
+ * away: it is unsubscribed on the others first, so messages from those may
+ * still arrive before the NULL reply. A callback may unsubscribe itself. */
+int proxyAsyncSubscribe( proxyAsyncContext *pac, const char *channel, proxyAsyncCallbackFn *fn, void *privdata );
+int proxyAsyncUnsubscribe( proxyAsyncContext *pac, const char *channel, proxyAsyncCallbackFn *fn, void *privdata );
+int proxyAsyncPSubscribe( proxyAsyncContext *pac, const char *pattern, proxyAsyncCallbackFn *fn, void *privdata );
+int proxyAsyncPUnsubscribe( proxyAsyncContext *pac, const char *pattern, proxyAsyncCallbackFn *fn, void *privdata );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,16 +2,25 @@
 #include    <string.h>
 #include    <strings.h>
 #include    <stdint.h>
+#include    <unistd.h>
+#include    <errno.h>
+#include    <limits.h>
+#include    <fcntl.h>
+#include    <sys/time.h>
 #include    "sds.h"
 #include    "dict.h"
 #include    "proxy.h"
 #include    "md5.h"
+#include    "sha1.h"
 
 #define PROXY_NOTUSED(V) ((void) V)
 
 struct redisKeyInfo;
 
-typedef void *redisCommandProc(proxyContext *p, int argc, char **argv, struct redisKeyInfo *keyInfo);
+/* Arguments of a command, binary safe: procs use argvlen, the arguments
+ * can't be relied on to be nul terminated. Procs may replace entries of argv
+ * and argvlen while they run, but have to restore them. */
+typedef void *redisCommandProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, struct redisKeyInfo *keyInfo);
 
 typedef struct redisKeyInfo {
     const char *name;
@@ -45,6 +54,17 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Script cache. sds sha1 hex digest -> sds script body. The hash function
+ * doesn't rely on sdslen so plain C strings can be used for lookups. */
+static dictType scriptDictType = {
+    dictCaseHash,              /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCaseCompare,     /* key compare */
+    dictSdsDestructor,         /* key destructor */
+    dictSdsDestructor          /* val destructor */
+};
+
 static void freeProxyCommand( int argc, char **argv ) {
     for( int i = 0; i < argc; i++ ) {
         sdsfree(argv[i]);
@@ -77,6 +97,7 @@ static proxyContext *proxyContextInit(int count) {
     p->contexts = calloc(count, sizeof(redisContext *));
     p->mcs_count = count * 160;
     p->mcs = calloc(p->mcs_count*160, sizeof(ketamaMCS));
+    p->scripts = dictCreate(&scriptDictType,NULL);
     return p;
 }
 
@@ -88,20 +109,26 @@ void destroyProxyContext(proxyContext *p) {
             }
         }
 
+        free(p->contexts);
+
         if( p->mcs ){
             free(p->mcs);
         }
 
+        if( p->scripts ){
+            dictRelease(p->scripts);
+        }
+
         free(p);
     }
 }
 
-void ketama_md5_digest( const char* inString, unsigned char md5pword[16] )
+void ketama_md5_digest( const char* inString, size_t len, unsigned char md5pword[16] )
 {
     md5_state_t md5state;
 
     md5_init( &md5state );
-    md5_append( &md5state, (unsigned char *)inString, strlen( inString ) );
+    md5_append( &md5state, (unsigned char *)inString, len );
     md5_finish( &md5state, md5pword );
 }
 
@@ -129,7 +156,7 @@ int createContinuum( proxyContext *p, redisAddr *addr, redisContext **c, int con
         unsigned char digest[16];
 
         sprintf( ss, "%s:%d-%d", addr->ip, addr->port, k );
-        ketama_md5_digest( ss, digest );
+        ketama_md5_digest( ss, strlen( ss ), digest );
 
         /* Use successive 4-bytes from hash as numbers
          * for the points on the circle: */
@@ -176,11 +203,29 @@ proxyContext *proxyConnect( redisAddr *addrs, int count ) {
     return p;
 }
 
-unsigned int ketama_hashi( const char* key)
+/* Build a proxyContext around connections established by the caller. The
+ * async proxy uses this with the redisContext embedded in each of its
+ * redisAsyncContexts, so both share the same key distribution. */
+proxyContext *proxyContextWithConnections( redisAddr *addrs, redisContext **contexts, int count ) {
+    proxyContext *p = proxyContextInit(count);
+    if( p == NULL )
+        return NULL;
+
+    int cont = 0;
+    for( int i = 0; i < count; i++ ) {
+        p->contexts[p->count++] = contexts[i];
+        cont = createContinuum( p, &addrs[i], &(p->contexts[i]), cont);
+    }
+
+    sortContinuum( p, cont );
+    return p;
+}
+
+unsigned int ketama_hashi( const char* key, size_t len )
 {
     unsigned char digest[16];
 
-    ketama_md5_digest( key, digest );
+    ketama_md5_digest( key, len, digest );
     return (unsigned int)(( digest[3] << 24 )
             | ( digest[2] << 16 )
             | ( digest[1] <<  8 )
@@ -188,7 +233,6 @@ unsigned int ketama_hashi( const char* key)
 }
 
 redisContext *getFirstContext( proxyContext *p, int idx ) {
-    printf("key index: %d\n", idx);
     for ( int i = idx; i < p->mcs_count; i++ ){
         if( p->mcs[i].c != NULL )
             return *(p->mcs[i].c);
@@ -205,7 +249,11 @@ redisContext *getFirstContext( proxyContext *p, int idx ) {
 }
 
 redisContext *lookupRedisServerWithKey( proxyContext *p, const char *key ) {
-    unsigned int h = ketama_hashi( key );
+    return lookupRedisServerWithKeyLen( p, key, strlen(key) );
+}
+
+redisContext *lookupRedisServerWithKeyLen( proxyContext *p, const char *key, size_t len ) {
+    unsigned int h = ketama_hashi( key, len );
     int highp = p->mcs_count-1;
     int lowp = 0, midp;
     unsigned int midval, midval1;
@@ -238,26 +286,62 @@ redisContext *getRedisContextWithIdx( proxyContext *p, int idx ) {
     return c;
 }
 
-void *notsupportCommandProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo) {
+static redisReply *createStringReply( int type, const char *str, size_t len ) {
+    redisReply *reply;
+
+    reply = createReplyObject(type);
+    if( reply == NULL )
+        return NULL;
+
+    reply->str = malloc(len+1);
+    if( reply->str == NULL ) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+
+    memcpy(reply->str, str, len);
+    reply->str[len] = '\0';
+    reply->len = len;
+    return reply;
+}
+
+static redisReply *createErrorReply( const char *err ) {
+    return createStringReply(REDIS_REPLY_ERROR, err, strlen(err));
+}
+
+static redisReply *createArityErrorReply( const char *cmd, size_t len ) {
+    char err[128];
+    snprintf(err, sizeof(err), "ERR wrong number of arguments for '%.*s' command", (int)len, cmd);
+    return createErrorReply(err);
+}
+
+/* Copy a short argument into buf as a C string, for strtol and friends.
+ * Returns NULL when it doesn't fit or contains a nul byte. */
+static const char *argToString( char *buf, size_t size, const char *arg, size_t len ) {
+    if( len >= size || memchr(arg, '\0', len) != NULL )
+        return NULL;
+
+    memcpy(buf, arg, len);
+    buf[len] = '\0';
+    return buf;
+}
+
+void *notsupportCommandProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo) {
     PROXY_NOTUSED(p);
     PROXY_NOTUSED(argc);
-    PROXY_NOTUSED(argv);
     PROXY_NOTUSED(keyInfo);
 
-    redisReply *reply; 
-    reply = createReplyObject(REDIS_REPLY_ERROR);
     char err[1024];
-    sprintf(err, "ERR not support %s command in proxy", argv[0]); 
-    reply->str = malloc(strlen(err)+1);
-    strcpy(reply->str, err);
-    return reply;
+    snprintf(err, sizeof(err), "ERR not support %.*s command in proxy", (int)argvlen[0], argv[0]);
+    return createErrorReply(err);
 }
 
-void *proxyCommandArgvList(proxyContext *p, redisContext *c, int argc, const char **argv) {
+/* Send a command to c and wait for its reply. */
+static void *forwardCommandArgv( proxyContext *p, redisContext *c, int argc, const char **argv, const size_t *argvlen ) {
     if( c == NULL )
         return NULL;
 
-    void *reply = redisCommandArgvList( c, argc, (const char **)argv );
+    void *reply = redisCommandArgv( c, argc, argv, argvlen );
     if( reply == NULL ){
         adjustClosedConnections( p, c );
     }
@@ -265,11 +349,19 @@ void *proxyCommandArgvList(proxyContext *p, redisContext *c, int argc, const cha
     return reply;
 }
 
-void *oneKeyProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
+void *proxyCommandArgvList(proxyContext *p, redisContext *c, int argc, const char **argv) {
+    return forwardCommandArgv( p, c, argc, argv, NULL );
+}
+
+void *oneKeyProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
     PROXY_NOTUSED(keyInfo);
     redisContext *c;
-    c = lookupRedisServerWithKey( p, argv[1] );
-    return proxyCommandArgvList( p, c, argc, (const char **)argv );
+
+    if( argc < 2 )
+        return createArityErrorReply( argv[0], argvlen[0] );
+
+    c = lookupRedisServerWithKeyLen( p, argv[1], argvlen[1] );
+    return forwardCommandArgv( p, c, argc, argv, argvlen );
 }
 
 void printArgv( int argc, char **argv ){
@@ -279,27 +371,32 @@ void printArgv( int argc, char **argv ){
     }
 }
 
-void *msetProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
+void *msetProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
     int command_count = (argc-1)/keyInfo->keystep;
     redisReply *replyAll = NULL;
 
     int call_count = 0;
     
-    char *myargv[3];
-    myargv[0] = (char *)"SET";
+    const char *myargv[3];
+    size_t myargvlen[3];
+    myargv[0] = "SET";
+    myargvlen[0] = 3;
+
+    if( argc < 3 || (argc-1) % keyInfo->keystep != 0 )
+        return createArityErrorReply( argv[0], argvlen[0] );
 
     for( int i = 0; i < command_count; i++ ) {
         int keyIdx = 1+(i*keyInfo->keystep);
-        char *key = argv[keyIdx];
-        char *value = argv[keyIdx+1];
-        myargv[1] = key;
-        myargv[2] = value;
-        redisContext *c = lookupRedisServerWithKey( p, key );
-        redisReply *reply = proxyCommandArgvList( p, c, 3, (const char **)myargv ); 
+        myargv[1] = argv[keyIdx];
+        myargvlen[1] = argvlen[keyIdx];
+        myargv[2] = argv[keyIdx+1];
+        myargvlen[2] = argvlen[keyIdx+1];
+        redisContext *c = lookupRedisServerWithKeyLen( p, myargv[1], myargvlen[1] );
+        redisReply *reply = forwardCommandArgv( p, c, 3, myargv, myargvlen );
         if( call_count == 0 ) {
             replyAll = reply;
         } else {
-            if( reply->type != REDIS_REPLY_ERROR ) {
+            if( reply && reply->type != REDIS_REPLY_ERROR ) {
                 freeReplyObject(reply);
             } else {
                 if( replyAll ) {
@@ -315,7 +412,7 @@ void *msetProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
     return replyAll;
 }
 
-void *mgetProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
+void *mgetProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
     redisReply *replyAll;
 
     int command_count = (argc-1)/keyInfo->keystep;
@@ -326,18 +423,21 @@ void *mgetProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
     replyAll = createReplyObject(REDIS_REPLY_ARRAY);
     if( !replyAll ){
         free(element);
+        return NULL;
     }
 
-    char *myargv[2];
-    myargv[0] = (char *)"GET";
+    const char *myargv[2];
+    size_t myargvlen[2];
+    myargv[0] = "GET";
+    myargvlen[0] = 3;
 
     replyAll->elements = command_count;
     for( int i = 0; i < command_count; i++ ) {
         int keyIdx = 1+(i*keyInfo->keystep);
-        char *key = argv[keyIdx];
-        myargv[1] = key;
-        redisContext *c = lookupRedisServerWithKey( p, key );
-        redisReply *reply = proxyCommandArgvList( p, c, 2, (const char **)myargv ); 
+        myargv[1] = argv[keyIdx];
+        myargvlen[1] = argvlen[keyIdx];
+        redisContext *c = lookupRedisServerWithKeyLen( p, myargv[1], myargvlen[1] );
+        redisReply *reply = forwardCommandArgv( p, c, 2, myargv, myargvlen );
         if( reply == NULL ) {
             reply = createReplyObject(REDIS_REPLY_NIL);
         }
@@ -348,7 +448,121 @@ void *mgetProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
     return replyAll;
 }
 
-void *sumIntegerKeyProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
+static int getRedisContextIdx( proxyContext *p, redisContext *c ) {
+    if( c == NULL )
+        return -1;
+
+    for( int i = 0; i < p->max_count; i++ ) {
+        if( p->contexts[i] == c )
+            return i;
+    }
+    return -1;
+}
+
+/* MGET decoded into columns. Keys are grouped by server and every server
+ * gets a single MGET, all of them pipelined. The replies are decoded with
+ * redisColumnarFunctions and merged in key order. Values of keys on servers
+ * that can't be reached are nil; when a server replies with an error, that
+ * error is returned. keylens may be NULL to use strlen. Free the result with
+ * freeColumnsObject. */
+redisColumns *proxyMGetColumnar( proxyContext *p, int count, const char **keys, const size_t *keylens ) {
+    redisColumns *replyAll = NULL;
+    redisColumns **replies = calloc( p->max_count, sizeof(redisColumns *) );
+    size_t *cursor = calloc( p->max_count, sizeof(size_t) );
+    int *node = malloc( count * sizeof(int) );
+    size_t *len = malloc( count * sizeof(size_t) );
+    const char **myargv = malloc( (count+1) * sizeof(char *) );
+    size_t *myargvlen = malloc( (count+1) * sizeof(size_t) );
+    int *sent = calloc( p->max_count, sizeof(int) );
+
+    if( !replies || !cursor || !node || !len || !myargv || !myargvlen || !sent )
+        goto cleanup;
+
+    for( int i = 0; i < count; i++ ) {
+        len[i] = keylens ? keylens[i] : strlen(keys[i]);
+        node[i] = getRedisContextIdx( p, lookupRedisServerWithKeyLen( p, keys[i], len[i] ) );
+    }
+
+    myargv[0] = "MGET";
+    myargvlen[0] = 4;
+    for( int n = 0; n < p->max_count; n++ ) {
+        int myargc = 1;
+        for( int i = 0; i < count; i++ ) {
+            if( node[i] == n ) {
+                myargv[myargc] = keys[i];
+                myargvlen[myargc++] = len[i];
+            }
+        }
+
+        if( myargc > 1 && redisAppendCommandArgv( p->contexts[n], myargc, myargv, myargvlen ) == REDIS_OK )
+            sent[n] = 1;
+    }
+
+    for( int n = 0; n < p->max_count; n++ ) {
+        redisContext *c = p->contexts[n];
+        redisReplyObjectFunctions *fn;
+        void *reply = NULL;
+
+        if( !sent[n] )
+            continue;
+
+        fn = c->reader->fn;
+        c->reader->fn = &redisColumnarFunctions;
+        if( redisGetReply( c, &reply ) != REDIS_OK ) {
+            c->reader->fn = fn;
+            adjustClosedConnections( p, c );
+            continue;
+        }
+        c->reader->fn = fn;
+        replies[n] = reply;
+    }
+
+    /* Every reply is read before giving up on an error, so no connection is
+     * left with a pending reply. */
+    for( int n = 0; n < p->max_count; n++ ) {
+        if( replies[n] && replies[n]->type == REDIS_REPLY_ERROR ) {
+            replyAll = replies[n];
+            replies[n] = NULL;
+            goto cleanup;
+        }
+    }
+
+    replyAll = redisColumnsCreate( REDIS_REPLY_ARRAY, count );
+    if( !replyAll )
+        goto cleanup;
+
+    for( int i = 0; i < count; i++ ) {
+        redisColumns *r = node[i] >= 0 ? replies[node[i]] : NULL;
+        size_t j;
+
+        if( r == NULL || r->type != REDIS_REPLY_ARRAY || (j = cursor[node[i]]++) >= r->count ||
+                redisColumnsIsNil( r, j ) ) {
+            redisColumnsAppendNil( replyAll );
+        } else if( redisColumnsAppend( replyAll, redisColumnsValue( r, j ), r->len[j] ) != REDIS_OK ) {
+            freeColumnsObject( replyAll );
+            replyAll = NULL;
+            break;
+        }
+    }
+
+cleanup:
+    if( replies ) {
+        for( int n = 0; n < p->max_count; n++ ) {
+            freeColumnsObject( replies[n] );
+        }
+    }
+
+    free(replies);
+    free(cursor);
+    free(node);
+    free(len);
+    free(myargv);
+    free(myargvlen);
+    free(sent);
+    return replyAll;
+}
+
+void *sumIntegerKeyProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
     PROXY_NOTUSED(keyInfo);
     redisContext *c;
     redisReply *replyAll; 
@@ -358,7 +572,7 @@ void *sumIntegerKeyProc(proxyContext *p, int argc, char **argv, redisKeyInfo *ke
         for( int i = 0; i < p->count; i++ ){
             redisReply *reply;
             c = getRedisContextWithIdx( p, i );
-            reply = proxyCommandArgvList( p, c, argc, (const char **)argv );
+            reply = forwardCommandArgv( p, c, argc, argv, argvlen );
             int value = 0;
             if( reply ) {
                 value = reply->integer;
@@ -371,7 +585,7 @@ void *sumIntegerKeyProc(proxyContext *p, int argc, char **argv, redisKeyInfo *ke
     return replyAll;
 }
 
-void *allServerProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInfo){
+void *allServerProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
     PROXY_NOTUSED(keyInfo);
     redisContext *c;
     redisReply *replyAll = NULL; 
@@ -379,7 +593,7 @@ void *allServerProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInf
     for( int i = 0; i < p->count; i++ ){
         redisReply *reply;
         c = getRedisContextWithIdx( p, i );
-        reply = proxyCommandArgvList( p, c, argc, (const char **)argv );
+        reply = forwardCommandArgv( p, c, argc, argv, argvlen );
         if( reply ){
             if( i == 0 ) {
                 replyAll = reply;
@@ -400,195 +614,1842 @@ void *allServerProc(proxyContext *p, int argc, char **argv, redisKeyInfo *keyInf
     return replyAll;
 }
 
-void loadCommandTable(dict *commands) {
-    static redisKeyInfo keyInfos[] = {
-        { "get", oneKeyProc,1,1,1,0,0},
-        { "set", oneKeyProc,1,1,1,0,0},
-        { "setnx", oneKeyProc,1,1,1,0,0},
-        { "setex", oneKeyProc,1,1,1,0,0},
-        { "psetex", oneKeyProc,1,1,1,0,0},
-        { "append", oneKeyProc,1,1,1,0,0},
-        { "exists", oneKeyProc,1,1,1,0,0},
-        { "strlen", oneKeyProc,1,1,1,0,0},
-        { "del", sumIntegerKeyProc,1,-1,1,0,0},
-        { "getbit", oneKeyProc,1,1,1,0,0},
-        { "setbit", oneKeyProc,1,1,1,0,0},
-        { "setrange", oneKeyProc,1,1,1,0,0},
-        { "getrange", oneKeyProc,1,1,1,0,0},
-        { "substr", oneKeyProc, 1,1,1,0,0},
-        { "incr", oneKeyProc, 1,1,1,0,0},
-        { "decr", oneKeyProc, 1,1,1,0,0},
-        { "mget", mgetProc, 1,-1,1,0,0},
-        { "rpush", oneKeyProc, 1,1,1,0,0},
-        { "lpush", oneKeyProc, 1,1,1,0,0},
-        { "rpushx", oneKeyProc,1,1,1,0,0},
-        { "lpushx", oneKeyProc,1,1,1,0,0},
-        { "linsert", oneKeyProc, 1,1,1,0,0},
-        { "rpop", oneKeyProc, 1,1,1,0,0},
-        { "lpop", oneKeyProc, 1,1,1,0,0},
-        { "brpop",oneKeyProc,1,1,1,0,0},
-        { "brpoplpush",notsupportCommandProc,1,2,1,0,0},
-        { "blpop",notsupportCommandProc,1,-2,1,0,0},
-        { "llen", oneKeyProc,1,1,1,0,0},
-        { "lindex",oneKeyProc,1,1,1,0,0},
-        { "lset", oneKeyProc,1,1,1,0,0},
-        { "lrange", oneKeyProc,1,1,1,0,0},
-        { "ltrim", oneKeyProc,1,1,1,0,0},
-        { "lrem", oneKeyProc,1,1,1,0,0},
-        { "rpoplpush",notsupportCommandProc,1,2,1,0,0},
-        { "sadd",oneKeyProc,1,1,1,0,0},
-        { "srem",oneKeyProc,1,1,1,0,0},
-        { "smove",oneKeyProc,1,2,1,0,0},
-        { "sismember",oneKeyProc,1,1,1,0,0},
-        { "scard",oneKeyProc,1,1,1,0,0},
-        { "spop",oneKeyProc,1,1,1,0,0},
-        { "srandmember",oneKeyProc,1,1,1,0,0},
-        { "sinter",notsupportCommandProc,1,-1,1,0,0},
-        { "sinterstore",notsupportCommandProc,1,-1,1,0,0},
-        { "sunion",notsupportCommandProc,1,-1,1,0,0},
-        { "sunionstore",notsupportCommandProc,1,-1,1,0,0},
-        { "sdiff",notsupportCommandProc,1,-1,1,0,0},
-        { "sdiffstore",notsupportCommandProc,1,-1,1,0,0},
-        { "smembers",oneKeyProc,1,1,1,0,0},
-        { "zadd",oneKeyProc,1,1,1,0,0},
-        { "zincrby",oneKeyProc,1,1,1,0,0},
-        { "zrem",oneKeyProc,1,1,1,0,0},
-        { "zremrangebyscore",oneKeyProc,1,1,1,0,0},
-        { "zremrangebyrank",oneKeyProc,1,1,1,0,0},
-        { "zunionstore",notsupportCommandProc,0,0,0,0,0},
-        { "zinterstore",notsupportCommandProc,0,0,0,0,0},
-        { "zrange",oneKeyProc,1,1,1,0,0},
-        { "zrangebyscore",oneKeyProc,1,1,1,0,0},
-        { "zrevrangebyscore",oneKeyProc,1,1,1,0,0},
-        { "zcount",oneKeyProc,1,1,1,0,0},
-        { "zrevrange",oneKeyProc,1,1,1,0,0},
-        { "zcard",oneKeyProc,1,1,1,0,0},
-        { "zscore",oneKeyProc,1,1,1,0,0},
-        { "zrank",oneKeyProc,1,1,1,0,0},
-        { "zrevrank",oneKeyProc,1,1,1,0,0},
-        { "hset",oneKeyProc,1,1,1,0,0},
-        { "hsetnx",oneKeyProc,1,1,1,0,0},
-        { "hget",oneKeyProc,1,1,1,0,0},
-        { "hmset",oneKeyProc,1,1,1,0,0},
-        { "hmget",oneKeyProc,1,1,1,0,0},
-        { "hincrby",oneKeyProc,1,1,1,0,0},
-        { "hincrbyfloat",oneKeyProc,1,1,1,0,0},
-        { "hdel",oneKeyProc,1,1,1,0,0},
-        { "hlen",oneKeyProc,1,1,1,0,0},
-        { "hkeys",oneKeyProc,1,1,1,0,0},
-        { "hvals",oneKeyProc,1,1,1,0,0},
-        { "hgetall",oneKeyProc,1,1,1,0,0},
-        { "hexists",oneKeyProc,1,1,1,0,0},
-        { "incrby",oneKeyProc,1,1,1,0,0},
-        { "decrby",oneKeyProc,1,1,1,0,0},
-        { "incrbyfloat",oneKeyProc,1,1,1,0,0},
-        { "getset",oneKeyProc,1,1,1,0,0},
-        { "mset",msetProc,1,-1,2,0,0},
-        { "msetnx",notsupportCommandProc,1,-1,2,0,0},
-        { "randomkey",notsupportCommandProc,0,0,0,0,0},
-        { "select",notsupportCommandProc,0,0,0,0,0},
-        { "move",notsupportCommandProc,1,1,1,0,0},
-        { "rename",notsupportCommandProc,1,2,1,0,0},
-        { "renamenx",notsupportCommandProc,1,2,1,0,0},
-        { "expire",notsupportCommandProc,1,1,1,0,0},
-        { "expireat",notsupportCommandProc,1,1,1,0,0},
-        { "pexpire",notsupportCommandProc,1,1,1,0,0},
-        { "pexpireat",notsupportCommandProc,1,1,1,0,0},
-        { "keys",notsupportCommandProc,0,0,0,0,0},
-        { "dbsize",sumIntegerKeyProc,0,0,0,0,0},
-        { "auth",allServerProc,0,0,0,0,0},
-        { "ping",allServerProc,0,0,0,0,0},
-        { "echo",notsupportCommandProc,0,0,0,0,0},
-        { "save",notsupportCommandProc,0,0,0,0,0},
-        { "bgsave",notsupportCommandProc,0,0,0,0,0},
-        { "bgrewriteaof",notsupportCommandProc,0,0,0,0,0},
-        { "shutdown",notsupportCommandProc,0,0,0,0,0},
-        { "lastsave",notsupportCommandProc,0,0,0,0,0},
-        { "type",notsupportCommandProc,1,1,1,0,0},
-        { "multi",notsupportCommandProc,0,0,0,0,0},
-        { "exec",notsupportCommandProc,0,0,0,0,0},
-        { "discard",notsupportCommandProc,0,0,0,0,0},
-        { "sync",notsupportCommandProc,0,0,0,0,0},
-        { "replconf",notsupportCommandProc,0,0,0,0,0},
-        { "flushdb",allServerProc,0,0,0,0,0},
-        { "flushall",allServerProc,0,0,0,0,0},
-        { "sort",notsupportCommandProc,1,1,1,0,0},
-        { "info",notsupportCommandProc,0,0,0,0,0},
-        { "monitor",notsupportCommandProc,0,0,0,0,0},
-        { "ttl",oneKeyProc,1,1,1,0,0},
-        { "pttl",notsupportCommandProc,1,1,1,0,0},
-        { "persist",notsupportCommandProc,1,1,1,0,0},
-        { "slaveof",notsupportCommandProc,0,0,0,0,0},
-        { "debug",notsupportCommandProc,0,0,0,0,0},
-        { "config",notsupportCommandProc,0,0,0,0,0},
-        { "subscribe",notsupportCommandProc,0,0,0,0,0},
-        { "unsubscribe",notsupportCommandProc,0,0,0,0,0},
-        { "psubscribe",notsupportCommandProc,0,0,0,0,0},
-        { "punsubscribe",notsupportCommandProc,0,0,0,0,0},
-        { "publish",notsupportCommandProc,0,0,0,0,0},
-        { "watch",notsupportCommandProc,1,-1,1,0,0},
-        { "unwatch",notsupportCommandProc,0,0,0,0,0},
-        { "dump",notsupportCommandProc,1,1,1,0,0},
-        { "object",notsupportCommandProc,2,2,2,0,0},
-        { "client",notsupportCommandProc,0,0,0,0,0},
-        { "slowlog",notsupportCommandProc,0,0,0,0,0},
-        { "time",notsupportCommandProc,0,0,0,0,0},
-        { "bitop",notsupportCommandProc,2,-1,1,0,0},
-        { "bitcount",notsupportCommandProc,1,1,1,0,0}
-    }; 
+static void scriptSha1Hex( char *digest, const char *script, size_t len ) {
+    static const char hex[] = "0123456789abcdef";
+    SHA1_CTX ctx;
+    unsigned char hash[20];
 
-    int numcommands = sizeof(keyInfos)/sizeof(redisKeyInfo);
-    for (int i = 0; i < numcommands; i++) {
-        redisKeyInfo *c = keyInfos+i;
-        int retval = dictAdd(commands, sdsnew(c->name), c);
-        if( 0 != retval ) {
-            printf("Error: dictAdd: %s\n", c->name );
-        }
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *)script, len);
+    SHA1Final(hash, &ctx);
+
+    for( int i = 0; i < 20; i++ ) {
+        digest[i*2] = hex[hash[i] >> 4];
+        digest[i*2+1] = hex[hash[i] & 0xf];
     }
+    digest[40] = '\0';
 }
 
-redisKeyInfo *lookupRedisKeyInfo( const char *cmd ) {
-    static dict *commands;
-    /* Command table. sds string -> command struct pointer. */
-    dictType commandTableDictType = {
-        dictSdsCaseHash,           /* hash function */
-        NULL,                      /* key dup */
-        NULL,                      /* val dup */
-        dictSdsKeyCaseCompare,     /* key compare */
-        dictSdsDestructor,         /* key destructor */
-        NULL                       /* val destructor */
-    };
+static int isNoScriptReply( redisReply *reply ) {
+    return reply && reply->type == REDIS_REPLY_ERROR &&
+        reply->str && strncmp(reply->str, "NOSCRIPT", 8) == 0;
+}
 
+/* Bodies kept for EVALSHA. Clients that build a script per call would grow
+ * the cache forever, so past this size an arbitrary script is dropped for
+ * every new one; EVALSHA of a dropped script gets NOSCRIPT from the server
+ * like without the proxy. */
+#define PROXY_MAX_SCRIPTS 1024
 
-    if( commands == NULL ) {
-        commands = dictCreate(&commandTableDictType,NULL);
-        loadCommandTable(commands);
-    }
+static void evictScript( dict *scripts ) {
+    dictIterator *iter = dictGetIterator(scripts);
+    dictEntry *de = dictNext(iter);
+    void *key = de ? dictGetEntryKey(de) : NULL;
 
-    return dictFetchValue(commands, cmd);
+    dictReleaseIterator(iter);
+    if( key )
+        dictDelete(scripts, key);
 }
 
-void *proxyCommand(proxyContext *p, const char *format, ...) {
-    va_list args;
-    void *reply = NULL;
-    if( p ) {
-        int argc;
-        char **argv = NULL;
-
-        redisKeyInfo *info;
-        va_start(args, format);
-        redisvFormatCommandArgList( &argv, &argc, format, args );
-        va_end(args);
-        info = lookupRedisKeyInfo(argv[0]); 
-        if( info ) {
-            reply = info->proc( p, argc, argv, info );
-        } else {
-            reply = notsupportCommandProc( p, argc, argv, info );
+/* EVAL and EVALSHA are routed by their declared keys, which all have to live
+ * on the same server. Scripts seen through EVAL are remembered by their sha1
+ * so the proxy always tries the cheaper EVALSHA first and only resends the
+ * script body when the server answers with NOSCRIPT. */
+void *evalProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
+    PROXY_NOTUSED(keyInfo);
+    redisContext *c = NULL;
+    redisReply *reply;
+    char digest[41], buf[32];
+    const char *str;
+    char *endptr;
+    long numkeys;
+    int evalsha;
+    sds script = NULL;
+
+    if( argc < 3 ) {
+        return createErrorReply("ERR wrong number of arguments for 'eval' command");
+    }
+
+    str = argToString( buf, sizeof(buf), argv[2], argvlen[2] );
+    if( str != NULL )
+        numkeys = strtol(str, &endptr, 10);
+    if( str == NULL || *str == '\0' || *endptr != '\0' ) {
+        return createErrorReply("ERR value is not an integer or out of range");
+    }
+    if( numkeys < 0 ) {
+        return createErrorReply("ERR Number of keys can't be negative");
+    }
+    if( numkeys > argc-3 ) {
+        return createErrorReply("ERR Number of keys can't be greater than number of args");
+    }
+
+    if( numkeys == 0 ) {
+        for( int i = 0; i < p->max_count && c == NULL; i++ ) {
+            c = getRedisContextWithIdx( p, i );
+        }
+    } else {
+        c = lookupRedisServerWithKeyLen( p, argv[3], argvlen[3] );
+        for( int i = 1; i < numkeys; i++ ) {
+            if( lookupRedisServerWithKeyLen( p, argv[3+i], argvlen[3+i] ) != c ) {
+                return createErrorReply("ERR EVAL keys must map to the same server in proxy");
+            }
+        }
+    }
+
+    if( c == NULL )
+        return createErrorReply("ERR no connection to the server");
+
+    evalsha = (argvlen[0] == 7 && strncasecmp(argv[0], "evalsha", 7) == 0);
+    if( evalsha ) {
+        if( argToString( digest, sizeof(digest), argv[1], argvlen[1] ) != NULL )
+            script = dictFetchValue(p->scripts, digest);
+        reply = forwardCommandArgv( p, c, argc, argv, argvlen );
+        if( script == NULL || !isNoScriptReply(reply) )
+            return reply;
+    } else {
+        scriptSha1Hex(digest, argv[1], argvlen[1]);
+        script = dictFetchValue(p->scripts, digest);
+        if( script == NULL ) {
+            if( dictSize(p->scripts) >= PROXY_MAX_SCRIPTS )
+                evictScript( p->scripts );
+            script = sdsnewlen(argv[1], argvlen[1]);
+            dictAdd(p->scripts, sdsnew(digest), script);
         }
-        
-        freeProxyCommand(argc,argv);
+
+        const char *shaargv0 = argv[0], *shaargv1 = argv[1];
+        size_t shaargvlen0 = argvlen[0], shaargvlen1 = argvlen[1];
+        argv[0] = "EVALSHA";
+        argvlen[0] = 7;
+        argv[1] = digest;
+        argvlen[1] = 40;
+        reply = forwardCommandArgv( p, c, argc, argv, argvlen );
+        argv[0] = shaargv0;
+        argvlen[0] = shaargvlen0;
+        argv[1] = shaargv1;
+        argvlen[1] = shaargvlen1;
+        if( !isNoScriptReply(reply) )
+            return reply;
     }
 
+    /* The server doesn't know the script yet: send the body once. */
+    freeReplyObject(reply);
+
+    const char *evalargv0 = argv[0], *evalargv1 = argv[1];
+    size_t evalargvlen0 = argvlen[0], evalargvlen1 = argvlen[1];
+    argv[0] = "EVAL";
+    argvlen[0] = 4;
+    argv[1] = script;
+    argvlen[1] = sdslen(script);
+    reply = forwardCommandArgv( p, c, argc, argv, argvlen );
+    argv[0] = evalargv0;
+    argvlen[0] = evalargvlen0;
+    argv[1] = evalargv1;
+    argvlen[1] = evalargvlen1;
     return reply;
 }
 
+/* Commands that need data from several servers don't wait for each reply in
+ * turn: every request is appended to its server's output buffer first and
+ * the replies are collected afterwards, so the round trips overlap. Contexts
+ * that failed along the way are only released once every reply was read,
+ * because several requests can share the same context. */
+static int proxyAppendCommandArgv( redisContext *c, int argc, const char **argv, const size_t *argvlen ) {
+    if( c == NULL )
+        return REDIS_ERR;
+
+    return redisAppendCommandArgv( c, argc, argv, argvlen );
+}
+
+static redisReply *proxyGetReply( redisContext *c ) {
+    void *reply = NULL;
+
+    if( c == NULL || redisGetReply( c, &reply ) != REDIS_OK )
+        return NULL;
+
+    return reply;
+}
+
+static void adjustErroredConnections( proxyContext *p ) {
+    for( int i = 0; i < p->max_count; i++ ) {
+        if( p->contexts[i] && p->contexts[i]->err ) {
+            redisFree(p->contexts[i]);
+            p->contexts[i] = NULL;
+        }
+    }
+}
+
+/* Set members are hashed straight from the SMEMBERS reply elements, so
+ * building the working set doesn't copy any member. */
+static unsigned int setMemberHash(const void *key) {
+    const redisReply *r = key;
+    return dictGenHashFunction((const unsigned char *)r->str, r->len);
+}
+
+static int setMemberCompare(void *privdata, const void *key1, const void *key2) {
+    const redisReply *r1 = key1, *r2 = key2;
+    DICT_NOTUSED(privdata);
+
+    return r1->len == r2->len && memcmp(r1->str, r2->str, r1->len) == 0;
+}
+
+static dictType setMemberDictType = {
+    setMemberHash,             /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    setMemberCompare,          /* key compare */
+    NULL,                      /* key destructor */
+    NULL                       /* val destructor */
+};
+
+#define SETOP_UNION 0
+#define SETOP_INTER 1
+#define SETOP_DIFF 2
+
+#define SETOP_STORE_BATCH 1024
+
+static int compareSetSize( const void *a, const void *b ) {
+    const redisReply *r1 = *(redisReply * const *)a, *r2 = *(redisReply * const *)b;
+    return ( r1->elements < r2->elements ) ? -1 : ( ( r1->elements > r2->elements ) ? 1 : 0 );
+}
+
+/* Compute the set operation on the fetched member sets. The returned dict is
+ * keyed by elements of the given replies. */
+static dict *computeSetOperation( redisReply **sets, int count, int op ) {
+    dict *result = dictCreate(&setMemberDictType, NULL);
+    dictEntry *de;
+
+    if( result == NULL )
+        return NULL;
+
+    if( op == SETOP_UNION ) {
+        for( int i = 0; i < count; i++ ) {
+            for( size_t j = 0; j < sets[i]->elements; j++ ) {
+                dictAdd(result, sets[i]->element[j], NULL);
+            }
+        }
+    } else if( op == SETOP_DIFF ) {
+        for( size_t j = 0; j < sets[0]->elements; j++ ) {
+            dictAdd(result, sets[0]->element[j], NULL);
+        }
+
+        for( int i = 1; i < count && dictSize(result) > 0; i++ ) {
+            for( size_t j = 0; j < sets[i]->elements; j++ ) {
+                dictDelete(result, sets[i]->element[j]);
+            }
+        }
+    } else {
+        /* Start from the smallest set and count in how many of the following
+         * sets every candidate shows up. A member survives round i only if it
+         * was seen in all the previous rounds. */
+        redisReply **sorted = malloc( count * sizeof(redisReply *) );
+        if( sorted == NULL ) {
+            dictRelease(result);
+            return NULL;
+        }
+
+        memcpy(sorted, sets, count * sizeof(redisReply *));
+        qsort(sorted, count, sizeof(redisReply *), compareSetSize);
+
+        for( size_t j = 0; j < sorted[0]->elements; j++ ) {
+            dictAdd(result, sorted[0]->element[j], (void *)0);
+        }
+
+        for( int i = 1; i < count && dictSize(result) > 0; i++ ) {
+            for( size_t j = 0; j < sorted[i]->elements; j++ ) {
+                de = dictFind(result, sorted[i]->element[j]);
+                if( de && (long)dictGetEntryVal(de) == i-1 ) {
+                    de->val = (void *)(long)i;
+                }
+            }
+        }
+
+        dictIterator *it = dictGetIterator(result);
+        while( (de = dictNext(it)) != NULL ) {
+            if( (long)dictGetEntryVal(de) != count-1 ) {
+                dictDelete(result, dictGetEntryKey(de));
+            }
+        }
+        dictReleaseIterator(it);
+        free(sorted);
+    }
+
+    return result;
+}
+
+/* Move the members out of the source replies into a new array reply. */
+static redisReply *createSetReply( dict *members, redisReply **sets, int count ) {
+    redisReply *reply = createReplyObject(REDIS_REPLY_ARRAY);
+    dictIterator *it;
+    dictEntry *de;
+    size_t n = 0;
+
+    if( reply == NULL )
+        return NULL;
+
+    if( dictSize(members) > 0 ) {
+        reply->element = malloc( dictSize(members) * sizeof(redisReply *) );
+        if( reply->element == NULL ) {
+            freeReplyObject(reply);
+            return NULL;
+        }
+
+        it = dictGetIterator(members);
+        while( (de = dictNext(it)) != NULL ) {
+            reply->element[n++] = dictGetEntryKey(de);
+        }
+        dictReleaseIterator(it);
+    }
+    reply->elements = n;
+
+    /* The elements now belong to the new reply. */
+    for( int i = 0; i < count; i++ ) {
+        for( size_t j = 0; j < sets[i]->elements; j++ ) {
+            de = dictFind(members, sets[i]->element[j]);
+            if( de && dictGetEntryKey(de) == sets[i]->element[j] ) {
+                sets[i]->element[j] = NULL;
+            }
+        }
+    }
+
+    return reply;
+}
+
+/* Replace the destination set with the given members. Redis deletes the
+ * destination when the result is empty, so the DEL is always sent. */
+static redisReply *storeSetMembers( proxyContext *p, const char *dest, size_t destlen, dict *members ) {
+    redisContext *c = lookupRedisServerWithKeyLen( p, dest, destlen );
+    size_t total = dictSize(members);
+    int batches = (total + SETOP_STORE_BATCH - 1) / SETOP_STORE_BATCH;
+    const char **argv;
+    size_t *argvlen;
+    redisReply *reply, *replyAll = NULL;
+    dictIterator *it;
+    dictEntry *de;
+    int argc;
+
+    argv = malloc( (SETOP_STORE_BATCH+2) * sizeof(char *) );
+    argvlen = malloc( (SETOP_STORE_BATCH+2) * sizeof(size_t) );
+    if( argv == NULL || argvlen == NULL ) {
+        free(argv);
+        free(argvlen);
+        return NULL;
+    }
+
+    argv[0] = "DEL";
+    argvlen[0] = 3;
+    argv[1] = dest;
+    argvlen[1] = destlen;
+    proxyAppendCommandArgv( c, 2, argv, argvlen );
+
+    argv[0] = "SADD";
+    argvlen[0] = 4;
+    argc = 2;
+    it = dictGetIterator(members);
+    while( (de = dictNext(it)) != NULL ) {
+        redisReply *member = dictGetEntryKey(de);
+        argv[argc] = member->str;
+        argvlen[argc] = member->len;
+        if( ++argc == SETOP_STORE_BATCH+2 ) {
+            proxyAppendCommandArgv( c, argc, argv, argvlen );
+            argc = 2;
+        }
+    }
+    dictReleaseIterator(it);
+    if( argc > 2 ) {
+        proxyAppendCommandArgv( c, argc, argv, argvlen );
+    }
+
+    free(argv);
+    free(argvlen);
+
+    /* Read back the DEL and every SADD reply, keeping the first error. */
+    for( int i = 0; i <= batches; i++ ) {
+        reply = proxyGetReply( c );
+        if( reply == NULL ) {
+            if( replyAll ) freeReplyObject(replyAll);
+            replyAll = NULL;
+            break;
+        }
+
+        if( reply->type == REDIS_REPLY_ERROR && replyAll == NULL ) {
+            replyAll = reply;
+        } else {
+            freeReplyObject(reply);
+        }
+    }
+
+    if( replyAll == NULL && c && c->err == 0 ) {
+        replyAll = createReplyObject(REDIS_REPLY_INTEGER);
+        if( replyAll ) replyAll->integer = total;
+    }
+
+    return replyAll;
+}
+
+/* SUNION/SINTER/SDIFF and their STORE variants. The member sets are fetched
+ * from every owning server in parallel and combined locally; the STORE
+ * variants then write the result to the server owning the destination key.
+ * Unlike in Redis, the STORE variants are not atomic. */
+void *setOperationProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
+    PROXY_NOTUSED(keyInfo);
+    size_t cmdlen = argvlen[0];
+    int store = cmdlen > 5 && strncasecmp(argv[0]+cmdlen-5, "store", 5) == 0;
+    int first = store ? 2 : 1;
+    int count = argc - first;
+    int op;
+    redisContext **contexts;
+    redisReply **sets, *reply = NULL;
+    dict *members;
+    const char *myargv[2];
+    size_t myargvlen[2];
+
+    if( strncasecmp(argv[0], "sunion", 6) == 0 ) {
+        op = SETOP_UNION;
+    } else if( strncasecmp(argv[0], "sinter", 6) == 0 ) {
+        op = SETOP_INTER;
+    } else {
+        op = SETOP_DIFF;
+    }
+
+    if( count < 1 ) {
+        return createArityErrorReply( argv[0], argvlen[0] );
+    }
+
+    sets = calloc( count, sizeof(redisReply *) );
+    contexts = malloc( count * sizeof(redisContext *) );
+    if( sets == NULL || contexts == NULL ) {
+        free(sets);
+        free(contexts);
+        return NULL;
+    }
+
+    myargv[0] = "SMEMBERS";
+    myargvlen[0] = 8;
+    for( int i = 0; i < count; i++ ) {
+        contexts[i] = lookupRedisServerWithKeyLen( p, argv[first+i], argvlen[first+i] );
+        myargv[1] = argv[first+i];
+        myargvlen[1] = argvlen[first+i];
+        proxyAppendCommandArgv( contexts[i], 2, myargv, myargvlen );
+    }
+
+    for( int i = 0; i < count; i++ ) {
+        sets[i] = proxyGetReply( contexts[i] );
+    }
+
+    for( int i = 0; i < count; i++ ) {
+        if( sets[i] == NULL ) {
+            goto cleanup;
+        }
+
+        if( sets[i]->type != REDIS_REPLY_ARRAY ) {
+            reply = sets[i];
+            sets[i] = NULL;
+            goto cleanup;
+        }
+    }
+
+    members = computeSetOperation( sets, count, op );
+    if( members ) {
+        if( store ) {
+            reply = storeSetMembers( p, argv[1], argvlen[1], members );
+        } else {
+            reply = createSetReply( members, sets, count );
+        }
+        dictRelease(members);
+    }
+
+cleanup:
+    for( int i = 0; i < count; i++ ) {
+        if( sets[i] ) freeReplyObject(sets[i]);
+    }
+    free(sets);
+    free(contexts);
+    adjustErroredConnections( p );
+    return reply;
+}
+
+#define ZSTORE_CHUNK 1000
+#define ZSTORE_MAX_TMPKEY_TRIES 1024
+#define ZSTORE_TMPKEY_TTL 60 /* Seconds, renewed with every chunk */
+
+/* Write the output buffer without waiting for a reply, so the server can
+ * start working while the next request is being prepared. */
+static int proxyFlush( redisContext *c ) {
+    int done = 0;
+
+    do {
+        if( redisBufferWrite( c, &done ) == REDIS_ERR )
+            return REDIS_ERR;
+    } while( !done );
+
+    return REDIS_OK;
+}
+
+/* A random token for the names of temporary keys, so proxies on other hosts
+ * (or in containers sharing a pid) never pick the same name. */
+static const char *tmpKeyPrefix( void ) {
+    static char prefix[17];
+    unsigned char seed[8];
+    struct timeval tv;
+    uint64_t r;
+    int fd;
+
+    if( prefix[0] != '\0' )
+        return prefix;
+
+    gettimeofday(&tv, NULL);
+    r = ((uint64_t)tv.tv_sec << 32) ^ (uint64_t)tv.tv_usec ^
+        ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)&prefix;
+    fd = open("/dev/urandom", O_RDONLY);
+    if( fd != -1 ) {
+        if( read(fd, seed, sizeof(seed)) == (ssize_t)sizeof(seed) ) {
+            for( int i = 0; i < 8; i++ )
+                r ^= (uint64_t)seed[i] << (i*8);
+        }
+        close(fd);
+    }
+
+    snprintf(prefix, sizeof(prefix), "%016llx", (unsigned long long)r);
+    return prefix;
+}
+
+/* Find a temporary key name that hashes to the given server. */
+static sds createTmpKeyForServer( proxyContext *p, redisContext *c ) {
+    static unsigned int seq = 0;
+    sds key;
+
+    for( int i = 0; i < ZSTORE_MAX_TMPKEY_TRIES; i++ ) {
+        key = sdscatprintf(sdsempty(), "__proxy_zstore:%s:%u", tmpKeyPrefix(), seq++);
+        if( key == NULL )
+            return NULL;
+
+        if( lookupRedisServerWithKeyLen( p, key, sdslen(key) ) == c )
+            return key;
+        sdsfree(key);
+    }
+
+    return NULL;
+}
+
+/* Temporary keys expire on their own in case the proxy dies before it
+ * deletes them. */
+static int appendTmpKeyExpire( redisContext *c, sds tmpkey ) {
+    const char *argv[3];
+    size_t argvlen[3];
+    char ttl[16];
+
+    argv[0] = "EXPIRE";
+    argvlen[0] = 6;
+    argv[1] = tmpkey;
+    argvlen[1] = sdslen(tmpkey);
+    argv[2] = ttl;
+    argvlen[2] = snprintf(ttl, sizeof(ttl), "%d", ZSTORE_TMPKEY_TTL);
+    return redisAppendCommandArgv( c, 3, argv, argvlen );
+}
+
+/* Read the replies of count writes sent to c. Returns NULL when they all
+ * succeeded, the first error otherwise. */
+static redisReply *readWriteReplies( redisContext *c, int count ) {
+    redisReply *err = NULL;
+
+    for( int i = 0; i < count; i++ ) {
+        redisReply *reply = proxyGetReply( c );
+        if( reply == NULL ) {
+            if( err ) freeReplyObject(err);
+            return createErrorReply("ERR connection error in proxy");
+        }
+
+        if( reply->type == REDIS_REPLY_ERROR && err == NULL )
+            err = reply;
+        else
+            freeReplyObject(reply);
+    }
+
+    return err;
+}
+
+/* Older servers answer "ERR Operation against ...", newer ones start with
+ * WRONGTYPE; both share the text. */
+static int isWrongTypeReply( redisReply *reply ) {
+    return reply->type == REDIS_REPLY_ERROR &&
+        reply->str && strstr(reply->str, "wrong kind of value") != NULL;
+}
+
+/* ZUNIONSTORE and ZINTERSTORE also take plain sets, whose members count with
+ * a score of 1. Such a source is copied into a plain set, which the command
+ * on the destination server then treats the same way. The members are read
+ * with a single SMEMBERS, so unlike sorted sets the copy of a set is not
+ * bounded by the chunk size. */
+static redisReply *copySetMembers( redisContext *src, const char *key, size_t keylen,
+        redisContext *dst, sds tmpkey ) {
+    const char **argv;
+    size_t *argvlen;
+    redisReply *members = NULL, *reply = NULL;
+    size_t j = 0;
+    int sent = 0;
+
+    argv = malloc( (2+ZSTORE_CHUNK*2) * sizeof(char *) );
+    argvlen = malloc( (2+ZSTORE_CHUNK*2) * sizeof(size_t) );
+    if( argv == NULL || argvlen == NULL ) {
+        reply = createErrorReply("ERR out of memory in proxy");
+        goto cleanup;
+    }
+
+    argv[0] = "SMEMBERS";
+    argvlen[0] = 8;
+    argv[1] = key;
+    argvlen[1] = keylen;
+    members = redisCommandArgv( src, 2, argv, argvlen );
+    if( members == NULL ) {
+        reply = createErrorReply("ERR connection error in proxy");
+        goto cleanup;
+    }
+    if( members->type != REDIS_REPLY_ARRAY ) {
+        reply = members;
+        members = NULL;
+        goto cleanup;
+    }
+
+    while( j < members->elements ) {
+        int argc = 2;
+        argv[0] = "SADD";
+        argvlen[0] = 4;
+        argv[1] = tmpkey;
+        argvlen[1] = sdslen(tmpkey);
+        for( ; j < members->elements && argc < 2+ZSTORE_CHUNK*2; j++ ) {
+            argv[argc] = members->element[j]->str;
+            argvlen[argc++] = members->element[j]->len;
+        }
+
+        if( redisAppendCommandArgv( dst, argc, argv, argvlen ) != REDIS_OK )
+            break;
+        sent++;
+        if( appendTmpKeyExpire( dst, tmpkey ) != REDIS_OK )
+            break;
+        sent++;
+    }
+
+    reply = readWriteReplies( dst, sent );
+    if( reply == NULL && j < members->elements )
+        reply = createErrorReply("ERR connection error in proxy");
+
+cleanup:
+    if( members ) freeReplyObject(members);
+    free(argv);
+    free(argvlen);
+    return reply;
+}
+
+/* Stream a sorted set from its server into tmpkey on the destination server,
+ * ZSTORE_CHUNK members at a time. The ZADD of a chunk is flushed before the
+ * next chunk is fetched, so both servers work at the same time and at most
+ * two chunks are held in memory. Returns NULL on success, the error reply
+ * otherwise. */
+static redisReply *copySortedSetChunked( redisContext *src, const char *key, size_t keylen,
+        redisContext *dst, sds tmpkey ) {
+    const char **argv;
+    size_t *argvlen;
+    char start[32], stop[32];
+    redisReply *chunk, *reply = NULL, *pending = NULL;
+    long long offset = 0;
+    int done = 0;
+
+    argv = malloc( (2+ZSTORE_CHUNK*2) * sizeof(char *) );
+    argvlen = malloc( (2+ZSTORE_CHUNK*2) * sizeof(size_t) );
+    if( argv == NULL || argvlen == NULL ) {
+        reply = createErrorReply("ERR out of memory in proxy");
+        goto cleanup;
+    }
+
+    while( !done ) {
+        argv[0] = "ZRANGE";
+        argvlen[0] = 6;
+        argv[1] = key;
+        argvlen[1] = keylen;
+        argv[2] = start;
+        argvlen[2] = snprintf(start, sizeof(start), "%lld", offset);
+        argv[3] = stop;
+        argvlen[3] = snprintf(stop, sizeof(stop), "%lld", offset+ZSTORE_CHUNK-1);
+        argv[4] = "WITHSCORES";
+        argvlen[4] = 10;
+        if( redisAppendCommandArgv( src, 5, argv, argvlen ) != REDIS_OK ) {
+            reply = createErrorReply("ERR connection error in proxy");
+            goto cleanup;
+        }
+        chunk = proxyGetReply( src );
+
+        /* The previous ZADD has been running meanwhile; collect it. */
+        if( pending ) {
+            freeReplyObject(pending);
+            pending = NULL;
+            reply = readWriteReplies( dst, 2 );
+            if( reply ) {
+                if( chunk ) freeReplyObject(chunk);
+                goto cleanup;
+            }
+        }
+
+        if( chunk == NULL ) {
+            reply = createErrorReply("ERR connection error in proxy");
+            goto cleanup;
+        }
+        if( offset == 0 && isWrongTypeReply(chunk) ) {
+            freeReplyObject(chunk);
+            reply = copySetMembers( src, key, keylen, dst, tmpkey );
+            goto cleanup;
+        }
+        if( chunk->type != REDIS_REPLY_ARRAY ) {
+            reply = chunk;
+            goto cleanup;
+        }
+
+        done = (chunk->elements < ZSTORE_CHUNK*2);
+        if( chunk->elements > 0 ) {
+            int argc = 2;
+            argv[0] = "ZADD";
+            argvlen[0] = 4;
+            argv[1] = tmpkey;
+            argvlen[1] = sdslen(tmpkey);
+
+            /* ZRANGE answers member, score; ZADD wants score, member. */
+            for( size_t j = 0; j+1 < chunk->elements; j += 2 ) {
+                argv[argc] = chunk->element[j+1]->str;
+                argvlen[argc++] = chunk->element[j+1]->len;
+                argv[argc] = chunk->element[j]->str;
+                argvlen[argc++] = chunk->element[j]->len;
+            }
+
+            if( redisAppendCommandArgv( dst, argc, argv, argvlen ) != REDIS_OK ||
+                    appendTmpKeyExpire( dst, tmpkey ) != REDIS_OK ||
+                    proxyFlush( dst ) != REDIS_OK ) {
+                freeReplyObject(chunk);
+                reply = createErrorReply("ERR connection error in proxy");
+                goto cleanup;
+            }
+
+            /* Keep the chunk alive until its ZADD was written. */
+            pending = chunk;
+        } else {
+            freeReplyObject(chunk);
+        }
+
+        offset += ZSTORE_CHUNK;
+    }
+
+    if( pending ) {
+        freeReplyObject(pending);
+        reply = readWriteReplies( dst, 2 );
+    }
+
+cleanup:
+    free(argv);
+    free(argvlen);
+    return reply;
+}
+
+/* ZUNIONSTORE/ZINTERSTORE. When every source lives on the destination server
+ * the command is simply forwarded. Otherwise each remote source is streamed in
+ * bounded chunks into a temporary key on the destination server, and the
+ * command is run there against those keys, so WEIGHTS and AGGREGATE keep their
+ * exact Redis semantics while memory stays bounded by the chunk size. */
+void *zsetStoreProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
+    PROXY_NOTUSED(keyInfo);
+    redisContext *dst, *src;
+    redisReply *reply = NULL;
+    sds *tmpkeys;
+    const char *str;
+    char *endptr, buf[32];
+    long numkeys;
+    int remote = 0;
+
+    if( argc < 4 ) {
+        return createArityErrorReply( argv[0], argvlen[0] );
+    }
+
+    str = argToString( buf, sizeof(buf), argv[2], argvlen[2] );
+    if( str != NULL )
+        numkeys = strtol(str, &endptr, 10);
+    if( str == NULL || *str == '\0' || *endptr != '\0' ) {
+        return createErrorReply("ERR value is not an integer or out of range");
+    }
+    if( numkeys < 1 ) {
+        return createErrorReply("ERR at least 1 input key is needed for ZUNIONSTORE/ZINTERSTORE");
+    }
+    if( numkeys > argc-3 ) {
+        return createErrorReply("ERR syntax error");
+    }
+
+    dst = lookupRedisServerWithKeyLen( p, argv[1], argvlen[1] );
+    if( dst == NULL )
+        return NULL;
+
+    tmpkeys = calloc( numkeys, sizeof(sds) );
+    if( tmpkeys == NULL )
+        return NULL;
+
+    for( int i = 0; i < numkeys; i++ ) {
+        src = lookupRedisServerWithKeyLen( p, argv[3+i], argvlen[3+i] );
+        if( src == dst )
+            continue;
+
+        remote++;
+        tmpkeys[i] = createTmpKeyForServer( p, dst );
+        if( tmpkeys[i] == NULL ) {
+            reply = createErrorReply("ERR proxy can't allocate a temporary key");
+            goto cleanup;
+        }
+
+        if( src == NULL ) {
+            reply = createErrorReply("ERR connection error in proxy");
+            goto cleanup;
+        }
+
+        reply = copySortedSetChunked( src, argv[3+i], argvlen[3+i], dst, tmpkeys[i] );
+        if( reply )
+            goto cleanup;
+    }
+
+    /* Run the real command against the local copies. */
+    {
+        const char **myargv = malloc( argc * sizeof(char *) );
+        size_t *myargvlen = malloc( argc * sizeof(size_t) );
+        if( myargv == NULL || myargvlen == NULL ) {
+            free(myargv);
+            free(myargvlen);
+            goto cleanup;
+        }
+
+        memcpy(myargv, argv, argc * sizeof(char *));
+        memcpy(myargvlen, argvlen, argc * sizeof(size_t));
+        for( int i = 0; i < numkeys; i++ ) {
+            if( tmpkeys[i] ) {
+                myargv[3+i] = tmpkeys[i];
+                myargvlen[3+i] = sdslen(tmpkeys[i]);
+            }
+        }
+
+        reply = forwardCommandArgv( p, dst, argc, myargv, myargvlen );
+        free(myargv);
+        free(myargvlen);
+    }
+
+cleanup:
+    if( remote ) {
+        const char **delargv = malloc( (remote+1) * sizeof(char *) );
+        size_t *delargvlen = malloc( (remote+1) * sizeof(size_t) );
+        int delargc = 1;
+
+        if( delargv && delargvlen ) {
+            delargv[0] = "DEL";
+            delargvlen[0] = 3;
+            for( int i = 0; i < numkeys; i++ ) {
+                if( tmpkeys[i] ) {
+                    delargv[delargc] = tmpkeys[i];
+                    delargvlen[delargc++] = sdslen(tmpkeys[i]);
+                }
+            }
+
+            if( delargc > 1 && dst->err == 0 ) {
+                redisReply *delreply = redisCommandArgv( dst, delargc, delargv, delargvlen );
+                if( delreply ) freeReplyObject(delreply);
+            }
+        }
+        free(delargv);
+        free(delargvlen);
+    }
+
+    for( int i = 0; i < numkeys; i++ ) {
+        if( tmpkeys[i] ) sdsfree(tmpkeys[i]);
+    }
+    free(tmpkeys);
+    adjustErroredConnections( p );
+    return reply;
+}
+
+/* Move the elements of an array reply to the end of another one. */
+static int appendArrayReply( redisReply *dst, redisReply *src ) {
+    redisReply **element;
+
+    if( src->elements == 0 )
+        return REDIS_OK;
+
+    element = realloc( dst->element, (dst->elements+src->elements) * sizeof(redisReply *) );
+    if( element == NULL )
+        return REDIS_ERR;
+
+    memcpy(element+dst->elements, src->element, src->elements * sizeof(redisReply *));
+    dst->element = element;
+    dst->elements += src->elements;
+
+    /* The elements now belong to dst. */
+    free(src->element);
+    src->element = NULL;
+    src->elements = 0;
+    return REDIS_OK;
+}
+
+/* KEYS runs on every server in parallel; the answers are concatenated. */
+void *keysProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
+    PROXY_NOTUSED(keyInfo);
+    redisReply *replyAll, *reply;
+
+    for( int i = 0; i < p->max_count; i++ ) {
+        proxyAppendCommandArgv( getRedisContextWithIdx( p, i ), argc, argv, argvlen );
+    }
+
+    replyAll = createReplyObject(REDIS_REPLY_ARRAY);
+    for( int i = 0; i < p->max_count; i++ ) {
+        reply = proxyGetReply( getRedisContextWithIdx( p, i ) );
+        if( reply == NULL )
+            continue;
+
+        if( replyAll && replyAll->type == REDIS_REPLY_ARRAY && reply->type == REDIS_REPLY_ARRAY ) {
+            if( appendArrayReply( replyAll, reply ) != REDIS_OK ) {
+                freeReplyObject(replyAll);
+                replyAll = NULL;
+            }
+            freeReplyObject(reply);
+        } else if( replyAll && replyAll->type != REDIS_REPLY_ERROR && reply->type == REDIS_REPLY_ERROR ) {
+            /* Report the first error, but still drain the other servers. */
+            freeReplyObject(replyAll);
+            replyAll = reply;
+        } else {
+            freeReplyObject(reply);
+        }
+    }
+
+    adjustErroredConnections( p );
+    return replyAll;
+}
+
+/* Cluster wide SCAN. The cursor handed out to clients encodes both the
+ * server being scanned and that server's own cursor:
+ *
+ *   cursor = server cursor * number of servers + server index
+ *
+ * Servers are walked one after the other; a server cursor of 0 moves on to
+ * the next server, and 0 is returned once the last one is done. */
+void *scanProc(proxyContext *p, int argc, const char **argv, size_t *argvlen, redisKeyInfo *keyInfo){
+    PROXY_NOTUSED(keyInfo);
+    unsigned long long cursor, nodecursor, next;
+    redisContext *c = NULL;
+    redisReply *reply;
+    const char *str;
+    char *endptr, buf[32];
+    int idx;
+
+    if( argc < 2 ) {
+        return createErrorReply("ERR wrong number of arguments for 'scan' command");
+    }
+
+    errno = 0;
+    str = argToString( buf, sizeof(buf), argv[1], argvlen[1] );
+    if( str != NULL )
+        cursor = strtoull(str, &endptr, 10);
+    if( str == NULL || *str == '\0' || *str == '-' || *endptr != '\0' || errno == ERANGE ) {
+        return createErrorReply("ERR invalid cursor");
+    }
+
+    idx = cursor % p->max_count;
+    nodecursor = cursor / p->max_count;
+
+    /* Skip the servers we lost the connection to. */
+    while( idx < p->max_count && (c = getRedisContextWithIdx( p, idx )) == NULL ) {
+        idx++;
+        nodecursor = 0;
+    }
+
+    if( c == NULL ) {
+        reply = createReplyObject(REDIS_REPLY_ARRAY);
+        if( reply == NULL )
+            return NULL;
+
+        reply->element = calloc( 2, sizeof(redisReply *) );
+        if( reply->element ) {
+            reply->elements = 2;
+            reply->element[0] = createStringReply(REDIS_REPLY_STRING, "0", 1);
+            reply->element[1] = createReplyObject(REDIS_REPLY_ARRAY);
+        }
+
+        if( reply->element == NULL || reply->element[0] == NULL || reply->element[1] == NULL ) {
+            freeReplyObject(reply);
+            return NULL;
+        }
+        return reply;
+    }
+
+    {
+        const char *cursorarg = argv[1];
+        size_t cursorarglen = argvlen[1];
+        argv[1] = buf;
+        argvlen[1] = snprintf(buf, sizeof(buf), "%llu", nodecursor);
+        reply = forwardCommandArgv( p, c, argc, argv, argvlen );
+        argv[1] = cursorarg;
+        argvlen[1] = cursorarglen;
+    }
+
+    if( reply == NULL || reply->type != REDIS_REPLY_ARRAY )
+        return reply;
+
+    if( reply->elements != 2 || reply->element[0]->type != REDIS_REPLY_STRING ) {
+        freeReplyObject(reply);
+        return createErrorReply("ERR unexpected SCAN reply from server");
+    }
+
+    next = strtoull(reply->element[0]->str, NULL, 10);
+    if( next == 0 ) {
+        /* This server is done, the next call starts on the following one. */
+        do {
+            idx++;
+        } while( idx < p->max_count && getRedisContextWithIdx( p, idx ) == NULL );
+        cursor = (idx < p->max_count) ? (unsigned long long)idx : 0;
+    } else {
+        if( next > (ULLONG_MAX - idx) / p->max_count ) {
+            freeReplyObject(reply);
+            return createErrorReply("ERR SCAN cursor overflow in proxy");
+        }
+        cursor = next * p->max_count + idx;
+    }
+
+    snprintf(buf, sizeof(buf), "%llu", cursor);
+    freeReplyObject(reply->element[0]);
+    reply->element[0] = createStringReply(REDIS_REPLY_STRING, buf, strlen(buf));
+    if( reply->element[0] == NULL ) {
+        freeReplyObject(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+/* Walk the whole keyspace, running the SCAN of every server concurrently:
+ * each round appends one SCAN per unfinished server before reading any reply.
+ * Every batch of keys is handed to the callback as soon as it arrives; the
+ * callback doesn't own the reply. */
+int proxyScanAll(proxyContext *p, const char *pattern, int count, proxyScanCallback *fn, void *privdata) {
+    unsigned long long *cursors;
+    char *done;
+    char cursorbuf[32], countbuf[32];
+    const char *argv[6];
+    size_t argvlen[6], patternlen, countlen;
+    int argc, pending, status = REDIS_OK;
+
+    cursors = calloc( p->max_count, sizeof(unsigned long long) );
+    done = calloc( p->max_count, sizeof(char) );
+    if( cursors == NULL || done == NULL ) {
+        free(cursors);
+        free(done);
+        return REDIS_ERR;
+    }
+
+    patternlen = pattern ? strlen(pattern) : 0;
+    countlen = snprintf(countbuf, sizeof(countbuf), "%d", count);
+    do {
+        pending = 0;
+        for( int i = 0; i < p->max_count; i++ ) {
+            redisContext *c = getRedisContextWithIdx( p, i );
+            if( done[i] )
+                continue;
+            if( c == NULL ) {
+                done[i] = 1;
+                status = REDIS_ERR;
+                continue;
+            }
+
+            argc = 0;
+            argv[argc] = "SCAN";
+            argvlen[argc++] = 4;
+            argv[argc] = cursorbuf;
+            argvlen[argc++] = snprintf(cursorbuf, sizeof(cursorbuf), "%llu", cursors[i]);
+            if( pattern ) {
+                argv[argc] = "MATCH";
+                argvlen[argc++] = 5;
+                argv[argc] = pattern;
+                argvlen[argc++] = patternlen;
+            }
+            if( count > 0 ) {
+                argv[argc] = "COUNT";
+                argvlen[argc++] = 5;
+                argv[argc] = countbuf;
+                argvlen[argc++] = countlen;
+            }
+            proxyAppendCommandArgv( c, argc, argv, argvlen );
+            pending++;
+        }
+
+        for( int i = 0; i < p->max_count; i++ ) {
+            redisReply *reply;
+            if( done[i] )
+                continue;
+
+            reply = proxyGetReply( getRedisContextWithIdx( p, i ) );
+            if( reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+                    reply->element[0]->type != REDIS_REPLY_STRING ||
+                    reply->element[1]->type != REDIS_REPLY_ARRAY ) {
+                done[i] = 1;
+                status = REDIS_ERR;
+                if( reply ) freeReplyObject(reply);
+                continue;
+            }
+
+            cursors[i] = strtoull(reply->element[0]->str, NULL, 10);
+            if( cursors[i] == 0 )
+                done[i] = 1;
+
+            if( fn && reply->element[1]->elements > 0 )
+                fn( p, reply->element[1], privdata );
+            freeReplyObject(reply);
+        }
+    } while( pending > 0 );
+
+    free(cursors);
+    free(done);
+    adjustErroredConnections( p );
+    return status;
+}
+
+void loadCommandTable(dict *commands) {
+    static redisKeyInfo keyInfos[] = {
+        { "get", oneKeyProc,1,1,1,0,0},
+        { "set", oneKeyProc,1,1,1,0,0},
+        { "setnx", oneKeyProc,1,1,1,0,0},
+        { "setex", oneKeyProc,1,1,1,0,0},
+        { "psetex", oneKeyProc,1,1,1,0,0},
+        { "append", oneKeyProc,1,1,1,0,0},
+        { "exists", oneKeyProc,1,1,1,0,0},
+        { "strlen", oneKeyProc,1,1,1,0,0},
+        { "del", sumIntegerKeyProc,1,-1,1,0,0},
+        { "getbit", oneKeyProc,1,1,1,0,0},
+        { "setbit", oneKeyProc,1,1,1,0,0},
+        { "setrange", oneKeyProc,1,1,1,0,0},
+        { "getrange", oneKeyProc,1,1,1,0,0},
+        { "substr", oneKeyProc, 1,1,1,0,0},
+        { "incr", oneKeyProc, 1,1,1,0,0},
+        { "decr", oneKeyProc, 1,1,1,0,0},
+        { "mget", mgetProc, 1,-1,1,0,0},
+        { "rpush", oneKeyProc, 1,1,1,0,0},
+        { "lpush", oneKeyProc, 1,1,1,0,0},
+        { "rpushx", oneKeyProc,1,1,1,0,0},
+        { "lpushx", oneKeyProc,1,1,1,0,0},
+        { "linsert", oneKeyProc, 1,1,1,0,0},
+        { "rpop", oneKeyProc, 1,1,1,0,0},
+        { "lpop", oneKeyProc, 1,1,1,0,0},
+        { "brpop",oneKeyProc,1,1,1,0,0},
+        { "brpoplpush",notsupportCommandProc,1,2,1,0,0},
+        { "blpop",notsupportCommandProc,1,-2,1,0,0},
+        { "llen", oneKeyProc,1,1,1,0,0},
+        { "lindex",oneKeyProc,1,1,1,0,0},
+        { "lset", oneKeyProc,1,1,1,0,0},
+        { "lrange", oneKeyProc,1,1,1,0,0},
+        { "ltrim", oneKeyProc,1,1,1,0,0},
+        { "lrem", oneKeyProc,1,1,1,0,0},
+        { "rpoplpush",notsupportCommandProc,1,2,1,0,0},
+        { "sadd",oneKeyProc,1,1,1,0,0},
+        { "srem",oneKeyProc,1,1,1,0,0},
+        { "smove",oneKeyProc,1,2,1,0,0},
+        { "sismember",oneKeyProc,1,1,1,0,0},
+        { "scard",oneKeyProc,1,1,1,0,0},
+        { "spop",oneKeyProc,1,1,1,0,0},
+        { "srandmember",oneKeyProc,1,1,1,0,0},
+        { "sinter",setOperationProc,1,-1,1,0,0},
+        { "sinterstore",setOperationProc,1,-1,1,0,0},
+        { "sunion",setOperationProc,1,-1,1,0,0},
+        { "sunionstore",setOperationProc,1,-1,1,0,0},
+        { "sdiff",setOperationProc,1,-1,1,0,0},
+        { "sdiffstore",setOperationProc,1,-1,1,0,0},
+        { "smembers",oneKeyProc,1,1,1,0,0},
+        { "zadd",oneKeyProc,1,1,1,0,0},
+        { "zincrby",oneKeyProc,1,1,1,0,0},
+        { "zrem",oneKeyProc,1,1,1,0,0},
+        { "zremrangebyscore",oneKeyProc,1,1,1,0,0},
+        { "zremrangebyrank",oneKeyProc,1,1,1,0,0},
+        { "zunionstore",zsetStoreProc,1,1,1,0,0},
+        { "zinterstore",zsetStoreProc,1,1,1,0,0},
+        { "zrange",oneKeyProc,1,1,1,0,0},
+        { "zrangebyscore",oneKeyProc,1,1,1,0,0},
+        { "zrevrangebyscore",oneKeyProc,1,1,1,0,0},
+        { "zcount",oneKeyProc,1,1,1,0,0},
+        { "zrevrange",oneKeyProc,1,1,1,0,0},
+        { "zcard",oneKeyProc,1,1,1,0,0},
+        { "zscore",oneKeyProc,1,1,1,0,0},
+        { "zrank",oneKeyProc,1,1,1,0,0},
+        { "zrevrank",oneKeyProc,1,1,1,0,0},
+        { "hset",oneKeyProc,1,1,1,0,0},
+        { "hsetnx",oneKeyProc,1,1,1,0,0},
+        { "hget",oneKeyProc,1,1,1,0,0},
+        { "hmset",oneKeyProc,1,1,1,0,0},
+        { "hmget",oneKeyProc,1,1,1,0,0},
+        { "hincrby",oneKeyProc,1,1,1,0,0},
+        { "hincrbyfloat",oneKeyProc,1,1,1,0,0},
+        { "hdel",oneKeyProc,1,1,1,0,0},
+        { "hlen",oneKeyProc,1,1,1,0,0},
+        { "hkeys",oneKeyProc,1,1,1,0,0},
+        { "hvals",oneKeyProc,1,1,1,0,0},
+        { "hgetall",oneKeyProc,1,1,1,0,0},
+        { "hexists",oneKeyProc,1,1,1,0,0},
+        { "incrby",oneKeyProc,1,1,1,0,0},
+        { "decrby",oneKeyProc,1,1,1,0,0},
+        { "incrbyfloat",oneKeyProc,1,1,1,0,0},
+        { "getset",oneKeyProc,1,1,1,0,0},
+        { "mset",msetProc,1,-1,2,0,0},
+        { "msetnx",notsupportCommandProc,1,-1,2,0,0},
+        { "randomkey",notsupportCommandProc,0,0,0,0,0},
+        { "select",notsupportCommandProc,0,0,0,0,0},
+        { "move",notsupportCommandProc,1,1,1,0,0},
+        { "rename",notsupportCommandProc,1,2,1,0,0},
+        { "renamenx",notsupportCommandProc,1,2,1,0,0},
+        { "expire",notsupportCommandProc,1,1,1,0,0},
+        { "expireat",notsupportCommandProc,1,1,1,0,0},
+        { "pexpire",notsupportCommandProc,1,1,1,0,0},
+        { "pexpireat",notsupportCommandProc,1,1,1,0,0},
+        { "keys",keysProc,0,0,0,0,0},
+        { "scan",scanProc,0,0,0,0,0},
+        { "dbsize",sumIntegerKeyProc,0,0,0,0,0},
+        { "auth",allServerProc,0,0,0,0,0},
+        { "ping",allServerProc,0,0,0,0,0},
+        { "echo",notsupportCommandProc,0,0,0,0,0},
+        { "save",notsupportCommandProc,0,0,0,0,0},
+        { "bgsave",notsupportCommandProc,0,0,0,0,0},
+        { "bgrewriteaof",notsupportCommandProc,0,0,0,0,0},
+        { "shutdown",notsupportCommandProc,0,0,0,0,0},
+        { "lastsave",notsupportCommandProc,0,0,0,0,0},
+        { "type",notsupportCommandProc,1,1,1,0,0},
+        { "multi",notsupportCommandProc,0,0,0,0,0},
+        { "exec",notsupportCommandProc,0,0,0,0,0},
+        { "discard",notsupportCommandProc,0,0,0,0,0},
+        { "sync",notsupportCommandProc,0,0,0,0,0},
+        { "replconf",notsupportCommandProc,0,0,0,0,0},
+        { "flushdb",allServerProc,0,0,0,0,0},
+        { "flushall",allServerProc,0,0,0,0,0},
+        { "sort",notsupportCommandProc,1,1,1,0,0},
+        { "info",notsupportCommandProc,0,0,0,0,0},
+        { "monitor",notsupportCommandProc,0,0,0,0,0},
+        { "ttl",oneKeyProc,1,1,1,0,0},
+        { "pttl",notsupportCommandProc,1,1,1,0,0},
+        { "persist",notsupportCommandProc,1,1,1,0,0},
+        { "slaveof",notsupportCommandProc,0,0,0,0,0},
+        { "debug",notsupportCommandProc,0,0,0,0,0},
+        { "config",notsupportCommandProc,0,0,0,0,0},
+        { "subscribe",notsupportCommandProc,0,0,0,0,0},
+        { "unsubscribe",notsupportCommandProc,0,0,0,0,0},
+        { "psubscribe",notsupportCommandProc,0,0,0,0,0},
+        { "punsubscribe",notsupportCommandProc,0,0,0,0,0},
+        { "publish",oneKeyProc,1,1,1,0,0},
+        { "watch",notsupportCommandProc,1,-1,1,0,0},
+        { "unwatch",notsupportCommandProc,0,0,0,0,0},
+        { "dump",notsupportCommandProc,1,1,1,0,0},
+        { "object",notsupportCommandProc,2,2,2,0,0},
+        { "client",notsupportCommandProc,0,0,0,0,0},
+        { "slowlog",notsupportCommandProc,0,0,0,0,0},
+        { "time",notsupportCommandProc,0,0,0,0,0},
+        { "bitop",notsupportCommandProc,2,-1,1,0,0},
+        { "bitcount",notsupportCommandProc,1,1,1,0,0},
+        { "eval",evalProc,3,-1,1,0,0},
+        { "evalsha",evalProc,3,-1,1,0,0}
+    }; 
+
+    int numcommands = sizeof(keyInfos)/sizeof(redisKeyInfo);
+    for (int i = 0; i < numcommands; i++) {
+        redisKeyInfo *c = keyInfos+i;
+        int retval = dictAdd(commands, sdsnew(c->name), c);
+        if( 0 != retval ) {
+            printf("Error: dictAdd: %s\n", c->name );
+        }
+    }
+}
+
+/* Command names are looked up as C strings copied to the stack, so lookups
+ * neither allocate nor depend on sds. */
+#define PROXY_MAX_COMMAND_NAME 32
+
+redisKeyInfo *lookupRedisKeyInfo( const char *cmd, size_t len ) {
+    static dict *commands;
+    /* Command table. sds string -> command struct pointer. */
+    static dictType commandTableDictType = {
+        dictCaseHash,              /* hash function */
+        NULL,                      /* key dup */
+        NULL,                      /* val dup */
+        dictSdsKeyCaseCompare,     /* key compare */
+        dictSdsDestructor,         /* key destructor */
+        NULL                       /* val destructor */
+    };
+    char name[PROXY_MAX_COMMAND_NAME];
+
+    if( commands == NULL ) {
+        commands = dictCreate(&commandTableDictType,NULL);
+        loadCommandTable(commands);
+    }
+
+    if( argToString( name, sizeof(name), cmd, len ) == NULL )
+        return NULL;
+
+    return dictFetchValue(commands, name);
+}
+
+/* Run a command given as arguments and their lengths, like redisCommandArgv:
+ * argvlen may be NULL to use strlen. The arguments are not copied. */
+void *proxyCommandArgv( proxyContext *p, int argc, const char **argv, const size_t *argvlen ) {
+    const char *stackargv[PROXY_STACK_ARGS];
+    size_t stackargvlen[PROXY_STACK_ARGS];
+    const char **myargv = stackargv;
+    size_t *myargvlen = stackargvlen;
+    redisKeyInfo *info;
+    void *reply = NULL;
+
+    if( p == NULL || argc < 1 )
+        return NULL;
+
+    /* Procs may swap arguments while they run, so they get their own arrays. */
+    if( argc > PROXY_STACK_ARGS ) {
+        myargv = malloc( argc * sizeof(char *) );
+        myargvlen = malloc( argc * sizeof(size_t) );
+        if( myargv == NULL || myargvlen == NULL )
+            goto cleanup;
+    }
+
+    memcpy(myargv, argv, argc * sizeof(char *));
+    for( int i = 0; i < argc; i++ ) {
+        myargvlen[i] = argvlen ? argvlen[i] : strlen(argv[i]);
+    }
+
+    info = lookupRedisKeyInfo( myargv[0], myargvlen[0] );
+    if( info ) {
+        reply = info->proc( p, argc, myargv, myargvlen, info );
+    } else {
+        reply = notsupportCommandProc( p, argc, myargv, myargvlen, info );
+    }
+
+cleanup:
+    if( myargv != stackargv ) {
+        free(myargv);
+        free(myargvlen);
+    }
+    return reply;
+}
+
+void *proxyvCommand( proxyContext *p, const char *format, va_list ap ) {
+    char buf[PROXY_STACK_BUF];
+    const char *argv[PROXY_STACK_ARGS];
+    size_t argvlen[PROXY_STACK_ARGS];
+    char **sdsargv = NULL;
+    void *reply = NULL;
+    va_list cpy;
+    int argc;
+
+    if( p == NULL )
+        return NULL;
+
+    /* Short commands are formatted on the stack. */
+    va_copy(cpy, ap);
+    argc = redisvFormatArgvBuf( buf, sizeof(buf), argv, argvlen, PROXY_STACK_ARGS, format, cpy );
+    va_end(cpy);
+    if( argc >= 0 )
+        return proxyCommandArgv( p, argc, argv, argvlen );
+
+    if( redisvFormatCommandArgList( &sdsargv, &argc, format, ap ) == -1 )
+        return NULL;
+
+    if( argc > 0 ) {
+        size_t *sdsargvlen = malloc( argc * sizeof(size_t) );
+        if( sdsargvlen ) {
+            for( int i = 0; i < argc; i++ ) {
+                sdsargvlen[i] = sdslen(sdsargv[i]);
+            }
+            reply = proxyCommandArgv( p, argc, (const char **)sdsargv, sdsargvlen );
+            free(sdsargvlen);
+        }
+    }
+
+    freeProxyCommand(argc,sdsargv);
+    return reply;
+}
+
+void *proxyCommand(proxyContext *p, const char *format, ...) {
+    va_list args;
+    void *reply;
+
+    va_start(args, format);
+    reply = proxyvCommand( p, format, args );
+    va_end(args);
+    return reply;
+}
+
+/* Pipelines. Commands are routed as they are appended and go straight to the
+ * output buffers of their servers. proxyPipelineExec flushes every server
+ * before reading any reply, so a batch costs one round trip to each server
+ * instead of one per command. Multi key commands are split into one request
+ * per server, the replies of a command are merged as below. */
+#define PROXY_MERGE_NONE 0  /* Known without asking a server, e.g. an error */
+#define PROXY_MERGE_ONE 1   /* The first error, otherwise the first reply */
+#define PROXY_MERGE_SUM 2   /* Integers added up, DEL and DBSIZE */
+#define PROXY_MERGE_ARRAY 3 /* MGET: elements put back in key order */
+
+typedef struct proxyPipelineEntry {
+    int merge;
+    redisReply *reply;
+    long long integer;      /* PROXY_MERGE_SUM */
+    int failed;             /* Requests that couldn't be sent or read */
+    redisReply **parts;     /* PROXY_MERGE_ARRAY: reply of every server */
+    int *nodes;             /* PROXY_MERGE_ARRAY: server of every key */
+    int keys;
+} proxyPipelineEntry;
+
+/* A request waiting for its reply. Servers reply in order, so reading the
+ * requests in the order they were sent reads every server in order. */
+typedef struct proxyPipelineRequest {
+    int entry;
+    int node;
+} proxyPipelineRequest;
+
+struct proxyPipeline {
+    proxyContext *p;
+    proxyPipelineEntry *entries;
+    int count;
+    int size;
+    int done;               /* Entries before this one have their reply */
+    proxyPipelineRequest *requests;
+    int pending;
+    int maxpending;
+};
+
+proxyPipeline *proxyPipelineBegin( proxyContext *p ) {
+    proxyPipeline *pp;
+
+    if( p == NULL )
+        return NULL;
+
+    pp = calloc(1, sizeof(proxyPipeline));
+    if( pp == NULL )
+        return NULL;
+
+    pp->p = p;
+    return pp;
+}
+
+/* Make room for an entry and its requests before anything is written to an
+ * output buffer: a request that was sent has to be recorded, or its reply
+ * would be taken for the reply of the next one. */
+static int pipelineReserve( proxyPipeline *pp, int requests ) {
+    if( pp->count == pp->size ) {
+        int size = pp->size ? pp->size*2 : 16;
+        proxyPipelineEntry *entries = realloc(pp->entries, size * sizeof(proxyPipelineEntry));
+        if( entries == NULL )
+            return REDIS_ERR;
+
+        pp->entries = entries;
+        pp->size = size;
+    }
+
+    if( pp->pending + requests > pp->maxpending ) {
+        int size = pp->maxpending ? pp->maxpending*2 : 16;
+        proxyPipelineRequest *reqs;
+
+        while( size < pp->pending + requests )
+            size *= 2;
+
+        reqs = realloc(pp->requests, size * sizeof(proxyPipelineRequest));
+        if( reqs == NULL )
+            return REDIS_ERR;
+
+        pp->requests = reqs;
+        pp->maxpending = size;
+    }
+
+    return REDIS_OK;
+}
+
+static proxyPipelineEntry *pipelineAddEntry( proxyPipeline *pp, int merge, redisReply *reply ) {
+    proxyPipelineEntry *e = &pp->entries[pp->count++];
+
+    memset(e, 0, sizeof(proxyPipelineEntry));
+    e->merge = merge;
+    e->reply = reply;
+    return e;
+}
+
+/* Send a request for the last entry. */
+static void pipelineSend( proxyPipeline *pp, int node, int argc, const char **argv, const size_t *argvlen ) {
+    proxyPipelineEntry *e = &pp->entries[pp->count-1];
+    redisContext *c = node >= 0 ? pp->p->contexts[node] : NULL;
+    proxyPipelineRequest *req;
+
+    if( c == NULL || redisAppendCommandArgv( c, argc, argv, argvlen ) != REDIS_OK ) {
+        e->failed++;
+        return;
+    }
+
+    req = &pp->requests[pp->pending++];
+    req->entry = pp->count-1;
+    req->node = node;
+}
+
+/* Send a command to every server. */
+static int pipelineAppendAll( proxyPipeline *pp, int merge, int argc, const char **argv, const size_t *argvlen ) {
+    if( pipelineReserve( pp, pp->p->count ) != REDIS_OK )
+        return REDIS_ERR;
+
+    pipelineAddEntry( pp, merge, NULL );
+    for( int i = 0; i < pp->p->count; i++ ) {
+        pipelineSend( pp, i, argc, argv, argvlen );
+    }
+    return REDIS_OK;
+}
+
+/* Send a command that takes keys (or groups of keystep arguments starting
+ * with a key) as one request per server, with the keys that server owns. */
+static int pipelineAppendByKey( proxyPipeline *pp, int merge, int argc, const char **argv, const size_t *argvlen, int keystep ) {
+    proxyContext *p = pp->p;
+    const char *stackargv[PROXY_STACK_ARGS];
+    size_t stackargvlen[PROXY_STACK_ARGS];
+    const char **myargv = stackargv;
+    size_t *myargvlen = stackargvlen;
+    int keys = (argc-1)/keystep;
+    int *nodes = malloc( keys * sizeof(int) );
+    redisReply **parts = NULL;
+    proxyPipelineEntry *e;
+    int status = REDIS_ERR;
+
+    if( argc > PROXY_STACK_ARGS ) {
+        myargv = malloc( argc * sizeof(char *) );
+        myargvlen = malloc( argc * sizeof(size_t) );
+    }
+
+    if( merge == PROXY_MERGE_ARRAY )
+        parts = calloc( p->max_count, sizeof(redisReply *) );
+
+    if( !nodes || !myargv || !myargvlen || (merge == PROXY_MERGE_ARRAY && !parts) ||
+            pipelineReserve( pp, p->max_count ) != REDIS_OK )
+        goto cleanup;
+
+    for( int i = 0; i < keys; i++ ) {
+        int k = 1+i*keystep;
+        nodes[i] = getRedisContextIdx( p, lookupRedisServerWithKeyLen( p, argv[k], argvlen[k] ) );
+    }
+
+    e = pipelineAddEntry( pp, merge, NULL );
+    myargv[0] = argv[0];
+    myargvlen[0] = argvlen[0];
+    for( int n = 0; n < p->max_count; n++ ) {
+        int myargc = 1;
+        for( int i = 0; i < keys; i++ ) {
+            if( nodes[i] != n )
+                continue;
+
+            for( int j = 1+i*keystep; j < 1+(i+1)*keystep; j++ ) {
+                myargv[myargc] = argv[j];
+                myargvlen[myargc++] = argvlen[j];
+            }
+        }
+
+        if( myargc > 1 )
+            pipelineSend( pp, n, myargc, myargv, myargvlen );
+    }
+
+    for( int i = 0; i < keys; i++ ) {
+        if( nodes[i] < 0 )
+            e->failed++;
+    }
+
+    if( merge == PROXY_MERGE_ARRAY ) {
+        e->parts = parts;
+        e->nodes = nodes;
+        e->keys = keys;
+        parts = NULL;
+        nodes = NULL;
+    }
+    status = REDIS_OK;
+
+cleanup:
+    if( myargv != stackargv ) {
+        free(myargv);
+        free(myargvlen);
+    }
+    free(nodes);
+    free(parts);
+    return status;
+}
+
+static void pipelineMerge( proxyPipelineEntry *e, int node, redisReply *r ) {
+    if( r == NULL ) {
+        e->failed++;
+        return;
+    }
+
+    switch( e->merge ) {
+    case PROXY_MERGE_ARRAY:
+        e->parts[node] = r;
+        return;
+    case PROXY_MERGE_SUM:
+        if( r->type == REDIS_REPLY_ERROR && e->reply == NULL ) {
+            e->reply = r;
+            return;
+        }
+        if( r->type == REDIS_REPLY_INTEGER )
+            e->integer += r->integer;
+        break;
+    default:
+        if( e->reply == NULL ) {
+            e->reply = r;
+            return;
+        }
+        if( r->type == REDIS_REPLY_ERROR && e->reply->type != REDIS_REPLY_ERROR ) {
+            freeReplyObject(e->reply);
+            e->reply = r;
+            return;
+        }
+        break;
+    }
+
+    freeReplyObject(r);
+}
+
+/* Put the MGET replies of the servers back in key order. Keys of servers
+ * that couldn't be reached are nil, like in mgetProc; an error of a server
+ * is the reply. */
+static redisReply *pipelineMergeArray( proxyPipelineEntry *e, int max_count ) {
+    redisReply *reply;
+    size_t *cursor;
+
+    for( int n = 0; n < max_count; n++ ) {
+        if( e->parts[n] && e->parts[n]->type == REDIS_REPLY_ERROR ) {
+            reply = e->parts[n];
+            e->parts[n] = NULL;
+            return reply;
+        }
+    }
+
+    reply = createReplyObject(REDIS_REPLY_ARRAY);
+    cursor = calloc( max_count, sizeof(size_t) );
+    if( reply == NULL || cursor == NULL ||
+            (reply->element = calloc( e->keys, sizeof(redisReply *) )) == NULL ) {
+        if( reply )
+            freeReplyObject(reply);
+        free(cursor);
+        return NULL;
+    }
+
+    reply->elements = e->keys;
+    for( int i = 0; i < e->keys; i++ ) {
+        int n = e->nodes[i];
+        redisReply *r = n >= 0 ? e->parts[n] : NULL;
+
+        if( r && r->type == REDIS_REPLY_ARRAY && cursor[n] < r->elements ) {
+            reply->element[i] = r->element[cursor[n]];
+            r->element[cursor[n]++] = NULL;
+        } else if( (reply->element[i] = createReplyObject(REDIS_REPLY_NIL)) == NULL ) {
+            freeReplyObject(reply);
+            reply = NULL;
+            break;
+        }
+    }
+
+    free(cursor);
+    return reply;
+}
+
+static void pipelineFinish( proxyPipelineEntry *e, int max_count ) {
+    switch( e->merge ) {
+    case PROXY_MERGE_ONE:
+        /* Part of the command was lost, a reply of the rest would lie. */
+        if( e->failed && e->reply && e->reply->type != REDIS_REPLY_ERROR ) {
+            freeReplyObject(e->reply);
+            e->reply = NULL;
+        }
+        break;
+    case PROXY_MERGE_SUM:
+        if( e->reply == NULL && (e->reply = createReplyObject(REDIS_REPLY_INTEGER)) != NULL )
+            e->reply->integer = e->integer;
+        break;
+    case PROXY_MERGE_ARRAY:
+        e->reply = pipelineMergeArray( e, max_count );
+        for( int n = 0; n < max_count; n++ ) {
+            if( e->parts[n] )
+                freeReplyObject(e->parts[n]);
+        }
+        free(e->parts);
+        free(e->nodes);
+        e->parts = NULL;
+        e->nodes = NULL;
+        break;
+    }
+}
+
+/* Flush every server, then read the reply of every request sent so far. */
+static void pipelineCollect( proxyPipeline *pp ) {
+    proxyContext *p = pp->p;
+
+    for( int n = 0; n < p->max_count; n++ ) {
+        if( p->contexts[n] )
+            proxyFlush( p->contexts[n] );
+    }
+
+    for( int i = 0; i < pp->pending; i++ ) {
+        proxyPipelineRequest *req = &pp->requests[i];
+        pipelineMerge( &pp->entries[req->entry], req->node, proxyGetReply( p->contexts[req->node] ) );
+    }
+    pp->pending = 0;
+
+    for( ; pp->done < pp->count; pp->done++ ) {
+        pipelineFinish( &pp->entries[pp->done], p->max_count );
+    }
+    adjustErroredConnections( p );
+}
+
+static int pipelineAppend( proxyPipeline *pp, int argc, const char **argv, size_t *argvlen ) {
+    proxyContext *p = pp->p;
+    redisKeyInfo *info = lookupRedisKeyInfo( argv[0], argvlen[0] );
+    redisCommandProc *proc = info ? info->proc : notsupportCommandProc;
+    redisReply *reply = NULL;
+
+    if( proc == oneKeyProc ) {
+        if( argc >= 2 ) {
+            if( pipelineReserve( pp, 1 ) != REDIS_OK )
+                return REDIS_ERR;
+
+            pipelineAddEntry( pp, PROXY_MERGE_ONE, NULL );
+            pipelineSend( pp, getRedisContextIdx( p, lookupRedisServerWithKeyLen( p, argv[1], argvlen[1] ) ),
+                    argc, argv, argvlen );
+            return REDIS_OK;
+        }
+        reply = createArityErrorReply( argv[0], argvlen[0] );
+    } else if( proc == mgetProc || proc == msetProc || (proc == sumIntegerKeyProc && info->keystep > 0) ) {
+        if( argc >= 2 && (argc-1) % info->keystep == 0 ) {
+            int merge = proc == mgetProc ? PROXY_MERGE_ARRAY :
+                        proc == msetProc ? PROXY_MERGE_ONE : PROXY_MERGE_SUM;
+            return pipelineAppendByKey( pp, merge, argc, argv, argvlen, info->keystep );
+        }
+        reply = createArityErrorReply( argv[0], argvlen[0] );
+    } else if( proc == sumIntegerKeyProc ) {
+        return pipelineAppendAll( pp, PROXY_MERGE_SUM, argc, argv, argvlen );
+    } else if( proc == allServerProc ) {
+        return pipelineAppendAll( pp, PROXY_MERGE_ONE, argc, argv, argvlen );
+    } else if( proc == notsupportCommandProc ) {
+        reply = notsupportCommandProc( p, argc, argv, argvlen, info );
+    } else {
+        /* Commands that take several steps (EVAL, set operations, KEYS, ...)
+         * run on their own, after the commands before them are done. */
+        pipelineCollect( pp );
+        reply = proxyCommandArgv( p, argc, argv, argvlen );
+    }
+
+    if( pipelineReserve( pp, 0 ) != REDIS_OK ) {
+        if( reply )
+            freeReplyObject(reply);
+        return REDIS_ERR;
+    }
+
+    pipelineAddEntry( pp, PROXY_MERGE_NONE, reply );
+    return REDIS_OK;
+}
+
+/* Append a command to the pipeline, argvlen may be NULL to use strlen. The
+ * arguments are not kept. Returns REDIS_ERR when the command couldn't be
+ * added, it then has no reply in the result of proxyPipelineExec. */
+int proxyPipelineAppendArgv( proxyPipeline *pp, int argc, const char **argv, const size_t *argvlen ) {
+    size_t stackargvlen[PROXY_STACK_ARGS];
+    size_t *myargvlen = stackargvlen;
+    int status;
+
+    if( pp == NULL || argc < 1 )
+        return REDIS_ERR;
+
+    if( argc > PROXY_STACK_ARGS ) {
+        myargvlen = malloc( argc * sizeof(size_t) );
+        if( myargvlen == NULL )
+            return REDIS_ERR;
+    }
+
+    for( int i = 0; i < argc; i++ ) {
+        myargvlen[i] = argvlen ? argvlen[i] : strlen(argv[i]);
+    }
+
+    status = pipelineAppend( pp, argc, argv, myargvlen );
+    if( myargvlen != stackargvlen )
+        free(myargvlen);
+    return status;
+}
+
+int proxyvPipelineAppend( proxyPipeline *pp, const char *format, va_list ap ) {
+    char buf[PROXY_STACK_BUF];
+    const char *argv[PROXY_STACK_ARGS];
+    size_t argvlen[PROXY_STACK_ARGS];
+    char **sdsargv = NULL;
+    int status = REDIS_ERR;
+    va_list cpy;
+    int argc;
+
+    if( pp == NULL )
+        return REDIS_ERR;
+
+    va_copy(cpy, ap);
+    argc = redisvFormatArgvBuf( buf, sizeof(buf), argv, argvlen, PROXY_STACK_ARGS, format, cpy );
+    va_end(cpy);
+    if( argc >= 0 )
+        return proxyPipelineAppendArgv( pp, argc, argv, argvlen );
+
+    if( redisvFormatCommandArgList( &sdsargv, &argc, format, ap ) == -1 )
+        return REDIS_ERR;
+
+    if( argc > 0 ) {
+        size_t *sdsargvlen = malloc( argc * sizeof(size_t) );
+        if( sdsargvlen ) {
+            for( int i = 0; i < argc; i++ ) {
+                sdsargvlen[i] = sdslen(sdsargv[i]);
+            }
+            status = proxyPipelineAppendArgv( pp, argc, (const char **)sdsargv, sdsargvlen );
+            free(sdsargvlen);
+        }
+    }
+
+    freeProxyCommand(argc,sdsargv);
+    return status;
+}
+
+int proxyPipelineAppend( proxyPipeline *pp, const char *format, ... ) {
+    va_list args;
+    int status;
+
+    va_start(args, format);
+    status = proxyvPipelineAppend( pp, format, args );
+    va_end(args);
+    return status;
+}
+
+/* Send the commands and return their replies in order, as the elements of an
+ * array reply. A command that lost its server gets an error reply. The
+ * pipeline is freed. */
+redisReply *proxyPipelineExec( proxyPipeline *pp ) {
+    redisReply *reply;
+
+    if( pp == NULL )
+        return NULL;
+
+    pipelineCollect( pp );
+
+    reply = createReplyObject(REDIS_REPLY_ARRAY);
+    if( reply && pp->count > 0 ) {
+        reply->element = malloc( pp->count * sizeof(redisReply *) );
+        if( reply->element == NULL ) {
+            freeReplyObject(reply);
+            reply = NULL;
+        }
+    }
+
+    for( int i = 0; i < pp->count; i++ ) {
+        redisReply *r = pp->entries[i].reply;
+
+        if( reply == NULL ) {
+            if( r )
+                freeReplyObject(r);
+            continue;
+        }
+
+        if( r == NULL )
+            r = createErrorReply( "ERR no connection to the server" );
+        reply->element[reply->elements++] = r;
+    }
+
+    free(pp->entries);
+    free(pp->requests);
+    free(pp);
+    return reply;
+}
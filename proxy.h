@@ -7,6 +7,8 @@
 extern "C" {
 #endif
 
+struct dict; /* dictionary header is included in proxy.c */
+
 /* Context for a connection to Redis */
 typedef struct ketamaMCS{
     unsigned int point;
@@ -15,12 +17,21 @@ typedef struct ketamaMCS{
     int port;
 }ketamaMCS;
 
+/* The server contexts may read replies with redisPooledFunctions, e.g.
+ *
+ *   for (i = 0; i < p->count; i++)
+ *       if (p->contexts[i]) p->contexts[i]->reader->fn = &redisPooledFunctions;
+ *
+ * so that routing a GET of a short value makes no allocation. Every reply of
+ * the proxy, merged ones included, is still free'd with freeReplyObject.
+ * Other reply object functions can't be used on these contexts. */
 typedef struct proxyContext {
     int count;
     int max_count;
     redisContext **contexts;
     ketamaMCS *mcs;
     int mcs_count;
+    struct dict *scripts; /* Scripts seen through EVAL, by sha1 */
 } proxyContext;
 
 typedef struct redisAddr {
@@ -28,11 +39,36 @@ typedef struct redisAddr {
     int port;
 } redisAddr;
 
+/* Arguments kept on the stack while dispatching a command, and room for the
+ * arguments proxyCommand and proxyAsyncCommand format on the stack. */
+#define PROXY_STACK_ARGS 16
+#define PROXY_STACK_BUF 1024
+
+/* A batch of commands sent in a single round trip to every server, see
+ * proxyPipelineExec. Commands are sent as they are appended; Exec has to be
+ * called even when appending fails, it reads the pending replies. */
+typedef struct proxyPipeline proxyPipeline;
+
+/* Callback for proxyScanAll: receives each batch of keys as an array reply. */
+typedef void (proxyScanCallback)(proxyContext *p, redisReply *keys, void *privdata);
+
 proxyContext *proxyConnect( redisAddr *addrs, int count );
+proxyContext *proxyContextWithConnections( redisAddr *addrs, redisContext **contexts, int count );
+redisContext *lookupRedisServerWithKey( proxyContext *p, const char *key );
+redisContext *lookupRedisServerWithKeyLen( proxyContext *p, const char *key, size_t len );
+void *proxyvCommand( proxyContext *p, const char *format, va_list ap );
 void *proxyCommand(proxyContext *p, const char *format, ...);
+void *proxyCommandArgv( proxyContext *p, int argc, const char **argv, const size_t *argvlen );
 redisContext *getRedisContext( proxyContext *p, int idx );
 void destroyProxyContext(proxyContext *p);
 void *proxyCommandArgvList(proxyContext *p, redisContext *c, int argc, const char **argv); 
+redisColumns *proxyMGetColumnar( proxyContext *p, int count, const char **keys, const size_t *keylens );
+proxyPipeline *proxyPipelineBegin( proxyContext *p );
+int proxyvPipelineAppend( proxyPipeline *pp, const char *format, va_list ap );
+int proxyPipelineAppend( proxyPipeline *pp, const char *format, ... );
+int proxyPipelineAppendArgv( proxyPipeline *pp, int argc, const char **argv, const size_t *argvlen );
+redisReply *proxyPipelineExec( proxyPipeline *pp );
+int proxyScanAll(proxyContext *p, const char *pattern, int count, proxyScanCallback *fn, void *privdata);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,65 @@
+#include <cstdio>
+#include <climits>
+#include <cstring>
+#include <string>
+
+#include "hiredis.hpp"
+
+/* Same testing "framework" as test.c */
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+static constexpr char SET[] = "SET";
+static constexpr char PING[] = "PING";
+
+/* The prefix is built by the compiler. */
+static_assert(hiredis::detail::prefix<SET,3>::size == 13, "prefix length");
+static_assert(hiredis::detail::prefix<SET,3>::value[1] == '3', "prefix argc");
+
+int main(void) {
+    std::string key("a\0b",3);
+    std::string big(1000,'x');
+    char *cmd;
+    int len;
+
+    test("Format command with an integer argument: ");
+    test_cond(hiredis::cmd<SET>("key",42).str() ==
+        "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$2\r\n42\r\n");
+
+    test("Format command with a binary key: ");
+    test_cond(hiredis::cmd<SET>(key,42).str() ==
+        std::string("*3\r\n$3\r\nSET\r\n$3\r\na\0b\r\n$2\r\n42\r\n",30));
+
+    test("Format command without arguments: ");
+    test_cond(hiredis::cmd<PING>().str() == "*1\r\n$4\r\nPING\r\n");
+
+    test("Format command with the extreme integers: ");
+    test_cond(hiredis::cmd<SET>(LLONG_MIN,ULLONG_MAX).str() ==
+        "*3\r\n$3\r\nSET\r\n$20\r\n-9223372036854775808\r\n$20\r\n18446744073709551615\r\n");
+
+    test("Format command the same as redisFormatCommand: ");
+    len = redisFormatCommand(&cmd,"SET %b %b",key.data(),key.size(),big.data(),big.size());
+    test_cond(hiredis::cmd<SET>(key,big).str() == std::string(cmd,len));
+    free(cmd);
+
+    /* The context never connects, appending only fills its output buffer. */
+    test("Append command to the output buffer: ");
+    redisContext *c = redisConnectUnix("/tmp/hiredis-hpp-test-nonexistent.sock");
+    hiredis::append(c,hiredis::cmd<SET>(key,42));
+    hiredis::append(c,hiredis::cmd<SET>(key,big));
+    len = redisFormatCommand(&cmd,"SET %b %b",key.data(),key.size(),big.data(),big.size());
+    std::string expected = hiredis::cmd<SET>(key,42).str() + std::string(cmd,len);
+    test_cond(memcmp(c->obuf,expected.data(),expected.size()) == 0 &&
+        c->obuf[expected.size()] == '\0');
+    free(cmd);
+    redisFree(c);
+
+    if (fails) {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
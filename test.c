@@ -8,8 +8,12 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 
 #include "hiredis.h"
+#include "sds.h"
+#include "proxy-async.h"
 
 enum connection_type {
     CONN_TCP,
@@ -186,6 +190,51 @@ static void test_format_commands(void) {
     len = redisFormatCommand(&cmd,"key:%08p %b",(void*)1234,"foo",3);
     test_cond(len == -1);
 
+    test("Format command with incomplete printf format: ");
+    len = redisFormatCommand(&cmd,"key:%08");
+    test_cond(len == -1);
+
+    test("Format command with a compiled format: ");
+    {
+        redisFormat *f = redisFormatCompile("SET key:%d \"a b\" %b%%");
+        int ok;
+        len = redisFormatCompiledCommand(&cmd,f,12,"b\0r",(size_t)3);
+        ok = (len == 4+4+(3+2)+4+(6+2)+4+(3+2)+4+(4+2) &&
+              memcmp(cmd,"*4\r\n$3\r\nSET\r\n$6\r\nkey:12\r\n$3\r\na b\r\n$4\r\nb\0r%\r\n",len) == 0);
+        free(cmd);
+        len = redisFormatCompiledCommand(&cmd,f,7,"",(size_t)0);
+        test_cond(ok && len == 4+4+(3+2)+4+(5+2)+4+(3+2)+4+(1+2) &&
+            memcmp(cmd,"*4\r\n$3\r\nSET\r\n$5\r\nkey:7\r\n$3\r\na b\r\n$1\r\n%\r\n",len) == 0);
+        free(cmd);
+        redisFormatFree(f);
+    }
+
+    test("Compiling an invalid format fails: ");
+    test_cond(redisFormatCompile("key:%08p") == NULL &&
+              redisFormatCompile("GET \"foo") == NULL);
+
+    test("Format command with a format buffer reused for another format: ");
+    {
+        char fmt[16];
+        int ok = 1, i;
+        /* The format is compiled on its second use, the third one is a hit. */
+        strcpy(fmt,"GET %s");
+        for (i = 0; i < 3; i++) {
+            len = redisFormatCommand(&cmd,fmt,"foo");
+            ok &= (len == 4+4+(3+2)+4+(3+2) &&
+                   memcmp(cmd,"*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n",len) == 0);
+            free(cmd);
+        }
+        strcpy(fmt,"SET %s %s");
+        for (i = 0; i < 3; i++) {
+            len = redisFormatCommand(&cmd,fmt,"foo","bar");
+            ok &= (len == 4+4+(3+2)+4+(3+2)+4+(3+2) &&
+                   memcmp(cmd,"*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$3\r\nbar\r\n",len) == 0);
+            free(cmd);
+        }
+        test_cond(ok);
+    }
+
     const char *argv[3];
     argv[0] = "SET";
     argv[1] = "foo\0xxx";
@@ -204,8 +253,74 @@ static void test_format_commands(void) {
     test_cond(strncmp(cmd,"*3\r\n$3\r\nSET\r\n$7\r\nfoo\0xxx\r\n$3\r\nbar\r\n",len) == 0 &&
         len == 4+4+(3+2)+4+(7+2)+4+(3+2));
     free(cmd);
+
+    test("Format command into a caller buffer: ");
+    {
+        char buf[64];
+        memset(buf,'#',sizeof(buf));
+        len = redisFormatCommandArgvBuf(buf,10,argc,argv,lens);
+        assert(len == 4+4+(3+2)+4+(7+2)+4+(3+2) && buf[0] == '#');
+        len = redisFormatCommandArgvBuf(buf,len,argc,argv,lens);
+        test_cond(len == 4+4+(3+2)+4+(7+2)+4+(3+2) && buf[len] == '#' &&
+            memcmp(buf,"*3\r\n$3\r\nSET\r\n$7\r\nfoo\0xxx\r\n$3\r\nbar\r\n",len) == 0);
+    }
+
+    test("Format command with argument lengths of every width: ");
+    {
+        static char arg[100001];
+        const char *bigargv[20];
+        size_t biglens[20], j, off;
+        char expect[64];
+        int ok;
+        memset(arg,'a',sizeof(arg));
+        for (j = 0; j < 20; j++) {
+            bigargv[j] = arg;
+            biglens[j] = (size_t[]){0,1,9,10,11,99,100,101,999,1000,1001,
+                9999,10000,10001,12345,99999,100000,100001,54321,7}[j];
+        }
+        len = redisFormatCommandArgv(&cmd,20,bigargv,biglens);
+        ok = (strncmp(cmd,"*20\r\n",5) == 0);
+        for (j = 0, off = 5; ok && j < 20; j++) {
+            int hdr = sprintf(expect,"$%zu\r\n",biglens[j]);
+            ok = (memcmp(cmd+off,expect,hdr) == 0 &&
+                  memcmp(cmd+off+hdr+biglens[j],"\r\n",2) == 0);
+            off += hdr+biglens[j]+2;
+        }
+        test_cond(ok && (size_t)len == off);
+        free(cmd);
+    }
+}
+
+/* Streaming callbacks that log every item to a string. */
+static void stream_begin(void *privdata, int depth, int elements) {
+    char *log = privdata;
+    sprintf(log+strlen(log),"%d[%d ",depth,elements);
+}
+
+static void stream_end(void *privdata, int depth) {
+    char *log = privdata;
+    sprintf(log+strlen(log),"%d] ",depth);
 }
 
+static void stream_string(void *privdata, int depth, int type, const char *str, size_t len) {
+    char *log = privdata;
+    sprintf(log+strlen(log),"%d%c%.*s ",depth,type == REDIS_REPLY_STRING ? '$' : '+',(int)len,str);
+}
+
+static void stream_integer(void *privdata, int depth, long long value) {
+    char *log = privdata;
+    sprintf(log+strlen(log),"%d:%lld ",depth,value);
+}
+
+static void stream_nil(void *privdata, int depth) {
+    char *log = privdata;
+    sprintf(log+strlen(log),"%dnil ",depth);
+}
+
+static redisReplyCallbacks stream_callbacks = {
+    stream_begin, stream_end, stream_string, stream_integer, stream_nil
+};
+
 static void test_reply_reader(void) {
     redisReader *reader;
     void *reply;
@@ -263,6 +378,47 @@ static void test_reply_reader(void) {
     test_cond(ret == REDIS_OK && reply == (void*)REDIS_REPLY_STATUS);
     redisReaderFree(reader);
 
+    test("Finds the newline at every offset of a line: ");
+    {
+        char buf[128];
+        int ok = 1;
+        for (i = 0; i < 100; i++) {
+            int j;
+            buf[0] = '+';
+            for (j = 0; j < i; j++)
+                buf[1+j] = (j % 7 == 3) ? '\r' : 'a';
+            memcpy(buf+1+i,"\r\n",2);
+            reader = redisReaderCreate();
+            redisReaderFeed(reader,buf,i+3);
+            ret = redisReaderGetReply(reader,&reply);
+            if (ret != REDIS_OK || reply == NULL ||
+                ((redisReply*)reply)->len != i ||
+                memcmp(((redisReply*)reply)->str,buf+1,i) != 0)
+                ok = 0;
+            if (reply != NULL) freeReplyObject(reply);
+            redisReaderFree(reader);
+        }
+        test_cond(ok);
+    }
+
+    test("Works when a long line ends with a single \\r: ");
+    {
+        char buf[80];
+        memset(buf,'a',sizeof(buf));
+        buf[0] = '+';
+        buf[sizeof(buf)-1] = '\r';
+        reader = redisReaderCreate();
+        redisReaderFeed(reader,buf,sizeof(buf));
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK && reply == NULL);
+        redisReaderFeed(reader,(char*)"\n",1);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ret == REDIS_OK && reply != NULL &&
+            ((redisReply*)reply)->len == sizeof(buf)-2);
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
     test("Don't reset state after protocol error: ");
     reader = redisReaderCreate();
     reader->fn = NULL;
@@ -273,6 +429,292 @@ static void test_reply_reader(void) {
     test_cond(ret == REDIS_ERR && reply == NULL);
     redisReaderFree(reader);
 
+    test("Builds nested replies with the arena functions: ");
+    {
+        char big[2000];
+        redisReply *r;
+        memset(big,'x',sizeof(big));
+        reader = redisReaderCreate();
+        reader->fn = &redisArenaFunctions;
+        redisReaderFeed(reader,(char*)"*4\r\n$5\r\nhello\r\n*2\r\n:42\r\n$-1\r\n+OK\r\n",34);
+        redisReaderFeed(reader,(char*)"$2000\r\n",7);
+        redisReaderFeed(reader,big,sizeof(big));
+        redisReaderFeed(reader,(char*)"\r\n",2);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        test_cond(ret == REDIS_OK && r->type == REDIS_REPLY_ARRAY && r->elements == 4 &&
+            r->element[0]->type == REDIS_REPLY_STRING && strcmp(r->element[0]->str,"hello") == 0 &&
+            r->element[1]->elements == 2 && r->element[1]->element[0]->integer == 42 &&
+            r->element[1]->element[1]->type == REDIS_REPLY_NIL &&
+            r->element[2]->type == REDIS_REPLY_STATUS && strcmp(r->element[2]->str,"OK") == 0 &&
+            r->element[3]->len == 2000 && memcmp(r->element[3]->str,big,2000) == 0);
+        freeArenaReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
+    test("Builds large arrays with the arena functions: ");
+    {
+        int ok;
+        reader = redisReaderCreate();
+        reader->fn = &redisArenaFunctions;
+        redisReaderFeed(reader,(char*)"*5000\r\n",7);
+        for (i = 0; i < 5000; i++) {
+            char buf[32];
+            int len = sprintf(buf,":%d\r\n",i);
+            redisReaderFeed(reader,buf,len);
+        }
+        ret = redisReaderGetReply(reader,&reply);
+        ok = (ret == REDIS_OK && ((redisReply*)reply)->elements == 5000);
+        for (i = 0; ok && i < 5000; i++)
+            ok = ((redisReply*)reply)->element[i]->integer == i;
+        test_cond(ok);
+        freeArenaReplyObject(reply);
+
+        /* A partial reply is released by the reader on errors. */
+        redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n@",14);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_ERR);
+        redisReaderFree(reader);
+    }
+
+    test("Default replies own a separate string: ");
+    {
+        redisReply *r;
+        reader = redisReaderCreate();
+        redisReaderFeed(reader,(char*)"+OK\r\n",5);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        free(r->str);
+        r->str = strdup("replaced");
+        test_cond(ret == REDIS_OK && strcmp(r->str,"replaced") == 0);
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
+    test("Pooled replies store short strings inline: ");
+    {
+        redisReply *r;
+        char buf[128];
+        int ok = 1, len;
+        reader = redisReaderCreate();
+        reader->fn = &redisPooledFunctions;
+        for (i = 0; ok && i < 200; i++) {
+            len = sprintf(buf,"*2\r\n$%d\r\n%0*d\r\n+OK\r\n",i%50,i%50,0);
+            if (i%50 == 0) len = sprintf(buf,"*2\r\n$0\r\n\r\n+OK\r\n");
+            redisReaderFeed(reader,buf,len);
+            ret = redisReaderGetReply(reader,&reply);
+            r = reply;
+            ok = (ret == REDIS_OK && r->element[0]->len == i%50 &&
+                  strlen(r->element[0]->str) == (size_t)(i%50) &&
+                  strcmp(r->element[1]->str,"OK") == 0);
+            freePooledReplyObject(reply);
+        }
+        redisReaderFree(reader);
+        redisReplyPoolRelease();
+        test_cond(ok);
+    }
+
+    test("Pooled replies are free'd by freeReplyObject, also in default trees: ");
+    {
+        redisReply *r, *all;
+        reader = redisReaderCreate();
+        reader->fn = &redisPooledFunctions;
+        redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n:1\r\n",17);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        all = createReplyObject(REDIS_REPLY_ARRAY);
+        all->element = r->element;
+        all->elements = r->elements;
+        r->element = NULL;
+        r->elements = 0;
+        test_cond(ret == REDIS_OK && (r->flags & REDIS_REPLY_POOLED) &&
+                  (all->element[0]->flags & REDIS_REPLY_STR_INLINE) &&
+                  strcmp(all->element[0]->str,"foo") == 0 && all->flags == 0);
+        freeReplyObject(r);
+        freeReplyObject(all);
+        redisReaderFree(reader);
+    }
+
+    test("Builds compact replies: ");
+    {
+        redisCompactReply *r, *e;
+        char big[100];
+        memset(big,'x',sizeof(big));
+        reader = redisReaderCreate();
+        reader->fn = &redisCompactFunctions;
+        redisReaderFeed(reader,(char*)"*4\r\n+OK\r\n*2\r\n:42\r\n$-1\r\n$100\r\n",29);
+        redisReaderFeed(reader,big,sizeof(big));
+        redisReaderFeed(reader,(char*)"\r\n$23\r\n01234567890123456789012\r\n",32);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        e = redisCompactElement(r,1);
+        test_cond(ret == REDIS_OK && sizeof(redisCompactReply) == 32 &&
+            redisCompactType(r) == REDIS_REPLY_ARRAY && redisCompactElements(r) == 4 &&
+            redisCompactType(redisCompactElement(r,0)) == REDIS_REPLY_STATUS &&
+            strcmp(redisCompactStr(redisCompactElement(r,0)),"OK") == 0 &&
+            redisCompactElements(e) == 2 && redisCompactInteger(redisCompactElement(e,0)) == 42 &&
+            redisCompactType(redisCompactElement(e,1)) == REDIS_REPLY_NIL &&
+            redisCompactLen(redisCompactElement(r,2)) == 100 &&
+            memcmp(redisCompactStr(redisCompactElement(r,2)),big,100) == 0 &&
+            strcmp(redisCompactStr(redisCompactElement(r,3)),"01234567890123456789012") == 0);
+        freeCompactReplyObject(reply);
+
+        /* A partial reply is released by the reader on errors. */
+        redisReaderFeed(reader,(char*)"*3\r\n$30\r\n012345678901234567890123456789\r\n*2\r\n+OK\r\n@",51);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_ERR);
+        redisReaderFree(reader);
+    }
+
+    test("Decodes arrays into columns: ");
+    {
+        redisColumns *c;
+        reader = redisReaderCreate();
+        reader->fn = &redisColumnarFunctions;
+        redisReaderFeed(reader,(char*)"*4\r\n$5\r\nhello\r\n$-1\r\n:42\r\n$0\r\n\r\n-ERR x\r\n",40);
+        ret = redisReaderGetReply(reader,&reply);
+        c = reply;
+        test_cond(ret == REDIS_OK && c->type == REDIS_REPLY_ARRAY && c->count == 4 &&
+            !redisColumnsIsNil(c,0) && c->len[0] == 5 && strcmp(redisColumnsValue(c,0),"hello") == 0 &&
+            redisColumnsIsNil(c,1) && strcmp(redisColumnsValue(c,2),"42") == 0 &&
+            !redisColumnsIsNil(c,3) && c->len[3] == 0);
+        freeColumnsObject(reply);
+        ret = redisReaderGetReply(reader,&reply);
+        c = reply;
+        assert(ret == REDIS_OK && c->type == REDIS_REPLY_ERROR && strcmp(redisColumnsValue(c,0),"ERR x") == 0);
+        freeColumnsObject(reply);
+        redisReaderFree(reader);
+    }
+
+    test("Zero-copy strings outlive the reader buffer: ");
+    {
+        redisReply *r1, *r2;
+        reader = redisReaderCreate();
+        reader->zerocopy = 4;
+        redisReaderFeed(reader,(char*)"*2\r\n$5\r\nhello\r\n$2\r\nhi\r\n$6\r\nwo",29);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK);
+        r1 = reply;
+        redisReaderFeed(reader,(char*)"rld!\r\n",6);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK);
+        r2 = reply;
+        redisReaderFree(reader);
+        test_cond(r1->element[0]->buffer != NULL && strcmp(r1->element[0]->str,"hello") == 0 &&
+            r1->element[1]->buffer != r1->element[0]->buffer && strcmp(r1->element[1]->str,"hi") == 0 &&
+            r2->buffer != NULL && r2->len == 6 && strcmp(r2->str,"world!") == 0);
+        freeReplyObject(r1);
+        freeReplyObject(r2);
+    }
+
+    test("Receives large bulks fed in pieces: ");
+    {
+        char big[100];
+        redisReply *r;
+        int ok;
+        for (i = 0; i < 100; i++)
+            big[i] = 'a'+(i%26);
+        reader = redisReaderCreate();
+        reader->bigbulk = 16;
+        redisReaderFeed(reader,(char*)"*2\r\n$100\r\n",10);
+        redisReaderFeed(reader,big,30);
+        ret = redisReaderGetReply(reader,&reply);
+        ok = (ret == REDIS_OK && reply == NULL && reader->bulk != NULL);
+        redisReaderFeed(reader,big+30,70);
+        redisReaderFeed(reader,(char*)"\r",1);
+        ret = redisReaderGetReply(reader,&reply);
+        ok = ok && (ret == REDIS_OK && reply == NULL);
+        redisReaderFeed(reader,(char*)"\n$3\r\nfoo\r\n",10);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        test_cond(ok && ret == REDIS_OK && r != NULL && r->elements == 2 &&
+            r->element[0]->len == 100 && memcmp(r->element[0]->str,big,100) == 0 &&
+            r->element[0]->str[100] == '\0' && strcmp(r->element[1]->str,"foo") == 0);
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
+    test("Parses input written through reserve/commit: ");
+    {
+        size_t avail;
+        char *dst;
+        int ok = 1;
+        reader = redisReaderCreate();
+        for (i = 0; i < 1000; i++) {
+            char buf[32];
+            int len = sprintf(buf,"$%d\r\n%d\r\n",(i<10)?1:(i<100)?2:3,i);
+            dst = redisReaderReserve(reader,len,&avail);
+            assert(dst != NULL && avail >= (size_t)len);
+            memcpy(dst,buf,len);
+            redisReaderCommit(reader,len);
+        }
+        for (i = 0; ok && i < 1000; i++) {
+            ret = redisReaderGetReply(reader,&reply);
+            ok = (ret == REDIS_OK && reply != NULL && atoi(((redisReply*)reply)->str) == i);
+            if (reply != NULL) freeReplyObject(reply);
+        }
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ok && ret == REDIS_OK && reply == NULL && reader->pos == 0 && reader->len == 0);
+        redisReaderFree(reader);
+    }
+
+    test("Streams replies to callbacks as they arrive: ");
+    {
+        const char *proto = "*4\r\n$5\r\nhello\r\n*3\r\n:42\r\n*0\r\n$-1\r\n+OK\r\n*-1\r\n:7\r\n";
+        char log[256] = "";
+        int ok = 1;
+        reader = redisReaderCreate();
+        reader->privdata = log;
+        redisReaderSetCallbacks(reader,&stream_callbacks);
+        for (i = 0; proto[i] != '\0'; i++) {
+            redisReaderFeed(reader,proto+i,1);
+            ret = redisReaderGetReply(reader,&reply);
+            ok = ok && ret == REDIS_OK;
+            /* Items are reported before the reply is complete. */
+            if (i == 14) ok = ok && strcmp(log,"0[4 1$hello ") == 0;
+        }
+        test_cond(ok && reply == (void*)REDIS_REPLY_INTEGER && strcmp(log,
+            "0[4 1$hello 1[3 2:42 2[0 2] 2nil 1] 1+OK 1nil 0] 0:7 ") == 0);
+        redisReaderFree(reader);
+    }
+
+    test("Parses the 64 bit integer limits: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*3\r\n:9223372036854775807\r\n:-9223372036854775808\r\n:-1234567890123\r\n",66);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK &&
+        ((redisReply*)reply)->element[0]->integer == LLONG_MAX &&
+        ((redisReply*)reply)->element[1]->integer == LLONG_MIN &&
+        ((redisReply*)reply)->element[2]->integer == -1234567890123LL);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Set error on integer overflow: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":9223372036854775808\r\n",22);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcasecmp(reader->errstr,"Bad integer value") == 0);
+    redisReaderFree(reader);
+
+    test("Set error on invalid integer: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)":12345678a\r\n",12);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcasecmp(reader->errstr,"Bad integer value") == 0);
+    redisReaderFree(reader);
+
+    test("Set error on invalid bulk and multi-bulk lengths: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"$1x\r\n",5);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_ERR && strcasecmp(reader->errstr,"Bad bulk string length") == 0);
+    redisReaderFree(reader);
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*-2\r\n",5);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_ERR && strcasecmp(reader->errstr,"Bad multi-bulk length") == 0);
+    redisReaderFree(reader);
+
     /* Regression test for issue #45 on GitHub. */
     test("Don't do empty allocation for empty multi bulk: ");
     reader = redisReaderCreate();
@@ -307,6 +749,10 @@ static void test_blocking_connection_errors(void) {
     redisFree(c);
 }
 
+static void test_release(void *privdata) {
+    (*(int*)privdata)++;
+}
+
 static void test_blocking_connection(struct config config) {
     redisContext *c;
     redisReply *reply;
@@ -344,6 +790,23 @@ static void test_blocking_connection(struct config config) {
     test_cond(reply->len == 11)
     freeReplyObject(reply);
 
+    test("Writes borrowed argument buffers: ");
+    {
+        static char big[REDIS_OUTPUT_BORROW_MIN*4];
+        const char *argv[3] = { "SET", "foo", big };
+        size_t lens[3] = { 3, 3, sizeof(big) };
+        int released = 0;
+        memset(big,'x',sizeof(big));
+        redisAppendCommandArgvBorrowed(c,3,argv,lens,test_release,&released);
+        assert(released == 0 && c->orefslen == 1 && strlen(c->obuf) < 64);
+        assert(redisGetReply(c,(void**)&reply) == REDIS_OK);
+        freeReplyObject(reply);
+        reply = redisCommand(c,"GET foo");
+        test_cond(released == 1 && c->orefslen == 0 && reply->type == REDIS_REPLY_STRING &&
+            reply->len == (int)sizeof(big) && memcmp(reply->str,big,sizeof(big)) == 0);
+        freeReplyObject(reply);
+    }
+
     test("Can parse nil replies: ");
     reply = redisCommand(c,"GET nokey");
     test_cond(reply->type == REDIS_REPLY_NIL)
@@ -436,6 +899,337 @@ static void test_blocking_io_errors(struct config config) {
     redisFree(c);
 }
 
+static proxyContext *proxy_connect(struct config config) {
+    redisAddr addr = { config.tcp.host, config.tcp.port };
+    proxyContext *p = proxyConnect(&addr,1);
+
+    if (p == NULL || p->contexts[0] == NULL || p->contexts[0]->err) {
+        printf("Proxy connection error\n");
+        exit(1);
+    }
+
+    select_database(p->contexts[0]);
+    return p;
+}
+
+static void proxy_disconnect(proxyContext *p) {
+    redisReply *reply;
+
+    reply = redisCommand(p->contexts[0],"FLUSHDB");
+    assert(reply != NULL);
+    freeReplyObject(reply);
+    destroyProxyContext(p);
+}
+
+static int reply_is_string(redisReply *reply, const char *str) {
+    return reply->type == REDIS_REPLY_STRING && strcmp(reply->str,str) == 0;
+}
+
+static void test_proxy_pipeline(struct config config) {
+    proxyContext *p = proxy_connect(config);
+    proxyPipeline *pp;
+    redisReply *reply;
+
+    test("Pipelined replies come back in submission order: ");
+    pp = proxyPipelineBegin(p);
+    proxyPipelineAppend(pp,"SET foo 1");
+    proxyPipelineAppend(pp,"INCR foo");
+    proxyPipelineAppend(pp,"GET foo");
+    proxyPipelineAppend(pp,"INCR foo");
+    reply = proxyPipelineExec(pp);
+    test_cond(reply->type == REDIS_REPLY_ARRAY && reply->elements == 4 &&
+        reply->element[0]->type == REDIS_REPLY_STATUS &&
+        reply->element[1]->type == REDIS_REPLY_INTEGER && reply->element[1]->integer == 2 &&
+        reply_is_string(reply->element[2],"2") &&
+        reply->element[3]->type == REDIS_REPLY_INTEGER && reply->element[3]->integer == 3);
+    freeReplyObject(reply);
+
+    test("Pipelined MGET returns the values in key order: ");
+    pp = proxyPipelineBegin(p);
+    proxyPipelineAppend(pp,"MSET a 1 b 2 c 3");
+    proxyPipelineAppend(pp,"MGET c nokey a b");
+    reply = proxyPipelineExec(pp);
+    test_cond(reply->elements == 2 &&
+        reply->element[1]->type == REDIS_REPLY_ARRAY &&
+        reply->element[1]->elements == 4 &&
+        reply_is_string(reply->element[1]->element[0],"3") &&
+        reply->element[1]->element[1]->type == REDIS_REPLY_NIL &&
+        reply_is_string(reply->element[1]->element[2],"1") &&
+        reply_is_string(reply->element[1]->element[3],"2"));
+    freeReplyObject(reply);
+
+    test("Pipelined DEL returns the number of removed keys: ");
+    pp = proxyPipelineBegin(p);
+    proxyPipelineAppend(pp,"DEL a nokey b c");
+    proxyPipelineAppend(pp,"EXISTS a");
+    reply = proxyPipelineExec(pp);
+    test_cond(reply->elements == 2 &&
+        reply->element[0]->type == REDIS_REPLY_INTEGER && reply->element[0]->integer == 3 &&
+        reply->element[1]->type == REDIS_REPLY_INTEGER && reply->element[1]->integer == 0);
+    freeReplyObject(reply);
+
+    test("Pipelined EVAL sees the commands before it only: ");
+    pp = proxyPipelineBegin(p);
+    proxyPipelineAppend(pp,"SET foo bar");
+    proxyPipelineAppend(pp,"EVAL %s 1 %s","return redis.call('get',KEYS[1])","foo");
+    proxyPipelineAppend(pp,"SET foo baz");
+    proxyPipelineAppend(pp,"GET foo");
+    reply = proxyPipelineExec(pp);
+    test_cond(reply->elements == 4 &&
+        reply->element[0]->type == REDIS_REPLY_STATUS &&
+        reply_is_string(reply->element[1],"bar") &&
+        reply->element[2]->type == REDIS_REPLY_STATUS &&
+        reply_is_string(reply->element[3],"baz"));
+    freeReplyObject(reply);
+
+    proxy_disconnect(p);
+}
+
+/* Set members come back in no particular order. */
+static int reply_has_members(redisReply *reply, const char *members) {
+    char buf[64], *m, *saveptr;
+    size_t count = 0;
+
+    if (reply->type != REDIS_REPLY_ARRAY) return 0;
+    snprintf(buf,sizeof(buf),"%s",members);
+    for (m = strtok_r(buf," ",&saveptr); m; m = strtok_r(NULL," ",&saveptr)) {
+        size_t i;
+        for (i = 0; i < reply->elements; i++)
+            if (reply_is_string(reply->element[i],m)) break;
+        if (i == reply->elements) return 0;
+        count++;
+    }
+    return count == reply->elements;
+}
+
+static void test_proxy_set_commands(struct config config) {
+    proxyContext *p = proxy_connect(config);
+    redisReply *reply;
+    int stored;
+
+    freeReplyObject(proxyCommand(p,"SADD s1 a b c d"));
+    freeReplyObject(proxyCommand(p,"SADD s2 c d e"));
+
+    test("Proxy SUNION returns the members of all sets: ");
+    reply = proxyCommand(p,"SUNION s1 s2 nokey");
+    test_cond(reply_has_members(reply,"a b c d e"));
+    freeReplyObject(reply);
+
+    test("Proxy SINTER returns the common members: ");
+    reply = proxyCommand(p,"SINTER s1 s2");
+    test_cond(reply_has_members(reply,"c d"));
+    freeReplyObject(reply);
+
+    test("Proxy SDIFF returns the members of the first set only: ");
+    reply = proxyCommand(p,"SDIFF s1 s2");
+    test_cond(reply_has_members(reply,"a b"));
+    freeReplyObject(reply);
+
+    test("Proxy SUNIONSTORE stores the union: ");
+    reply = proxyCommand(p,"SUNIONSTORE dst s1 s2");
+    stored = reply->type == REDIS_REPLY_INTEGER && reply->integer == 5;
+    freeReplyObject(reply);
+    reply = proxyCommand(p,"SMEMBERS dst");
+    test_cond(stored && reply_has_members(reply,"a b c d e"));
+    freeReplyObject(reply);
+
+    test("Proxy SINTERSTORE stores the intersection: ");
+    reply = proxyCommand(p,"SINTERSTORE dst s1 s2");
+    stored = reply->type == REDIS_REPLY_INTEGER && reply->integer == 2;
+    freeReplyObject(reply);
+    reply = proxyCommand(p,"SMEMBERS dst");
+    test_cond(stored && reply_has_members(reply,"c d"));
+    freeReplyObject(reply);
+
+    test("Proxy SDIFFSTORE stores the difference: ");
+    reply = proxyCommand(p,"SDIFFSTORE dst s1 s2");
+    stored = reply->type == REDIS_REPLY_INTEGER && reply->integer == 2;
+    freeReplyObject(reply);
+    reply = proxyCommand(p,"SMEMBERS dst");
+    test_cond(stored && reply_has_members(reply,"a b"));
+    freeReplyObject(reply);
+
+    test("Proxy SINTER with a missing set is empty: ");
+    reply = proxyCommand(p,"SINTER s1 nokey");
+    test_cond(reply->type == REDIS_REPLY_ARRAY && reply->elements == 0);
+    freeReplyObject(reply);
+
+    test("Proxy SINTERSTORE of an empty intersection removes the destination: ");
+    reply = proxyCommand(p,"SINTERSTORE dst s1 nokey");
+    stored = reply->type == REDIS_REPLY_INTEGER && reply->integer == 0;
+    freeReplyObject(reply);
+    reply = proxyCommand(p,"EXISTS dst");
+    test_cond(stored && reply->type == REDIS_REPLY_INTEGER && reply->integer == 0);
+    freeReplyObject(reply);
+
+    proxy_disconnect(p);
+}
+
+/* A minimal event loop for the async proxy tests, driving the connection
+ * to a single server with poll(2). */
+typedef struct test_events {
+    redisAsyncContext *ac;
+    int reading, writing;
+    long long timer; /* When the timer fires, 0 when none is pending */
+} test_events;
+
+static void test_add_read(void *privdata) { ((test_events*)privdata)->reading = 1; }
+static void test_del_read(void *privdata) { ((test_events*)privdata)->reading = 0; }
+static void test_add_write(void *privdata) { ((test_events*)privdata)->writing = 1; }
+static void test_del_write(void *privdata) { ((test_events*)privdata)->writing = 0; }
+static void test_cleanup(void *privdata) { ((test_events*)privdata)->ac = NULL; }
+
+static void test_schedule_timer(void *privdata, long long us) {
+    ((test_events*)privdata)->timer = usec()+us;
+}
+
+static void test_attach(test_events *e, redisAsyncContext *ac) {
+    e->ac = ac;
+    e->reading = e->writing = 0;
+    e->timer = 0;
+    ac->ev.addRead = test_add_read;
+    ac->ev.delRead = test_del_read;
+    ac->ev.addWrite = test_add_write;
+    ac->ev.delWrite = test_del_write;
+    ac->ev.cleanup = test_cleanup;
+    ac->ev.scheduleTimer = test_schedule_timer;
+    ac->ev.data = e;
+}
+
+static void test_loop_once(test_events *e) {
+    struct pollfd pfd;
+    long long now = usec();
+    int ms = 10;
+
+    if (e->ac == NULL) return;
+    if (e->timer) {
+        if (e->timer <= now) {
+            e->timer = 0;
+            redisAsyncHandleTimer(e->ac);
+            return;
+        }
+        if (e->timer-now < ms*1000) ms = (e->timer-now+999)/1000;
+    }
+
+    pfd.fd = e->ac->c.fd;
+    pfd.events = (e->reading ? POLLIN : 0) | (e->writing ? POLLOUT : 0);
+    if (poll(&pfd,1,ms) <= 0) return;
+    if (pfd.revents & POLLOUT) redisAsyncHandleWrite(e->ac);
+    if (e->ac && (pfd.revents & (POLLIN|POLLHUP|POLLERR))) redisAsyncHandleRead(e->ac);
+}
+
+/* Run the loop until *counter reaches target, for at most a second. */
+static int test_loop_until(test_events *e, int *counter, int target) {
+    long long deadline = usec()+1000000;
+    while (*counter < target && e->ac != NULL && usec() < deadline)
+        test_loop_once(e);
+    return *counter >= target;
+}
+
+static int __proxy_replies, __proxy_nulls, __proxy_bad;
+
+/* The privdata is the expected string, NULL for a nil reply. */
+static void __test_proxy_callback(proxyAsyncContext *pac, void *r, void *privdata) {
+    redisReply *reply = r;
+    const char *expected = privdata;
+    (void)pac;
+
+    __proxy_replies++;
+    if (reply == NULL)
+        __proxy_nulls++;
+    else if (expected == NULL ? reply->type != REDIS_REPLY_NIL :
+             reply->type != REDIS_REPLY_STRING || strcmp(reply->str,expected) != 0)
+        __proxy_bad++;
+}
+
+static void test_proxy_async_batching(struct config config) {
+    redisAddr addr = { config.tcp.host, config.tcp.port };
+    proxyAsyncContext *pac;
+    redisAsyncContext *ac;
+    test_events e;
+    int i;
+
+    pac = proxyAsyncConnect(&addr,1);
+    assert(pac != NULL && proxyAsyncGetContext(pac,0) != NULL);
+    ac = proxyAsyncGetContext(pac,0);
+    test_attach(&e,ac);
+
+    /* Nothing is queued yet, this arms the write that completes the
+     * connect and switches to DB 9 like the blocking tests. */
+    __proxy_replies = 0;
+    proxyAsyncCommand(pac,NULL,NULL,"SELECT 9");
+    proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET foo");
+    assert(test_loop_until(&e,&__proxy_replies,1) && __proxy_bad == 0);
+
+    test("Batched commands are written when the queue reaches its depth: ");
+    __proxy_replies = __proxy_nulls = __proxy_bad = 0;
+    proxyAsyncSetBatch(pac,4,0,0);
+    proxyAsyncCommand(pac,NULL,NULL,"SET foo bar");
+    proxyAsyncCommand(pac,NULL,NULL,"SET bar baz");
+    proxyAsyncCommand(pac,__test_proxy_callback,(char*)"bar","GET foo");
+    {
+        size_t queued = sdslen(ac->c.obuf);
+        proxyAsyncCommand(pac,__test_proxy_callback,(char*)"baz","GET bar");
+        test_cond(queued == 0 && sdslen(ac->c.obuf) > 0 &&
+            test_loop_until(&e,&__proxy_replies,2) &&
+            __proxy_nulls == 0 && __proxy_bad == 0);
+    }
+
+    test("Merged GETs are handed their own element of the MGET reply: ");
+    __proxy_replies = __proxy_nulls = __proxy_bad = 0;
+    proxyAsyncSetBatch(pac,3,0,1);
+    proxyAsyncCommand(pac,__test_proxy_callback,(char*)"bar","GET foo");
+    proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET nokey");
+    proxyAsyncCommand(pac,__test_proxy_callback,(char*)"baz","GET bar");
+    test_cond(strncmp(ac->c.obuf,"*4\r\n$4\r\nMGET",12) == 0 &&
+        test_loop_until(&e,&__proxy_replies,3) &&
+        __proxy_nulls == 0 && __proxy_bad == 0);
+
+    test("Batched commands are written when the window is over: ");
+    __proxy_replies = __proxy_nulls = __proxy_bad = 0;
+    proxyAsyncSetBatch(pac,100,10000,1);
+    proxyAsyncCommand(pac,__test_proxy_callback,(char*)"bar","GET foo");
+    proxyAsyncCommand(pac,__test_proxy_callback,(char*)"baz","GET bar");
+    test_cond(sdslen(ac->c.obuf) == 0 && e.timer != 0 &&
+        test_loop_until(&e,&__proxy_replies,2) &&
+        __proxy_nulls == 0 && __proxy_bad == 0);
+
+    /* Queued commands are never sent on free, so clean up first. */
+    __proxy_replies = 0;
+    proxyAsyncSetBatch(pac,0,0,0);
+    proxyAsyncCommand(pac,NULL,NULL,"FLUSHDB");
+    proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET foo");
+    assert(test_loop_until(&e,&__proxy_replies,1));
+
+    test("Queued commands get a NULL reply when the proxy is free'd: ");
+    __proxy_replies = __proxy_nulls = __proxy_bad = 0;
+    proxyAsyncSetBatch(pac,100,0,0);
+    for (i = 0; i < 3; i++)
+        proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET foo");
+    assert(__proxy_replies == 0);
+    proxyAsyncFree(pac);
+    test_cond(__proxy_replies == 3 && __proxy_nulls == 3);
+
+    test("Queued commands get a NULL reply when the connection is lost: ");
+    pac = proxyAsyncConnect(&addr,1);
+    assert(pac != NULL && proxyAsyncGetContext(pac,0) != NULL);
+    ac = proxyAsyncGetContext(pac,0);
+    test_attach(&e,ac);
+    __proxy_replies = 0;
+    proxyAsyncCommand(pac,NULL,NULL,"SELECT 9");
+    proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET foo");
+    assert(test_loop_until(&e,&__proxy_replies,1));
+    __proxy_replies = __proxy_nulls = __proxy_bad = 0;
+    proxyAsyncSetBatch(pac,100,0,0);
+    for (i = 0; i < 3; i++)
+        proxyAsyncCommand(pac,__test_proxy_callback,NULL,"GET foo");
+    redisAsyncDisconnect(ac);
+    test_loop_until(&e,&__proxy_replies,3);
+    test_cond(__proxy_replies == 3 && __proxy_nulls == 3 &&
+        proxyAsyncGetContext(pac,0) == NULL);
+    proxyAsyncFree(pac);
+}
+
 static void test_throughput(struct config config) {
     redisContext *c = connect(config);
     redisReply **replies;
@@ -644,6 +1438,9 @@ int main(int argc, char **argv) {
     cfg.type = CONN_TCP;
     test_blocking_connection(cfg);
     test_blocking_io_errors(cfg);
+    test_proxy_set_commands(cfg);
+    test_proxy_pipeline(cfg);
+    test_proxy_async_batching(cfg);
     if (throughput) test_throughput(cfg);
 
     printf("\nTesting against Unix socket connection (%s):\n", cfg.unix.path);